@@ -4,66 +4,157 @@
 
 #include "def.h"
 
-pthread_mutex_t mutex_for_fs_stat;
+//initialize a file system (volume) with the in-place layout and return its handle, or NULL if it fails;
+//should be called as the first thing before accessing the file system;
+//each handle is independent, so a process can run many volumes side by side
+struct rsfs *rsfs_init(){
+    return rsfs_format(RSFS_LAYOUT_INPLACE);
+}
+
+//initialize a file system (volume) whose data blocks are managed with layout:
+//RSFS_LAYOUT_INPLACE overwrites blocks where they are, RSFS_LAYOUT_LOG appends every change to a log (see log.c);
+//RSFS_LAYOUT_INPLACE | RSFS_MEMFD also keeps the medium and large blocks in a memfd, for rsfs_mmap() (see mmap.c);
+//return its handle, or NULL if it fails
+struct rsfs *rsfs_format(int layout){
+
+    int memfd = layout & RSFS_MEMFD;
+    layout &= ~RSFS_MEMFD;
+    if(layout!=RSFS_LAYOUT_INPLACE && layout!=RSFS_LAYOUT_LOG) return NULL;
+    if(memfd && layout==RSFS_LAYOUT_LOG) return NULL; //files of the log only have a tail, which can not be mapped
+
+    struct rsfs *fs = NULL;
+    if(posix_memalign((void **)&fs, 64, sizeof(struct rsfs))!=0){ //the stats slots are cache-line aligned
+        printf("[init] fails to allocate the file system\n");
+        return NULL;
+    }
+    memset(fs, 0, sizeof(struct rsfs));
+    static int next_id;
+    fs->id = __atomic_fetch_add(&next_id, 1, __ATOMIC_RELAXED);
+
+    if(memfd && memfd_init(fs)<0){
+        printf("[init] fails to create the memfd of the blocks\n");
+        rsfs_destroy(fs);
+        return NULL;
+    }
+    if(volume_setup(fs, layout)<0){
+        rsfs_destroy(fs);
+        return NULL;
+    }
+    return fs;
+}
 
-//initialize file system - should be called as the first thing before accessing this file system 
-int RSFS_init(){
+//initialize the zeroed volume fs with layout: its blocks, bitmaps, inodes, open file table and root directory;
+//fs->shm is set already for a shared volume (see shm.c), whose memory and locks then live in its segment;
+//return 0 if succeed, or -1 if it fails (the caller releases what was set up)
+int volume_setup(struct rsfs *fs, int layout){
+
+    fs->layout = layout;
 
     //initialize data blocks
     for(int i=0; i<NUM_DBLOCKS; i++){
-      void *block = malloc(BLOCK_SIZE); //a data block is allocated from memory
+      void *block = fs_alloc(fs, BLOCK_SIZE); //a data block is allocated from the volume's memory
       if(block==NULL){
         printf("[init] fails to init data_blocks\n");
         return -1;
       }
-      data_blocks[i] = block;  
+      fs->data_blocks[i] = block;  
     } 
 
     //initialize bitmaps
-    for(int i=0; i<NUM_DBLOCKS; i++) data_bitmap[i]=0;
-    pthread_mutex_init(&data_bitmap_mutex,NULL);
-    for(int i=0; i<NUM_INODES; i++) inode_bitmap[i]=0;
-    pthread_mutex_init(&inode_bitmap_mutex,NULL);    
+    for(int i=0; i<NUM_DBLOCKS; i++) fs->data_bitmap[i]=0;
+    fs->num_free_dblocks=NUM_DBLOCKS;
+    fs->num_reserved_dblocks=0;
+    init_mutex(fs, &fs->data_bitmap_mutex, 1);
+    for(int i=0; i<NUM_INODES; i++) fs->inode_bitmap[i]=0;
+    init_mutex(fs, &fs->inode_bitmap_mutex, 1);
+
+    //initialize the medium and large blocks; their memory is allocated as they are first used
+    init_mutex(fs, &fs->mmap_mutex, 1);
+    if(init_block_classes(fs)<0){
+        printf("[init] fails to init the block classes\n");
+        return -1;
+    }
 
     //initialize inodes
     for(int i=0; i<NUM_INODES; i++){
-        inodes[i].length=0;
+        fs->inodes[i].length=0;
         for(int j=0; j<NUM_POINTER; j++) 
-            inodes[i].block[j]=-1; //pointer value -1 means the pointer is not used
-        inodes[i].num_current_reader=0;
-        pthread_mutex_init(&inodes[i].rw_mutex,NULL);
-        pthread_mutex_init(&inodes[i].read_mutex,NULL);
+            fs->inodes[i].block[j]=-1; //pointer value -1 means the pointer is not used
+        fs->inodes[i].num_large=0;
+        fs->inodes[i].num_medium=0;
+        fs->inodes[i].num_current_reader=0;
+        init_mutex(fs, &fs->inodes[i].rw_mutex, 0); //held from open to close and released by the last reader
+        init_mutex(fs, &fs->inodes[i].read_mutex, 1);
+        init_mutex(fs, &fs->inodes[i].map_mutex, 1);
     }
-    pthread_mutex_init(&inodes_mutex,NULL); 
+    init_mutex(fs, &fs->inodes_mutex, 1);
 
-    //initialize open file table
-    for(int i=0; i<NUM_OPEN_FILE; i++){
-        struct open_file_entry entry=open_file_table[i];
-        entry.used=0; //each entry is not used initially
-        pthread_mutex_init(&entry.entry_mutex,NULL);
-        entry.position=0;
-        entry.access_flag=-1;
+    //initialize open file table with its first chunk of entries
+    fs->open_file_free_head = 0xffffffffu; //empty free stack
+    init_mutex(fs, &fs->open_file_table_mutex, 1);
+    if(grow_open_file_table(fs)<0){
+        printf("[init] fails to init the open file table\n");
+        return -1;
     }
-    pthread_mutex_init(&open_file_table_mutex,NULL); 
 
-    //initialize root directory
-    root_dir.head = root_dir.tail = NULL;
+    //initialize root directory and the dentry cache
+    dcache_init(fs);
+    if(init_dir(fs, &fs->root_dir, NULL)<0){
+        printf("[init] fails to init the root directory\n");
+        return -1;
+    }
 
     //initialize mutex_for_fs_stat
-    pthread_mutex_init(&mutex_for_fs_stat,NULL);
+    init_mutex(fs, &fs->mutex_for_fs_stat, 1);
+
+    init_mutex(fs, &fs->defrag_mutex, 1);
+    init_cond(fs, &fs->defrag_cond);
+
+    //set up the log and start its cleaner
+    if(layout==RSFS_LAYOUT_LOG && log_init(fs)<0){
+        printf("[init] fails to start the log cleaner\n");
+        return -1;
+    }
 
-    //return 0 means success
     return 0;
 }
 
+//release a file system and everything in it; no thread may use fs afterwards;
+//a shared volume is only unmapped from this process (see rsfs_unlink_shared)
+void rsfs_destroy(struct rsfs *fs){
+
+    if(fs==NULL) return;
+    if(fs->shm){
+        shm_detach(fs);
+        return;
+    }
+
+    log_destroy(fs); //the cleaner must be gone before the blocks are
+    rsfs_defrag_stop(fs); //and so must the defragmenter
+
+    for(int c=0; c<fs->num_open_file_chunks; c++){
+        for(int i=0; i<OPEN_FILE_CHUNK; i++) fs_free(fs, fs->open_file_chunks[c][i].dirty);
+        fs_free(fs, fs->open_file_chunks[c]);
+    }
+    for(int i=0; i<NUM_DBLOCKS; i++) fs_free(fs, fs->data_blocks[i]);
+    for(int i=0; i<NUM_INODES; i++) fs_free(fs, fs->inodes[i].large);
+    destroy_block_classes(fs);
+    memfd_destroy(fs); //the mappings of files go with the blocks
+
+    destroy_dir(fs, &fs->root_dir);
+    dcache_destroy(fs);
+
+    free(fs);
+}
+
 //create file
 //if file does not exist, create the file and return 0;
 //if file_name already exists, return -1; 
-//otherwise, return -2.
-int RSFS_create(char *file_name){
+//otherwise (e.g. its directory does not exist), return -2.
+static int create_internal(struct rsfs *fs, char *file_name){
 
-    //search root_dir for dir_entry matching provided file_name
-    struct dir_entry *dir_entry = search_dir(file_name);
+    //search the directories for dir_entry matching provided file_name
+    struct dir_entry *dir_entry = search_dir(fs, file_name);
 
     if(dir_entry){//already exists
         printf("[create] file (%s) already exists.\n", file_name);
@@ -72,51 +163,58 @@ int RSFS_create(char *file_name){
 
         if(DEBUG) printf("[create] file (%s) does not exist.\n", file_name);
 
-        //construct and insert a new dir_entry with given file_name
-        dir_entry = insert_dir(file_name);
-        if(DEBUG) printf("[create] insert a dir_entry with file_name:%s.\n", dir_entry->name);
-        
         //access inode-bitmap to get a free inode 
-        int inode_number = allocate_inode();
+        int inode_number = allocate_inode(fs);
         if(inode_number<0){
             printf("[create] fail to allocate an inode.\n");
             return -2;
         } 
         if(DEBUG) printf("[create] allocate inode with number:%d.\n", inode_number);
 
-        //save inode-number to dir-entry
-        dir_entry->inode_number = inode_number;
+        //construct and insert a new dir_entry with given file_name and the inode-number;
+        //the inode is allocated first so the entry is never seen without one
+        dir_entry = insert_dir(fs, file_name, inode_number);
+        if(dir_entry==NULL){
+            free_inode(fs, inode_number);
+            if(search_dir(fs, file_name)){//created by another thread meanwhile
+                printf("[create] file (%s) already exists.\n", file_name);
+                return -1;
+            }
+            printf("[create] fail to insert a dir_entry for (%s).\n", file_name);
+            return -2;
+        }
+        if(DEBUG) printf("[create] insert a dir_entry with file_name:%s.\n", dir_entry->name);
         
         return 0;
     }
 }
 
 // helper function to allocate a free inode
-void lock_inode(struct inode *inode, int access_flag) { 
+void lock_inode(struct rsfs *fs, struct inode *inode, int access_flag) { 
     if (access_flag == RSFS_RDWR) { // if access_flag is RSFS_RDWR
-        pthread_mutex_lock(&inode->rw_mutex); // lock the rw_mutex
+        lock_mutex(fs, &inode->rw_mutex, RSFS_LOCK_INODE_RW); // lock the rw_mutex
     } else {  // if access_flag is other
-        pthread_mutex_lock(&inode->read_mutex); // lock the read_mutex
+        lock_mutex(fs, &inode->read_mutex, RSFS_LOCK_INODE_READ); // lock the read_mutex
         while (inode->num_current_reader < 0) { // while the number of current readers is less than 0
             pthread_mutex_unlock(&inode->read_mutex); // unlock the read_mutex
-            pthread_mutex_lock(&inode->rw_mutex); // lock the rw_mutex
+            lock_mutex(fs, &inode->rw_mutex, RSFS_LOCK_INODE_RW); // lock the rw_mutex
             pthread_mutex_unlock(&inode->rw_mutex); // unlock the rw_mutex
-            pthread_mutex_lock(&inode->read_mutex); // lock the read_mutex
+            lock_mutex(fs, &inode->read_mutex, RSFS_LOCK_INODE_READ); // lock the read_mutex
         }
         inode->num_current_reader++; // increment the number of current readers
         if (inode->num_current_reader == 1) { // if the number of current readers is 1
-            pthread_mutex_lock(&inode->rw_mutex); // lock the rw_mutex
+            lock_mutex(fs, &inode->rw_mutex, RSFS_LOCK_INODE_RW); // lock the rw_mutex
         }
         pthread_mutex_unlock(&inode->read_mutex); // unlock the read_mutex
     }
 }
 
 // helper function to deallocate an inode
-void unlock_inode(struct inode *inode, int access_flag) {
+void unlock_inode(struct rsfs *fs, struct inode *inode, int access_flag) {
     if (access_flag == RSFS_RDWR) { // if access_flag is RSFS_RDWR
         pthread_mutex_unlock(&inode->rw_mutex); // unlock the rw_mutex
     } else {  // if access_flag is other
-        pthread_mutex_lock(&inode->read_mutex); // lock the read_mutex
+        lock_mutex(fs, &inode->read_mutex, RSFS_LOCK_INODE_READ); // lock the read_mutex
         inode->num_current_reader--; // decrement the number of current readers
         if (inode->num_current_reader == 0) { // if the number of current readers is 0
             pthread_mutex_unlock(&inode->rw_mutex); // unlock the rw_mutex
@@ -125,86 +223,221 @@ void unlock_inode(struct inode *inode, int access_flag) {
     }
 }
 
+//helper: count the tail blocks of the byte range [start, end) that have no data block yet
+//(the body and the medium blocks before the tail have no holes);
+//no block map lock is needed, as the log cleaner only swaps one block for another
+static int count_unallocated_blocks(struct inode *ino, int64_t start, int64_t end) {
+    int64_t base = tail_start(ino); // get the file offset of the tail
+    if (start < base) start = base; // only the tail can have holes
+    int count = 0; // the number of tail blocks with no data block
+    if (start >= end) return 0; // if the range ends before the tail, nothing is missing
+    for (int i = (start - base) / BLOCK_SIZE; i <= (end - 1 - base) / BLOCK_SIZE && i < NUM_POINTER; i++) { // for each tail block of the range
+        if (ino->block[i] == -1) count++; // count it if it has no data block
+    }
+    return count; // return the number of blocks missing
+}
+
+//helper: with the log-structured layout, move the blocks of the byte range [start, end) of ino to the head
+//of the log before they are modified; called without the block map held; return 0 if succeed, -1 if the log is full
+static int relocate_range(struct rsfs *fs, struct inode *ino, int64_t start, int64_t end) {
+    if (fs->layout != RSFS_LAYOUT_LOG) return 0; // blocks are overwritten in place
+    for (int i = start / BLOCK_SIZE; start < end && i <= (end - 1) / BLOCK_SIZE; i++) { // a log file is all tail
+        if (log_relocate_block(fs, ino, i) < 0) return -1;
+    }
+    return 0;
+}
+
+//helper: copy the buffered writes of an open file entry into the data blocks;
+//the missing blocks of the buffered range are allocated in one call (contiguous if possible)
+//out of the blocks reserved when the data was buffered; return 0 if succeed, -1 otherwise
+static int flush_entry(struct rsfs *fs, struct open_file_entry *ofe) {
+    if (ofe->dirty_len == 0) return 0; // if nothing is buffered, there is nothing to do
+
+    int ino_num = ofe->inode_number; // get the inode number from the open file entry
+    struct inode *ino = &fs->inodes[ino_num]; // get the inode from the inode number
+    int64_t start = ofe->dirty_start; // get the file offset of the buffered range
+    int64_t end = start + ofe->dirty_len; // get the file offset just past the buffered range
+
+    int missing = count_unallocated_blocks(ino, start, end); // get the number of blocks the range still needs
+    if (missing > ofe->reserved) { // should not happen, but top the reservation up rather than fail
+        ofe->reserved += reserve_data_blocks(fs, missing - ofe->reserved); // reserve what is left of the blocks needed
+        if (missing > ofe->reserved) return -1; // return failure: the volume is full; the data stays buffered
+    }
+    int blocks[NUM_POINTER]; // the data blocks taken for the range
+    if (allocate_reserved_data_blocks(fs, missing, blocks) < 0) return -1; // take them out of the reservation in one call
+    lock_block_map(fs, ino); // keep the log cleaner off the block map while it changes
+    for (int i = (start - tail_start(ino)) / BLOCK_SIZE, k = 0; k < missing; i++) { // the buffered range is in the tail
+        if (ino->block[i] == -1) ino->block[i] = blocks[k++]; // give each block with no data block the next block taken
+    }
+    unlock_block_map(fs, ino); // let the log cleaner in again
+    unreserve_data_blocks(fs, ofe->reserved - missing); // give back the blocks reserved but not needed
+    ofe->reserved = 0; // the open file entry holds no reservation anymore
+
+    if (relocate_range(fs, ino, start, end) < 0) return -1; // the log is full; the data stays buffered
+    lock_block_map(fs, ino); // keep the log cleaner off the blocks while they are written
+    copy_into_file(fs, ino, start, ofe->dirty, end - start); // copy the buffered bytes into their blocks
+    unlock_block_map(fs, ino); // let the log cleaner in again
+    log_write_inode(fs, ino_num); // record the new block map in the log
+    ofe->dirty_len = 0; // the buffer is empty now
+    return 0; // return success
+}
+
+//helper: buffer size bytes of buf to be written at file offset pos;
+//a write past the capacity of the file grows its block map first (see blockmap.c), and the bytes
+//that land before the tail are copied straight into their blocks, which are always allocated;
+//the buffer holds one contiguous range of the tail, so a write that does not touch it (or would overflow it)
+//flushes it first; data blocks for the range are only reserved here and allocated at flush time;
+//return the number of bytes buffered (short if the file or the volume is full), or -1 on error
+static int64_t buffered_write(struct rsfs *fs, struct open_file_entry *ofe, struct inode *ino, int64_t pos, char *buf, int64_t size) {
+    if (ofe->dirty == NULL) { // if the open file entry has no buffer yet
+        ofe->dirty = fs_alloc(fs, DIRTY_BUFFER_SIZE); // in the volume's memory, so another process can flush it on recovery
+        if (ofe->dirty == NULL) return -1; // return failure
+    }
+    if (pos + size > file_capacity(ino) && fs->layout != RSFS_LAYOUT_LOG) { // if the write goes past the capacity of the file
+        if (flush_entry(fs, ofe) < 0) return 0; // growing moves the tail, so the buffered bytes must be in it
+        grow_file(fs, ino, pos + size); // if a class runs out of blocks, the write stops at the capacity reached
+    }
+    int64_t max_length = file_capacity(ino); // get the capacity of the file
+    int64_t written = 0; // the number of bytes taken so far
+
+    int64_t base = tail_start(ino); // get the file offset of the tail
+    if (pos < base) { // if the write starts before the tail
+        int64_t n = (size < base - pos) ? size : base - pos; // get the number of bytes before the tail
+        lock_block_map(fs, ino); // keep the log cleaner off the blocks while they are written
+        copy_into_file(fs, ino, pos, buf, n); // copy them straight into their blocks, which are always allocated
+        unlock_block_map(fs, ino); // let the log cleaner in again
+        pos += n; // advance the position by the number of bytes copied
+        written += n; // and count them as written
+    }
+    while (written < size && pos < max_length) { // while bytes are left and the file has room
+        int n = (size - written < DIRTY_BUFFER_SIZE) ? size - written : DIRTY_BUFFER_SIZE; // get the number of bytes to buffer in this round
+        if (n > max_length - pos) n = max_length - pos; // but not past the capacity of the file
+
+        if (ofe->dirty_len > 0) { // if bytes are buffered already
+            int64_t dirty_end = ofe->dirty_start + ofe->dirty_len; // get the file offset just past the buffered range
+            int64_t lo = (pos < ofe->dirty_start) ? pos : ofe->dirty_start; // get the start of the merged range
+            int64_t hi = (pos + n > dirty_end) ? pos + n : dirty_end; // get the end of the merged range
+            if (pos > dirty_end || pos + n < ofe->dirty_start || hi - lo > DIRTY_BUFFER_SIZE) { // if the write does not touch the buffered range or would overflow the buffer
+                if (flush_entry(fs, ofe) < 0) break; // flush it first; stop if that fails
+            }
+        }
+        int64_t old_start = (ofe->dirty_len > 0) ? ofe->dirty_start : pos; // get the start of the buffered range, or the position if it is empty
+        int64_t old_end = (ofe->dirty_len > 0) ? ofe->dirty_start + ofe->dirty_len : pos; // get the end of the buffered range, or the position if it is empty
+        int64_t lo = (pos < old_start) ? pos : old_start; // get the start of the range after this round
+        int64_t hi = (pos + n > old_end) ? pos + n : old_end; // get the end of the range after this round
+
+        int need = count_unallocated_blocks(ino, lo, hi); // get the number of blocks the range will need at flush time
+        if (need > ofe->reserved) { // if the reservation does not cover them
+            ofe->reserved += reserve_data_blocks(fs, need - ofe->reserved); // reserve what is left of them
+            while (hi > old_end && count_unallocated_blocks(ino, lo, hi) > ofe->reserved) { // out of blocks: keep only the part of the write that is backed by blocks
+                hi = ((hi - 1) / BLOCK_SIZE) * BLOCK_SIZE; // drop the last block of the range
+            }
+            if (hi < old_end) hi = old_end; // the bytes buffered already keep their reservation
+            if (n > hi - pos) n = hi - pos; // shorten this round to the range backed by blocks
+        }
+        if (n <= 0) break; // if nothing is backed by blocks, the volume is full
+
+        if (ofe->dirty_len > 0 && lo < old_start) { // the range now starts earlier: shift the buffered bytes
+            memmove(ofe->dirty + (old_start - lo), ofe->dirty, ofe->dirty_len); // move them to their new offset in the buffer
+        }
+        memcpy(ofe->dirty + (pos - lo), buf + written, n); // copy the bytes of this round into the buffer
+        ofe->dirty_start = lo; // set the start of the buffered range
+        ofe->dirty_len = ((pos + n > old_end) ? pos + n : old_end) - lo; // set the length of the buffered range
+        pos += n; // advance the position by the number of bytes buffered
+        written += n; // and count them as written
+
+        if (ofe->dirty_len == DIRTY_BUFFER_SIZE && flush_entry(fs, ofe) < 0) break; // the buffer is full
+    }
+    return written; // return the number of bytes taken
+}
+
+//helper: open a sealed file; only a reference is taken, so concurrent opens share no lock
+//return the descriptor, or -1 if the file is to be written or was deleted meanwhile
+static int open_sealed(struct rsfs *fs, int access_flag, int inode_number) {
+    if (access_flag != RSFS_RDONLY) { // a sealed file can not be written
+        return -1; // return failure
+    }
+    if (get_inode(fs, inode_number) < 0) { // take a reference, unless the file was deleted
+        return -1; // return failure
+    }
+    int fd = allocate_open_file_entry(fs, RSFS_RDONLY, inode_number); // allocate an open file entry for reading
+    if (fd < 0) { // if no entry is available
+        put_inode(fs, inode_number); // drop the reference
+        return -1; // return failure
+    }
+    get_open_file_entry(fs, fd)->sealed = 1; // close drops the reference instead of unlocking
+    return fd; // return the file descriptor
+}
+
+
 //open a file with RSFS_RDONLY or RSFS_RDWR flags
 //When flag=RSFS_RDONLY: 
 //  if the file is currently opened with RSFS_RDWR (by a process/thread)=> the caller should be blocked (wait); 
-//  otherwise, the file is opened and the descriptor (i.e., index of the open_file_entry in the open_file_table) is returned
+//  otherwise, the file is opened and the descriptor (see get_open_file_entry()) is returned
 //When flag=RSFS_RDWR:
 //  if the file is currently opened with RSFS_RDWR (by a process/thread) or RSFS_RDONLY (by one or multiple processes/threads) 
 //      => the caller should be blocked (i.e. wait);
 //  otherwise, the file is opened and the desrcriptor is returned
-int RSFS_open(char *file_name, int access_flag) {
+static int open_internal(struct rsfs *fs, char *file_name, int access_flag) {
 
-    struct dir_entry *de = search_dir(file_name); // search for the directory entry with the given file name
-    if (access_flag != RSFS_RDONLY && access_flag != RSFS_RDWR || !de) { // if the access flag is not RSFS_RDONLY or RSFS_RDWR or the directory entry is not found
+    struct dir_entry *de = search_dir(fs, file_name); // search for the directory entry with the given file name
+    if (access_flag != RSFS_RDONLY && access_flag != RSFS_RDWR || !de || de->dir) { // if the access flag is not RSFS_RDONLY or RSFS_RDWR or the directory entry is not found or is a directory
         return -1; // return failure
     }
     int inode_number = de->inode_number; // get the inode number from the directory entry
-    struct inode *inode = &inodes[inode_number]; // get the inode from the inode number
-    lock_inode(inode, access_flag); // lock the inode with the given access flag
-    int fd = allocate_open_file_entry(access_flag, de); // allocate an open file entry with the given access flag and directory entry
+    struct inode *inode = &fs->inodes[inode_number]; // get the inode from the inode number
+    if (__atomic_load_n(&inode->sealed, __ATOMIC_ACQUIRE)) { // if the file is sealed
+        return open_sealed(fs, access_flag, inode_number); // skip the reader/writer protocol
+    }
+    lock_inode(fs, inode, access_flag); // lock the inode with the given access flag
+    if (__atomic_load_n(&inode->sealed, __ATOMIC_ACQUIRE)) { // if the file was sealed while this thread waited
+        unlock_inode(fs, inode, access_flag); // unlock the inode with the given access flag
+        return open_sealed(fs, access_flag, inode_number); // and take the sealed path instead
+    }
+    int fd = allocate_open_file_entry(fs, access_flag, inode_number); // allocate an open file entry with the given access flag and inode number
     if (fd < 0) { // if the file descriptor is less than 0
-        unlock_inode(inode, access_flag);   // unlock the inode with the given access flag
+        unlock_inode(fs, inode, access_flag);   // unlock the inode with the given access flag
         return -1; // return failure
     }
     return fd; // return the file descriptor
 }
 
 //append the content in buf to the end of the file of descriptor fd
-int RSFS_append(int fd, void *buf, int size) {
+static int64_t append_internal(struct rsfs *fs, int fd, void *buf, int64_t size) {
 
-    struct open_file_entry *ofe = &open_file_table[fd]; // get the open file entry with the given file descriptor
-    if (fd < 0 || fd >= NUM_OPEN_FILE || size <= 0 || !ofe->used || ofe->access_flag != RSFS_RDWR) { // if the file descriptor is less than 0, the file descriptor is greater than or equal to the number of open files, the size is less than or equal to 0, the open file entry is not used, or the access flag is not RSFS_RDWR
+    struct open_file_entry *ofe = get_open_file_entry(fs, fd); // get the open file entry with the given file descriptor
+    if (!ofe || size <= 0 || ofe->access_flag != RSFS_RDWR) { // if the file descriptor is not valid, the size is less than or equal to 0, or the access flag is not RSFS_RDWR
         return -1; // return failure
     }
-    struct dir_entry *de = ofe->dir_entry; // get the directory entry from the open file entry
-    int ino_num = de->inode_number; // get the inode number from the directory entry
-    struct inode *ino = &inodes[ino_num]; // get the inode from the inode number
-    int pos = ofe->position; // get the position from the open file entry
-
-    int appended = 0; // initialize the number of bytes appended to 0
-
-    while (appended < size) { // while the number of bytes appended is less than the size
-        int blk_off = pos % BLOCK_SIZE; // get the block offset from the position by modulo BLOCK_SIZE
-        int to_write = BLOCK_SIZE - blk_off; // get the number of bytes to write by subtracting the block offset from BLOCK_SIZE
-        if (to_write > size - appended) { // if the number of bytes to write is greater than the size minus the number of bytes appended
-            to_write = size - appended; // set the number of bytes to write to the size minus the number of bytes appended
-        }
-        int blk_idx = pos / BLOCK_SIZE; // get the block index from the position by dividing by BLOCK_SIZE
-        if (blk_idx >= NUM_POINTER || ino->block[blk_idx] == -1) { // if the block index is greater than or equal to NUM_POINTER or the block at the block index is -1
-            int new_blk = allocate_data_block();  // allocate a new data block
-            if (new_blk != -1) ino->block[blk_idx] = new_blk;
-            else break;
+    int ino_num = ofe->inode_number; // get the inode number from the open file entry
+    struct inode *ino = &fs->inodes[ino_num]; // get the inode from the inode number
+    int64_t pos = ofe->position; // get the position from the open file entry
 
-        }
-        void *blk = data_blocks[ino->block[blk_idx]]; // get the block from the data blocks at the block index
-        for (int i = 0; i < to_write; i++) { // for each byte to write
-            ((char*)blk)[blk_off + i] = ((char*)buf)[appended + i]; // copy the byte from the buffer to the block
-        }
-        pos += to_write; // increment the position by the number of bytes to write
-        appended += to_write; // increment the number of bytes appended by the number of bytes to write
+    int64_t appended = buffered_write(fs, ofe, ino, pos, (char *)buf, size); // buffer the data; its blocks are allocated when flushed
+    if (appended < 0) { // if the buffer cannot be set up
+        return -1; // return failure
     }
+    pos += appended; // advance the position by the number of bytes appended
 
-    pthread_mutex_lock(&inodes_mutex); // lock the inodes mutex
+    lock_mutex(fs, &fs->inodes_mutex, RSFS_LOCK_INODES); // lock the inodes mutex
     ino->length = (pos > ino->length) ? pos : ino->length; // set the length of the inode to the maximum of the position and the length of the inode
     ofe->position = pos; // set the position of the open file entry to the position
-    pthread_mutex_unlock(&inodes_mutex); // unlock the inodes mutex
+    pthread_mutex_unlock(&fs->inodes_mutex); // unlock the inodes mutex
 
     return appended;
 }
 
 //update current position of the file (which is in the open_file_entry) to offset
-int RSFS_fseek(int fd, int offset) {
+static int64_t fseek_internal(struct rsfs *fs, int fd, int64_t offset) {
 
-    struct open_file_entry *entry = &open_file_table[fd]; // get the open file entry with the given file descriptor
-    if (fd < 0 || fd >= NUM_OPEN_FILE ||!entry->used) { // if the file descriptor is less than 0, the file descriptor is greater than or equal to the number of open files, or the open file entry is not used
+    struct open_file_entry *entry = get_open_file_entry(fs, fd); // get the open file entry with the given file descriptor
+    if (!entry) { // if the file descriptor is not valid
         return -1; // return failure
     }
-    struct dir_entry *dir_entry = entry->dir_entry; // get the directory entry from the open file entry
-    int inode_number = dir_entry->inode_number; // get the inode number from the directory entry
-    struct inode *inode = &inodes[inode_number]; // get the inode from the inode number
-    int position = entry->position; // get the position from the open file entry
-    int length = inode->length; // get the length of the inode
+    int inode_number = entry->inode_number; // get the inode number from the open file entry
+    struct inode *inode = &fs->inodes[inode_number]; // get the inode from the inode number
+    int64_t position = entry->position; // get the position from the open file entry
+    int64_t length = inode->length; // get the length of the inode
     if (offset < 0 || offset > length) { // if the offset is less than 0 or the offset is greater than the length
         return position; // return the position
     }
@@ -213,50 +446,85 @@ int RSFS_fseek(int fd, int offset) {
     return offset; // return the offset
 }
 
+//helper: read from a sealed file; takes no lock, since a sealed file is immutable while referenced
+static int64_t read_sealed(struct rsfs *fs, struct open_file_entry *ofe, struct inode *ino, void *buf, int64_t size) {
+    int64_t pos = ofe->position; // get the position from the open file entry
+    int64_t end = (pos + size > ino->length) ? ino->length : pos + size; // do not read past the end of the file
+    int64_t read = (end > pos) ? end - pos : 0; // the number of bytes to read
+    copy_from_file(fs, ino, pos, (char *)buf, read); // copy the bytes block by block, whatever their class
+    ofe->position = pos + read; // set the position of the open file entry past the bytes read
+    return read; // return the number of bytes read
+}
+
 //read from file from the current position for up to size bytes
-int RSFS_read(int fd, void *buf, int size) {
-    struct open_file_entry *ofe = &open_file_table[fd]; // get the open file entry with the given file descriptor
-    if (fd < 0 || fd >= NUM_OPEN_FILE || size <= 0 || !ofe->used) { // if the file descriptor is less than 0, the file descriptor is greater than or equal to the number of open files, the size is less than or equal to 0, or the open file entry is not used
+static int64_t read_internal(struct rsfs *fs, int fd, void *buf, int64_t size) {
+    struct open_file_entry *ofe = get_open_file_entry(fs, fd); // get the open file entry with the given file descriptor
+    if (!ofe || size <= 0) { // if the file descriptor is not valid or the size is less than or equal to 0
         return -1;
     }
-    struct dir_entry *de = ofe->dir_entry; // get the directory entry from the open file entry
-    int ino_num = de->inode_number; // get the inode number from the directory entry
-    struct inode *ino = &inodes[ino_num]; // get the inode from the inode number
-    int pos = ofe->position; // get the position from the open file entry
+    int ino_num = ofe->inode_number; // get the inode number from the open file entry
+    struct inode *ino = &fs->inodes[ino_num]; // get the inode from the inode number
+    int64_t pos = ofe->position; // get the position from the open file entry
+    if (ofe->sealed) { // if the file is sealed, its length and blocks never change and nothing is buffered
+        return read_sealed(fs, ofe, ino, buf, size); // copy without looking at the dirty buffer
+    }
+    lock_block_map(fs, ino); // keep the log cleaner from moving the blocks being read
 
-    int read = 0; // initialize the number of bytes read to 0
+    int64_t read = 0; // initialize the number of bytes read to 0
     while (read < size && pos < ino->length) { // while the number of bytes read is less than the size and the position is less than the length of the inode
-        int blk_off = pos % BLOCK_SIZE; // get the block offset from the position by modulo BLOCK_SIZE
-        int blk_idx = pos / BLOCK_SIZE; // get the block index from the position by dividing by BLOCK_SIZE
-        int to_read = BLOCK_SIZE - blk_off; // get the number of bytes to read by subtracting the block offset from BLOCK_SIZE
+        int to_read; // get the number of bytes to read: up to the end of the block holding the position
+        char *blk_ptr = file_ptr(fs, ino, pos, &to_read); // get the address of the position in its block, whatever its class
         to_read = (to_read > size - read) ? (size - read) : to_read; // get the minimum of the number of bytes to read if the bytes is greater than the size minus the bytes
         to_read = (to_read > ino->length - pos) ? (ino->length - pos) : to_read; // get the minimum of the number of bytes to read if the length of the inode is less than the position
-        void *blk = data_blocks[ino->block[blk_idx]]; // get the block from the data blocks at the block index
-        char *src_ptr = (char *)blk + blk_off; // get the source pointer from the block and block offset
+        int64_t dirty_end = ofe->dirty_start + ofe->dirty_len; // get the end of the range buffered by this open file
+        char *src_ptr; // the source pointer
+        if (ofe->dirty_len > 0 && pos >= ofe->dirty_start && pos < dirty_end) { // if the position is inside the buffered range
+            to_read = (to_read > dirty_end - pos) ? (dirty_end - pos) : to_read; // do not read past the buffered range
+            src_ptr = ofe->dirty + (pos - ofe->dirty_start); // read the buffered (not yet flushed) bytes
+        } else { // otherwise the bytes are in the data blocks
+            if (ofe->dirty_len > 0 && pos < ofe->dirty_start && pos + to_read > ofe->dirty_start) { // if the read would run into the buffered range
+                to_read = ofe->dirty_start - pos; // stop at the start of the buffered range
+            }
+            src_ptr = blk_ptr; // get the source pointer in the block
+        }
         char *dst_ptr = (char *)buf + read; // get the destination pointer from the buffer and number of bytes read
-        for (int i = 0; i < to_read; i++) { // for each byte to read
-            dst_ptr[i] = src_ptr[i]; // copy the byte from the source pointer to the destination pointer
+        if (src_ptr) { // if the bytes are buffered or in a block
+            memcpy(dst_ptr, src_ptr, to_read); // copy them from the source pointer to the destination pointer
+        } else { // otherwise they are in a hole of the tail
+            memset(dst_ptr, 0, to_read); // which reads as zeros
         }
         pos += to_read; // increment the position by the number of bytes to read
         read += to_read; // increment the number of bytes read by the number of bytes to read
     }
+    unlock_block_map(fs, ino); // let the log cleaner in again
     ofe->position = pos; // set the position of the open file entry to the position
     return read; // return the number of bytes read
 }
 
-//close file: return 0 if succeed
-int RSFS_close(int fd) {
-    struct open_file_entry *ofe = &open_file_table[fd]; // get the open file entry with the given file descriptor
-    if (fd < 0 || fd >= NUM_OPEN_FILE || !ofe->used) { // if the file descriptor is less than 0, the file descriptor is greater than or equal to the number of open files, or the open file entry is not used
+//close file: return 0 if succeed, or -1 if the buffered writes could not be written out (the file is closed either way)
+static int close_internal(struct rsfs *fs, int fd) {
+    struct open_file_entry *ofe = get_open_file_entry(fs, fd); // get the open file entry with the given file descriptor
+    if (!ofe) { // if the file descriptor is not valid
         return -1; // return failure
     }
-    struct dir_entry *de = ofe->dir_entry; // get the directory entry from the open file entry
-    int ino_num = de->inode_number; // get the inode number from the directory entry
-    struct inode *ino = &inodes[ino_num]; // get the inode from the inode number
+    int ino_num = ofe->inode_number; // get the inode number from the open file entry
+    struct inode *ino = &fs->inodes[ino_num]; // get the inode from the inode number
+    int ret = 0; // the result of writing out the buffered data
+    if (flush_entry(fs, ofe) < 0) { // allocate blocks for and write out the buffered data while the file is still locked
+        unreserve_data_blocks(fs, ofe->reserved); // the buffered bytes are lost: give back the blocks reserved for them
+        ofe->reserved = 0; // nothing is reserved any more
+        ofe->dirty_len = 0; // drop the buffered range
+        ret = -1; // the file is still closed, but the caller learns that data was lost
+    }
+    if (ofe->sealed) { // if the entry holds a reference to a sealed file
+        free_open_file_entry(fs, fd); // free the open file entry with the given file descriptor
+        put_inode(fs, ino_num); // drop the reference; the last one of a deleted file frees it
+        return ret; // return success, or failure if the flush failed
+    }
     if (ofe->access_flag == RSFS_RDWR) { // if the access flag is RSFS_RDWR
         pthread_mutex_unlock(&ino->rw_mutex); // unlock the rw_mutex
     } else { // if the access flag is other
-        pthread_mutex_lock(&ino->read_mutex); // lock the read_mutex
+        lock_mutex(fs, &ino->read_mutex, RSFS_LOCK_INODE_READ); // lock the read_mutex
         ino->num_current_reader--; // decrement the number of current readers
         if (ino->num_current_reader == 0) { // if the number of current readers is 0
             pthread_mutex_unlock(&ino->read_mutex); // unlock the read_mutex
@@ -265,149 +533,409 @@ int RSFS_close(int fd) {
             pthread_mutex_unlock(&ino->read_mutex); // unlock the read_mutex
         }
     }
-    free_open_file_entry(fd); // free the open file entry with the given file descriptor
+    free_open_file_entry(fs, fd); // free the open file entry with the given file descriptor
 
-    return 0; // return success
+    return ret; // return success, or failure if the buffered data could not be written out
 }
 
 //delete file
-int RSFS_delete(char *file_name) {
-    struct dir_entry *de = search_dir(file_name); // search for the directory entry with the given file name
-    if (!de) { // if the directory entry is not found
+static int delete_internal(struct rsfs *fs, char *file_name) {
+    int ino_num = delete_dir(fs, file_name); // unlink the file's entry and take its inode number under the directory's lock, so only the thread that unlinked it frees it
+    if (ino_num < 0) { // if the entry is not found or is a directory (see rsfs_rmdir)
         return -1; // return failure
     }
-    int ino_num = de->inode_number; // get the inode number from the directory entry
-    struct inode *ino = &inodes[ino_num]; // get the inode from the inode number
-    for (int i = 0; i < NUM_POINTER; i++) { // for each pointer
-        if (ino->block[i] != -1) { // if the block at the pointer is not -1
-            free_data_block(ino->block[i]); // free the data block at the pointer
-            ino->block[i] = -1; // set the block at the pointer to -1
-        }
+    struct inode *ino = &fs->inodes[ino_num]; // get the inode from the inode number
+    if (__atomic_fetch_or(&ino->refcount, INODE_DEAD, __ATOMIC_ACQ_REL) != 0) { // if sealed readers or the defragmenter hold references, not locks
+        return 0; // the last reference frees it
     }
-    free_inode(ino_num); // free the inode with the inode number
-    delete_dir(file_name); // delete the directory entry with the given file name
+    release_inode(fs, ino_num); // free the data blocks and the inode
     return 0; // return success
 }
 
-int RSFS_write(int fd, void *buf, int size) {
-    struct open_file_entry *ofe = &open_file_table[fd]; // get the open file entry with the given file descriptor
-    if (fd < 0 || fd >= NUM_OPEN_FILE || size <= 0 || !ofe->used || ofe->access_flag != RSFS_RDWR) { // if the file descriptor is less than 0, the file descriptor is greater than or equal to the number of open files, the size is less than or equal to 0, the open file entry is not used, or the access flag is not RSFS_RDWR
+static int64_t write_internal(struct rsfs *fs, int fd, void *buf, int64_t size) {
+    struct open_file_entry *ofe = get_open_file_entry(fs, fd); // get the open file entry with the given file descriptor
+    if (!ofe || size <= 0 || ofe->access_flag != RSFS_RDWR) { // if the file descriptor is not valid, the size is less than or equal to 0, or the access flag is not RSFS_RDWR
         return -1; // return failure
     }
-    struct dir_entry *de = ofe->dir_entry; // get the directory entry from the open file entry
-    int ino_num = de->inode_number; // get the inode number from the directory entry
-    struct inode *ino = &inodes[ino_num]; // get the inode from the inode number
-    int pos = ofe->position; // get the position from the open file entry
-
-    int written = 0; // initialize the number of bytes written to 0
-    while (written < size) { // while the number of bytes written is less than the size
-        int blk_off = pos % BLOCK_SIZE; // get the block offset from the position by modulo BLOCK_SIZE
-        int blk_idx = pos / BLOCK_SIZE; // get the block index from the position by dividing by BLOCK_SIZE
-        int to_write = BLOCK_SIZE - blk_off; // get the number of bytes to write by subtracting the block offset from BLOCK_SIZE
-        if (to_write > size - written) { // if the number of bytes to write is greater than the size minus the number of bytes written
-            to_write = size - written; // set the number of bytes to write to the size minus the number of bytes written
-        }
-        if (blk_idx >= NUM_POINTER || ino->block[blk_idx] == -1) { // if the block index is greater than or equal to NUM_POINTER or the block at the block index is -1
-            int new_blk = allocate_data_block(); // allocate a new data block
-            if (new_blk != -1) ino->block[blk_idx] = new_blk;
-            else break;
-        }
-        void *blk = data_blocks[ino->block[blk_idx]]; // get the block from the data blocks at the block index
-        char *src_ptr = (char *)buf + written; // get the source pointer from the buffer and number of bytes written
-        char *dst_ptr = (char *)blk + blk_off; // get the destination pointer from the block and block offset
-        for (int i = 0; i < to_write; i++) {   // for each byte to write
-            dst_ptr[i] = src_ptr[i]; // copy the byte from the source pointer to the destination pointer
-        }
-        pos += to_write; // increment the position by the number of bytes to write
-        written += to_write; // increment the number of bytes written by the number of bytes to write
+    int ino_num = ofe->inode_number; // get the inode number from the open file entry
+    struct inode *ino = &fs->inodes[ino_num]; // get the inode from the inode number
+    int64_t pos = ofe->position; // get the position from the open file entry
+
+    int64_t written = buffered_write(fs, ofe, ino, pos, (char *)buf, size); // buffer the data; its blocks are allocated when flushed
+    if (written < 0) { // if the buffer cannot be set up
+        return -1; // return failure
     }
-    pthread_mutex_lock(&inodes_mutex); // lock the inodes mutex
+    pos += written; // advance the position by the number of bytes written
+    lock_mutex(fs, &fs->inodes_mutex, RSFS_LOCK_INODES); // lock the inodes mutex
     ofe->position = pos; // set the position of the open file entry to the position
     if (pos > ino->length) { // if the position is greater than the length of the inode
         ino->length = pos; // set the length of the inode to the position
     }
-    pthread_mutex_unlock(&inodes_mutex); // unlock the inodes mutex
+    pthread_mutex_unlock(&fs->inodes_mutex); // unlock the inodes mutex
     return written;  // return the number of bytes written
 }
 
-int RSFS_cut(int fd, int size) {
-    struct open_file_entry *ofe = &open_file_table[fd]; // get the open file entry with the given file descriptor
-    if (fd < 0 || fd >= NUM_OPEN_FILE || size <= 0 || ofe->access_flag != RSFS_RDWR) { // if the file descriptor is less than 0, the file descriptor is greater than or equal to the number of open files, the size is less than or equal to 0, or the access flag is not RSFS_RDWR
+static int64_t cut_internal(struct rsfs *fs, int fd, int64_t size) {
+    struct open_file_entry *ofe = get_open_file_entry(fs, fd); // get the open file entry with the given file descriptor
+    if (!ofe || size <= 0 || ofe->access_flag != RSFS_RDWR) { // if the file descriptor is not valid, the size is less than or equal to 0, or the access flag is not RSFS_RDWR
         return -1; // return failure
     }
-    pthread_mutex_lock(&ofe->entry_mutex); // lock the entry mutex
+    lock_mutex(fs, &ofe->entry_mutex, RSFS_LOCK_ENTRY); // lock the entry mutex
     if (ofe->used == 0) { // if the open file entry is not used
         pthread_mutex_unlock(&ofe->entry_mutex); // unlock the entry mutex
         return -1; // return failure
     }
-    int pos = ofe->position; // get the position from the open file entry
-    struct dir_entry *de = ofe->dir_entry; // get the directory entry from the open file entry
-    struct inode *ino = &inodes[de->inode_number]; // get the inode from the directory entry
+    if (flush_entry(fs, ofe) < 0) { // the data is shifted in the blocks, so the buffered writes must be there first
+        pthread_mutex_unlock(&ofe->entry_mutex); // unlock the entry mutex
+        return -1; // return failure
+    }
+    int64_t pos = ofe->position; // get the position from the open file entry
+    struct inode *ino = &fs->inodes[ofe->inode_number]; // get the inode from the open file entry
 
-    int to_cut = (size < ino->length - pos) ? size : (ino->length - pos); // get the number of bytes to cut
-    int src_blk = (pos + to_cut) / BLOCK_SIZE; // get the source block from the position plus the number of bytes to cut by dividing by BLOCK_SIZE
-    int dst_blk = pos / BLOCK_SIZE; // get the destination block from the position by dividing by BLOCK_SIZE
-    int src_off = (pos + to_cut) % BLOCK_SIZE; // get the source offset from the position plus the number of bytes to cut by modulo BLOCK_SIZE
-    int dst_off = pos % BLOCK_SIZE; // get the destination offset from the position by modulo BLOCK_SIZE
-    int to_move = ino->length - (pos + to_cut); // get the number of bytes to move
+    int64_t to_cut = (size < ino->length - pos) ? size : (ino->length - pos); // get the number of bytes to cut
+    int64_t src_pos = pos + to_cut; // get the source position: the first byte after the bytes cut
+    int64_t dst_pos = pos; // get the destination position: the first byte cut
+    int64_t to_move = ino->length - (pos + to_cut); // get the number of bytes to move
+    if (to_cut > 0) invalidate_mappings(fs, ino); // the bytes move to other offsets, and blocks may be freed
 
+    if (to_move > 0 && relocate_range(fs, ino, pos, pos + to_move) < 0) { // the blocks written are moved to the head of the log first
+        pthread_mutex_unlock(&ofe->entry_mutex); // unlock the entry mutex
+        return -1; // return failure; the log is full
+    }
+    lock_block_map(fs, ino); // keep the log cleaner off the blocks while the data is shifted
     while (to_move > 0) { // while the number of bytes to move is greater than 0
-        int in_src_blk = (to_move < BLOCK_SIZE - src_off) ? to_move : (BLOCK_SIZE - src_off); // get the number of bytes in the source block
-        int in_dst_blk = (to_move < BLOCK_SIZE - dst_off) ? to_move : (BLOCK_SIZE - dst_off); // get the number of bytes in the destination block
-        int to_copy = (in_src_blk < in_dst_blk) ? in_src_blk : in_dst_blk; // get the number of bytes to copy
-
-        char *src_ptr = (char *)data_blocks[ino->block[src_blk]] + src_off; // get the source pointer from the data blocks at the source block and source offset
-        char *dst_ptr = (char *)data_blocks[ino->block[dst_blk]] + dst_off; // get the destination pointer from the data blocks at the destination block and destination offset
-        for (int i = 0; i < to_copy; i++) { // for each byte to copy
-            dst_ptr[i] = src_ptr[i]; // copy the byte from the source pointer to the destination pointer
-        }
-        src_off += to_copy; // increment the source offset by the number of bytes to copy
-        to_move -= to_copy; // decrement the number of bytes to move by the number of bytes to copy
-        dst_off += to_copy; // increment the destination offset by the number of bytes to copy
-        src_off == BLOCK_SIZE ? (src_blk++, src_off = 0) : (void)0; // if the source offset is BLOCK_SIZE, increment the source block and set the source offset to 0
-        dst_off == BLOCK_SIZE ? (dst_blk++, dst_off = 0) : (void)0; // if the destination offset is BLOCK_SIZE, increment the destination block and set the destination offset to 0
-
+        int in_src_blk, in_dst_blk; // get the number of bytes left in the source and destination blocks
+        char *src_ptr = file_ptr(fs, ino, src_pos, &in_src_blk); // get the source pointer in the block holding the source position
+        char *dst_ptr = file_ptr(fs, ino, dst_pos, &in_dst_blk); // get the destination pointer in the block holding the destination position
+        int64_t to_copy = (in_src_blk < in_dst_blk) ? in_src_blk : in_dst_blk; // get the number of bytes to copy
+        to_copy = (to_copy < to_move) ? to_copy : to_move; // but not more than the bytes left to move
+
+        memmove(dst_ptr, src_ptr, to_copy); // copy the bytes from the source pointer to the destination pointer (they may overlap in a large block)
+        src_pos += to_copy; // advance the source position by the number of bytes copied
+        dst_pos += to_copy; // advance the destination position by the number of bytes copied
+        to_move -= to_copy; // decrement the number of bytes to move by the number of bytes copied
     }
+    unlock_block_map(fs, ino); // let the log cleaner in again
+    int64_t base = tail_start(ino); // get the file offset of the tail; the blocks before it are freed by shrink_file()
+    int old_last_blk = (ino->length <= base) ? -1 : (ino->length - 1 - base) / BLOCK_SIZE; // get the old last tail block; blocks after it are preallocated and kept
     ino->length -= to_cut; // decrement the length of the inode by the number of bytes to cut
-    int new_last_blk = (ino->length - 1) / BLOCK_SIZE; // get the new last block from the length minus 1 by dividing by BLOCK_SIZE
-    for (int i = new_last_blk + 1; i < NUM_POINTER; i++) { // for each block after the new last block
-        if (ino->block[i] != -1) { // if the block at the block index is not -1
-            free_data_block(ino->block[i]); // free the data block at the block index
-            ino->block[i] = -1; // set the block at the block index to -1
-        }
+    int new_last_blk = (ino->length <= base) ? -1 : (ino->length - 1 - base) / BLOCK_SIZE; // get the new last tail block; -1 if the file ends before the tail
+    for (int i = new_last_blk + 1; i <= old_last_blk && i < NUM_POINTER; i++) { // for each block after the new last block, up to the old last block
+        free_file_block(fs, ino, i); // free the data block at the block index, if any, and set it to -1
     }
+    shrink_file(fs, ino, ino->length); // if the file now ends before its tail, free the larger blocks past the end and move its last bytes into smaller ones
+    log_write_inode(fs, ofe->inode_number); // record the new length and block map in the log
     pthread_mutex_unlock(&ofe->entry_mutex); // unlock the entry mutex
     return to_cut; // return the number of bytes cut
 }
 
-void RSFS_stat(){
-    pthread_mutex_lock(&mutex_for_fs_stat);
-    printf("\nCurrent status of the file system:\n\n %16s%10s%10s\n", "File Name", "Length", "iNode #");
+//reserve data blocks for the byte range [offset, offset+len) of the file of descriptor fd;
+//the block map grows to cover the range (see blockmap.c), and tail blocks are taken as one
+//contiguous run when possible; the file length is not changed, so later writes into the range
+//do not call the allocator;
+//return 0 if succeed, or -1 if the arguments are invalid or not enough blocks are free
+static int fallocate_internal(struct rsfs *fs, int fd, int64_t offset, int64_t len) {
+    struct open_file_entry *ofe = get_open_file_entry(fs, fd); // get the open file entry with the given file descriptor
+    if (!ofe || offset < 0 || len <= 0 || ofe->access_flag != RSFS_RDWR) { // if the file descriptor is not valid, the range is empty or negative, or the access flag is not RSFS_RDWR
+        return -1; // return failure
+    }
+    struct inode *ino = &fs->inodes[ofe->inode_number]; // get the inode from the open file entry
+    if (flush_entry(fs, ofe) < 0) { // settle the buffered range so its reservation is not counted twice
+        return -1; // return failure
+    }
+    if (grow_file(fs, ino, offset + len) < 0) { // grow the block map to cover the range
+        return -1; // return failure: beyond the blocks left, or the maximum size of a file of the log
+    }
 
-    //list files
-    struct dir_entry *dir_entry = root_dir.head;
-    while(dir_entry!=NULL){
+    int64_t base = tail_start(ino); // get the file offset of the tail; only the tail can have holes
+    if (offset + len <= base) return 0; // if the range ends before the tail, every block of it exists
+    int first_blk = (offset > base) ? (offset - base) / BLOCK_SIZE : 0; // get the first tail block of the range
+    int last_blk = (offset + len - 1 - base) / BLOCK_SIZE; // get the last tail block of the range
 
-        int inode_number = dir_entry->inode_number;
-        struct inode *inode = &inodes[inode_number];
-        
-        printf("%16s%10d%10d\n", dir_entry->name, inode->length, inode_number);
-        dir_entry = dir_entry->next;
+    int missing = 0; // the number of blocks in the range that are not allocated yet
+    for (int i = first_blk; i <= last_blk; i++) { // for each tail block of the range
+        if (ino->block[i] == -1) missing++; // count it if it has no data block
+    }
+    if (missing == 0) return 0; // if the range is fully allocated, there is nothing to do
+
+    int blocks[NUM_POINTER]; // the data blocks taken for the range
+    if (allocate_data_blocks(fs, missing, blocks) < 0) { // take them in one call, contiguous if possible
+        return -1; // return failure: not enough blocks are free
+    }
+    lock_block_map(fs, ino); // keep the log cleaner off the block map while it changes
+    for (int i = first_blk, k = 0; i <= last_blk; i++) { // for each tail block of the range
+        if (ino->block[i] == -1) ino->block[i] = blocks[k++]; // give it the next block taken if it has none
+    }
+    unlock_block_map(fs, ino); // let the log cleaner in again
+    log_write_inode(fs, ofe->inode_number); // record the new block map in the log
+    return 0; // return success
+}
+
+//set the length of the file of descriptor fd to length;
+//shrinking frees the data blocks past the new end (including preallocated ones),
+//growing reserves the blocks for the new range and zero-fills it; no data is moved;
+//return 0 if succeed, or -1 otherwise
+static int truncate_internal(struct rsfs *fs, int fd, int64_t length) {
+    struct open_file_entry *ofe = get_open_file_entry(fs, fd); // get the open file entry with the given file descriptor
+    if (!ofe || length < 0 || ofe->access_flag != RSFS_RDWR) { // if the file descriptor is not valid, the length is negative, or the access flag is not RSFS_RDWR
+        return -1; // return failure
+    }
+    struct inode *ino = &fs->inodes[ofe->inode_number]; // get the inode from the open file entry
+    if (flush_entry(fs, ofe) < 0) { // the blocks are edited directly below, so the buffered writes must be there first
+        return -1; // return failure
+    }
+    int64_t old_length = ino->length; // get the length of the inode before the change
+
+    if (length > old_length) { // if the file grows
+        if (fallocate_internal(fs, fd, old_length, length - old_length) < 0) { // make sure every block of the grown range exists
+            return -1; // return failure
+        }
+        if (relocate_range(fs, ino, old_length, length) < 0) { // move the blocks to be zeroed to the head of the log first
+            return -1; // return failure: the log is full
+        }
+        lock_block_map(fs, ino); // keep the log cleaner off the blocks while they are zeroed
+        copy_into_file(fs, ino, old_length, NULL, length - old_length); // zero-fill the grown range, so it reads back as zeros
+        unlock_block_map(fs, ino); // let the log cleaner in again
+    } else { // if the file shrinks or keeps its length
+        int64_t base = tail_start(ino); // get the file offset of the tail
+        int last_blk = (length <= base) ? -1 : (length - 1 - base) / BLOCK_SIZE; // get the new last tail block; -1 if the file ends before the tail
+        for (int i = last_blk + 1; i < NUM_POINTER; i++) { // for each tail block after the new last block, preallocated ones included
+            free_file_block(fs, ino, i); // free the data block at the block index, if any, and set it to -1
+        }
+        shrink_file(fs, ino, length); // then free the larger blocks past the new end
+    }
+
+    lock_mutex(fs, &fs->inodes_mutex, RSFS_LOCK_INODES); // lock the inodes mutex
+    ino->length = length; // set the length of the inode to the new length
+    if (ofe->position > length) ofe->position = length; // keep the position inside the file
+    pthread_mutex_unlock(&fs->inodes_mutex); // unlock the inodes mutex
+
+    log_write_inode(fs, ofe->inode_number); // record the new length and block map in the log
+    return 0; // return success
+}
+
+//allocate data blocks for the writes buffered by the open file of descriptor fd and copy them in;
+//this also happens on rsfs_close and whenever the buffer fills up;
+//return 0 if succeed, or -1 otherwise
+static int flush_internal(struct rsfs *fs, int fd) {
+    struct open_file_entry *ofe = get_open_file_entry(fs, fd); // get the open file entry with the given file descriptor
+    if (!ofe) { // if the file descriptor is not valid
+        return -1; // return failure
+    }
+    return flush_entry(fs, ofe); // copy the buffered writes into the data blocks
+}
+
+//create a directory at path
+//return 0 if succeed, -1 if path already exists, or -2 if its parent directory does not exist
+static int mkdir_internal(struct rsfs *fs, char *path) {
+    return make_dir(fs, path); // insert a directory entry into the parent directory
+}
+
+//remove the directory at path
+//return 0 if succeed, or -1 if it does not exist, is a file or is not empty
+static int rmdir_internal(struct rsfs *fs, char *path) {
+    return remove_dir(fs, path); // unlink the directory entry from the parent directory
+}
+
+//list the directory at path into entries[0..max)
+//return the number of entries in the directory (may be more than max), or -1 if it is not a directory
+static int readdir_internal(struct rsfs *fs, char *path, struct rsfs_dirent *entries, int max) {
+    if (max < 0 || (max > 0 && !entries)) { // if the output buffer is invalid
+        return -1; // return failure
+    }
+    return list_dir(fs, path, entries, max); // copy the entries out under the directory's mutex
+}
+
+//seal the file of descriptor fd: flush it and make it read-only for good
+//fd must be open with RSFS_RDWR; it stays open as a sealed read-only descriptor
+//return 0 if succeed, or -1 otherwise
+static int seal_internal(struct rsfs *fs, int fd) {
+    struct open_file_entry *ofe = get_open_file_entry(fs, fd); // get the open file entry with the given file descriptor
+    if (!ofe || ofe->access_flag != RSFS_RDWR) { // if the file descriptor is not valid or not open for writing
+        return -1; // return failure
     }
+    struct inode *ino = &fs->inodes[ofe->inode_number]; // get the inode of the file
+    if (flush_entry(fs, ofe) < 0) { // if the buffered data can not be written out
+        return -1; // return failure
+    }
+    if (get_inode(fs, ofe->inode_number) < 0) { // the descriptor becomes a sealed reference, taken atomically as a delete or pin may update refcount meanwhile
+        return -1; // return failure: the file was deleted
+    }
+    ofe->access_flag = RSFS_RDONLY; // it can only read from now on
+    ofe->sealed = 1; // and close drops the reference
+    lock_block_map(fs, ino); // the log cleaner checks the seal under the block map, as it never moves sealed blocks
+    __atomic_store_n(&ino->sealed, 1, __ATOMIC_RELEASE); // publish the final length and blocks to sealed opens
+    unlock_block_map(fs, ino); // let the log cleaner in again
+    pthread_mutex_unlock(&ino->rw_mutex); // let waiting openers in; they see the seal and take the sealed path
+    return 0; // return success
+}
+
+void rsfs_stat(struct rsfs *fs){
+    struct rsfs_stats stats;
+    rsfs_stats_snapshot(fs, &stats);
+
+    lock_mutex(fs, &fs->mutex_for_fs_stat, RSFS_LOCK_FS_STAT);
+    printf("\nCurrent status of the file system:\n\n %16s%10s%10s\n", "File Name", "Length", "iNode #");
+
+    //list files; directories show their number of entries as length
+    print_dir(fs, &fs->root_dir, "");
     
     //data blocks
-    int db_used=0;
-    for(int i=0; i<NUM_DBLOCKS; i++) db_used+=data_bitmap[i];
+    int db_used = NUM_DBLOCKS - stats.free_dblocks;
     printf("\nTotal Data Blocks: %4d,  Used: %d,  Unused: %d\n", NUM_DBLOCKS, db_used, NUM_DBLOCKS-db_used);
 
     //inodes
-    int inodes_used=0;
-    for(int i=0; i<NUM_INODES; i++) inodes_used+=inode_bitmap[i];
+    int inodes_used = NUM_INODES - stats.free_inodes;
     printf("Total iNode Blocks: %3d,  Used: %d,  Unused: %d\n", NUM_INODES, inodes_used, NUM_INODES-inodes_used);
 
     //open files
-    int of_num=0;
-    for(int i=0; i<NUM_OPEN_FILE; i++) of_num+=open_file_table[i].used;
-    printf("Total Opened Files: %3d\n\n", of_num);
-    pthread_mutex_unlock(&mutex_for_fs_stat);
-}
\ No newline at end of file
+    printf("Total Opened Files: %3d\n\n", stats.open_files);
+    pthread_mutex_unlock(&fs->mutex_for_fs_stat);
+}
+
+
+//api entry points: each call is counted and timed in the stats of fs (see stats.c) and traced (see trace.c)
+
+int rsfs_create(struct rsfs *fs, char *file_name){
+    uint64_t start = stats_now();
+    TRACE(fs, 'B', rsfs_op_names[RSFS_OP_CREATE]);
+    int ret = create_internal(fs, file_name);
+    TRACE(fs, 'E', rsfs_op_names[RSFS_OP_CREATE]);
+    stats_record(fs, RSFS_OP_CREATE, start, ret, 0);
+    return ret;
+}
+
+int rsfs_open(struct rsfs *fs, char *file_name, int access_flag){
+    uint64_t start = stats_now();
+    TRACE(fs, 'B', rsfs_op_names[RSFS_OP_OPEN]);
+    int ret = open_internal(fs, file_name, access_flag);
+    TRACE(fs, 'E', rsfs_op_names[RSFS_OP_OPEN]);
+    stats_record(fs, RSFS_OP_OPEN, start, ret, 0);
+    return ret;
+}
+
+int64_t rsfs_append(struct rsfs *fs, int fd, void *buf, int64_t size){
+    uint64_t start = stats_now();
+    TRACE(fs, 'B', rsfs_op_names[RSFS_OP_APPEND]);
+    int64_t ret = append_internal(fs, fd, buf, size);
+    TRACE(fs, 'E', rsfs_op_names[RSFS_OP_APPEND]);
+    stats_record(fs, RSFS_OP_APPEND, start, ret, ret);
+    return ret;
+}
+
+int64_t rsfs_fseek(struct rsfs *fs, int fd, int64_t offset){
+    uint64_t start = stats_now();
+    TRACE(fs, 'B', rsfs_op_names[RSFS_OP_FSEEK]);
+    int64_t ret = fseek_internal(fs, fd, offset);
+    TRACE(fs, 'E', rsfs_op_names[RSFS_OP_FSEEK]);
+    stats_record(fs, RSFS_OP_FSEEK, start, ret, 0);
+    return ret;
+}
+
+int64_t rsfs_read(struct rsfs *fs, int fd, void *buf, int64_t size){
+    uint64_t start = stats_now();
+    TRACE(fs, 'B', rsfs_op_names[RSFS_OP_READ]);
+    int64_t ret = read_internal(fs, fd, buf, size);
+    TRACE(fs, 'E', rsfs_op_names[RSFS_OP_READ]);
+    stats_record(fs, RSFS_OP_READ, start, ret, ret);
+    return ret;
+}
+
+int rsfs_close(struct rsfs *fs, int fd){
+    uint64_t start = stats_now();
+    TRACE(fs, 'B', rsfs_op_names[RSFS_OP_CLOSE]);
+    int ret = close_internal(fs, fd);
+    TRACE(fs, 'E', rsfs_op_names[RSFS_OP_CLOSE]);
+    stats_record(fs, RSFS_OP_CLOSE, start, ret, 0);
+    return ret;
+}
+
+int rsfs_delete(struct rsfs *fs, char *file_name){
+    uint64_t start = stats_now();
+    TRACE(fs, 'B', rsfs_op_names[RSFS_OP_DELETE]);
+    int ret = delete_internal(fs, file_name);
+    TRACE(fs, 'E', rsfs_op_names[RSFS_OP_DELETE]);
+    stats_record(fs, RSFS_OP_DELETE, start, ret, 0);
+    return ret;
+}
+
+int64_t rsfs_write(struct rsfs *fs, int fd, void *buf, int64_t size){
+    uint64_t start = stats_now();
+    TRACE(fs, 'B', rsfs_op_names[RSFS_OP_WRITE]);
+    int64_t ret = write_internal(fs, fd, buf, size);
+    TRACE(fs, 'E', rsfs_op_names[RSFS_OP_WRITE]);
+    stats_record(fs, RSFS_OP_WRITE, start, ret, ret);
+    return ret;
+}
+
+int64_t rsfs_cut(struct rsfs *fs, int fd, int64_t size){
+    uint64_t start = stats_now();
+    TRACE(fs, 'B', rsfs_op_names[RSFS_OP_CUT]);
+    int64_t ret = cut_internal(fs, fd, size);
+    TRACE(fs, 'E', rsfs_op_names[RSFS_OP_CUT]);
+    stats_record(fs, RSFS_OP_CUT, start, ret, ret);
+    return ret;
+}
+
+int rsfs_fallocate(struct rsfs *fs, int fd, int64_t offset, int64_t len){
+    uint64_t start = stats_now();
+    TRACE(fs, 'B', rsfs_op_names[RSFS_OP_FALLOCATE]);
+    int ret = fallocate_internal(fs, fd, offset, len);
+    TRACE(fs, 'E', rsfs_op_names[RSFS_OP_FALLOCATE]);
+    stats_record(fs, RSFS_OP_FALLOCATE, start, ret, 0);
+    return ret;
+}
+
+int rsfs_truncate(struct rsfs *fs, int fd, int64_t length){
+    uint64_t start = stats_now();
+    TRACE(fs, 'B', rsfs_op_names[RSFS_OP_TRUNCATE]);
+    int ret = truncate_internal(fs, fd, length);
+    TRACE(fs, 'E', rsfs_op_names[RSFS_OP_TRUNCATE]);
+    stats_record(fs, RSFS_OP_TRUNCATE, start, ret, 0);
+    return ret;
+}
+
+int rsfs_flush(struct rsfs *fs, int fd){
+    uint64_t start = stats_now();
+    TRACE(fs, 'B', rsfs_op_names[RSFS_OP_FLUSH]);
+    int ret = flush_internal(fs, fd);
+    TRACE(fs, 'E', rsfs_op_names[RSFS_OP_FLUSH]);
+    stats_record(fs, RSFS_OP_FLUSH, start, ret, 0);
+    return ret;
+}
+
+int rsfs_mkdir(struct rsfs *fs, char *path){
+    uint64_t start = stats_now();
+    TRACE(fs, 'B', rsfs_op_names[RSFS_OP_MKDIR]);
+    int ret = mkdir_internal(fs, path);
+    TRACE(fs, 'E', rsfs_op_names[RSFS_OP_MKDIR]);
+    stats_record(fs, RSFS_OP_MKDIR, start, ret, 0);
+    return ret;
+}
+
+int rsfs_rmdir(struct rsfs *fs, char *path){
+    uint64_t start = stats_now();
+    TRACE(fs, 'B', rsfs_op_names[RSFS_OP_RMDIR]);
+    int ret = rmdir_internal(fs, path);
+    TRACE(fs, 'E', rsfs_op_names[RSFS_OP_RMDIR]);
+    stats_record(fs, RSFS_OP_RMDIR, start, ret, 0);
+    return ret;
+}
+
+int rsfs_readdir(struct rsfs *fs, char *path, struct rsfs_dirent *entries, int max){
+    uint64_t start = stats_now();
+    TRACE(fs, 'B', rsfs_op_names[RSFS_OP_READDIR]);
+    int ret = readdir_internal(fs, path, entries, max);
+    TRACE(fs, 'E', rsfs_op_names[RSFS_OP_READDIR]);
+    stats_record(fs, RSFS_OP_READDIR, start, ret, 0);
+    return ret;
+}
+
+int rsfs_seal(struct rsfs *fs, int fd){
+    uint64_t start = stats_now();
+    TRACE(fs, 'B', rsfs_op_names[RSFS_OP_SEAL]);
+    int ret = seal_internal(fs, fd);
+    TRACE(fs, 'E', rsfs_op_names[RSFS_OP_SEAL]);
+    stats_record(fs, RSFS_OP_SEAL, start, ret, 0);
+    return ret;
+}
@@ -283,6 +283,68 @@ void test_isolated(){
 
 
 
+//create and delete files in one directory many times over: the entries and names of the deleted
+//files are reused, so the directory's pool and arena stop growing after the first round
+void test_churn(){
+    struct rsfs *fs = rsfs_init();
+    if(fs==NULL){
+        printf("[test_churn] fail to initialize a volume.\n");
+        return;
+    }
+    char *names[3] = {"a", "churned_file", "a_much_longer_churned_file_name"};
+    int chunks[2] = {0, 0};
+    for(int round=0; round<2; round++){
+        for(int i=0; i<DIR_POOL_ENTRIES*8; i++){
+            char *name = names[i%3];
+            if(rsfs_create(fs, name)!=0 || rsfs_delete(fs, name)!=0){
+                printf("[test_churn] fail to create and delete file: %s.\n", name);
+                break;
+            }
+        }
+        for(struct dir_chunk *c = fs->root_dir.pool; c; c = c->next) chunks[round]++;
+        for(struct dir_chunk *c = fs->root_dir.arena; c; c = c->next) chunks[round]++;
+    }
+    printf("[test_churn] %d create/delete cycles: %d chunks of entries and names after the first half, %d after all: %s\n",
+        2*DIR_POOL_ENTRIES*8, chunks[0], chunks[1], chunks[0]==chunks[1] ? "reused" : "FAILED, still growing");
+    rsfs_destroy(fs);
+}
+
+//test: a close whose flush fails reports it; on a log volume, a sealed block in every segment but the head
+//leaves no segment the cleaner can free, so the block a buffered append needs can not be taken at close
+void test_full_close(){
+    struct rsfs *fs = rsfs_format(RSFS_LAYOUT_LOG);
+    if(fs==NULL){
+        printf("[test_full_close] fail to initialize a volume.\n");
+        return;
+    }
+    char block[BLOCK_SIZE];
+    memset(block, 'f', BLOCK_SIZE);
+    char name[] = "sealed_0";
+    rsfs_create(fs, "rewritten");
+    for(int i=0; i<NUM_INODES-1; i++){
+        name[7] = '0'+i;
+        rsfs_create(fs, name);
+        int fd = rsfs_open(fs, name, RSFS_RDWR);
+        rsfs_write(fs, fd, block, BLOCK_SIZE);
+        rsfs_seal(fs, fd);
+        rsfs_close(fs, fd);
+        //move the head of the log on, so the next sealed block lands in another segment
+        for(int j=0; j<SEGMENT_BLOCKS; j++){
+            fd = rsfs_open(fs, "rewritten", RSFS_RDWR);
+            rsfs_write(fs, fd, block, BLOCK_SIZE);
+            rsfs_close(fs, fd);
+        }
+    }
+    int fd = rsfs_open(fs, "rewritten", RSFS_RDWR);
+    rsfs_fseek(fs, fd, BLOCK_SIZE);
+    int64_t written = rsfs_write(fs, fd, block, BLOCK_SIZE); //only reserved: the block is taken when flushed
+    int ret = rsfs_close(fs, fd);
+    printf("[test_full_close] buffered %lld bytes on a full log, close returned %d: %s\n",
+        (long long)written, ret, (written==BLOCK_SIZE && ret==-1) ? "reported" : "FAILED, the lost bytes were not reported");
+    rsfs_destroy(fs);
+}
+
+
 //test: reader-writer problem
 void main(){
 
@@ -297,6 +359,12 @@ void main(){
     printf("\n\n-------------------Test for Isolated Cases-------------------------\n\n");
     test_isolated();
 
+    printf("\n\n--------Test for Directory Churn-----------\n\n");
+    test_churn();
+
+    printf("\n\n--------Test for Close on a Full Volume-----------\n\n");
+    test_full_close();
+
     printf("\n\n--------Test for Concurrent Readers/Writers-----------\n\n");
     test_concurrency();
 }
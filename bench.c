@@ -0,0 +1,832 @@
+/*
+    benchmark suite for the RSFS API
+
+    usage: ./bench [-w workload,...] [-t max_threads] [-n ops_per_thread] [-s io_size]
+                   [-r read_percent] [-V shared|sharded|both] [-L inplace|log|both]
+                   [-b baseline.json] [-T threshold_percent] [-x trace.json]
+
+    every workload is run with 1, 2, 4, ... max_threads threads; each thread times every
+    operation it issues, and one JSON line per (workload, threads, volumes, layout) is printed with
+    ops/sec and p50/p99/p999 latency. Save the output and pass it back with -b to compare:
+    each result then also carries the baseline ops/sec and the change in percent, and the
+    exit status is 1 if any result is slower than the baseline by more than the threshold.
+    -x traces the whole run and writes the last events of every thread to the given file.
+    where the CPU's counters can be read (perf_event_open), each result also reports cache
+    references and misses per operation, counted in user space over every thread's op loop.
+
+    volumes: "shared" runs all threads on one volume (one file per thread),
+             "sharded" gives every thread its own volume pinned to a core
+    layout: "inplace" or "log" (see log.c) is passed to rsfs_format(); log runs also report
+            the blocks written and moved by the cleaner per operation
+    the large workloads stream LARGE_IO_SIZE bytes per operation over a file of LARGE_FILE_SIZE bytes
+    per thread, held in large blocks (see blockmap.c); they only run in place, as files of the
+    log-structured layout stay small, and also report MB/sec; randpeek and mmappeek read PEEK_SIZE
+    bytes at random offsets of such a file, with rsfs_fseek() and rsfs_read() or through rsfs_mmap(),
+    on volumes formatted with RSFS_MEMFD
+    the bulk workloads (import, export, scan) are driven by one thread whose operations each run on a
+    pool of the run's threads (see bulk.c), over NUM_INODES files of BULK_FILE_SIZE bytes: import copies
+    a tree of the host under /tmp into the volume, export copies it back out, and scan searches it for
+    a string planted in every file; they run at most POOLED_OPS operations, on shared volumes in place,
+    and also report GB/sec
+*/
+
+#define _GNU_SOURCE
+#include "def.h"
+#include <sched.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdint.h>
+#include <ftw.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#define MAX_FILE_SIZE TAIL_SIZE //file size of the small workloads: the largest file of a log-structured volume
+#define LARGE_FILE_SIZE (16*1024*1024) //file size of the large workloads
+#define LARGE_IO_SIZE LARGE_BLOCK_SIZE //bytes per operation of the large workloads
+#define PEEK_SIZE 8 //bytes read per operation by randpeek and mmappeek
+#define BULK_FILE_SIZE (8*1024*1024) //size of every file of the bulk workloads
+#define BULK_BYTES ((int64_t)NUM_INODES * BULK_FILE_SIZE) //bytes copied or searched per operation of the bulk workloads
+#define POOLED_OPS 8 //most operations of a run of a bulk workload
+#define SCAN_NEEDLE "zyxwvu-needle" //string planted in the files of the bulk workloads
+#define BUF_SIZE (LARGE_IO_SIZE > MAX_FILE_SIZE ? LARGE_IO_SIZE : MAX_FILE_SIZE)
+#define MAX_RESULTS 256 //results kept from a baseline file
+#define LOOKUP_DIR_SIZE 4096 //entries of the directory searched by the lookup workload
+
+//settings from the command line
+struct bench_config{
+    int max_threads;
+    int ops; //operations per thread
+    int io_size; //bytes per read/write/append/cut
+    int read_pct; //share of RSFS_RDONLY opens in the open/close mix
+    int threshold_pct; //slowdown against the baseline that counts as a regression
+};
+
+struct bench_arg{
+    struct rsfs *fs; //volume this thread works on
+    int id;
+    int pin; //1-pin the thread to core id % number of cores
+    const struct bench_config *cfg;
+    char name[16]; //file of this thread
+    int fd; //descriptor opened by setup, -1 if none
+    struct rsfs_stream *stream; //stream opened by setup, NULL if none
+    char *map; //mapping of the file made by setup, NULL if none
+    int pool_threads; //threads of the pool the ops of a pooled workload run on
+    int64_t pos; //file position kept by sequential workloads
+    unsigned int seed; //for rand_r()
+    char *buf; //io buffer of BUF_SIZE bytes
+    uint64_t *lat; //latency of each operation in ns
+    int done; //number of timed operations
+    int counted; //1 if the cache counters below were read
+    uint64_t cache_refs; //cache references during the op loop
+    uint64_t cache_misses; //cache misses during the op loop
+};
+
+//a workload: prepare runs once per volume and setup/teardown once per thread, all outside
+//the timed region; op runs cfg->ops times and is timed on its own (op returns -1 to stop
+//the thread), and after, if any, runs untimed after each op
+struct workload{
+    const char *name;
+    void (*prepare)(struct rsfs *fs);
+    void (*setup)(struct bench_arg *arg);
+    int (*op)(struct bench_arg *arg);
+    void (*after)(struct bench_arg *arg);
+    void (*teardown)(struct bench_arg *arg);
+    int large; //1: works on a file of LARGE_FILE_SIZE bytes, which only volumes in place hold
+    int format_flags; //or'ed into the layout passed to rsfs_format()
+    int pooled; //1: one thread issues the ops, each of which runs on a pool of the run's threads
+};
+
+//one result line of a baseline file
+struct result{
+    char workload[32];
+    char volumes[16];
+    char layout[16];
+    int threads;
+    double ops_per_sec;
+};
+
+static char shared_name[] = "shared"; //file opened by every thread in the open/close workload
+static char deep_name[] = "d0/d1/d2/d3/d4/d5/d6/d7/shared"; //file opened by every thread in the deep-path workload
+
+static char lookup_paths[LOOKUP_DIR_SIZE][32]; //"big/<name>" for each entry of the lookup directory
+static char host_root[64]; //host directory of the bulk workloads, made by the first one run
+
+static uint64_t now_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+//open a counter of the calling thread's user-space hardware cache events (config); -1 if unavailable
+static int open_counter(uint64_t config){
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void pin_to_core(int id){
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if(ncpu<=0) return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(id % ncpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+
+//helpers shared by the workloads
+
+//create and open the thread's file; fill it with size bytes
+static void open_own_file(struct bench_arg *arg, int size){
+    rsfs_create(arg->fs, arg->name);
+    arg->fd = rsfs_open(arg->fs, arg->name, RSFS_RDWR);
+    if(arg->fd>=0 && size>0){
+        rsfs_write(arg->fs, arg->fd, arg->buf, size);
+        rsfs_flush(arg->fs, arg->fd);
+    }
+    arg->pos = 0;
+}
+
+static void close_own_file(struct bench_arg *arg){
+    if(arg->fd>=0) rsfs_close(arg->fs, arg->fd);
+    rsfs_delete(arg->fs, arg->name);
+    arg->fd = -1;
+}
+
+static void setup_empty(struct bench_arg *arg){ open_own_file(arg, 0); }
+static void setup_full(struct bench_arg *arg){ open_own_file(arg, MAX_FILE_SIZE); }
+
+static int io_size(struct bench_arg *arg){
+    int size = arg->cfg->io_size;
+    return (size > MAX_FILE_SIZE) ? MAX_FILE_SIZE : size;
+}
+
+//next sequential offset; wraps to the start of the file when the end is reached
+static int next_seq(struct bench_arg *arg, int size){
+    if(arg->pos + size > MAX_FILE_SIZE) arg->pos = 0;
+    int pos = arg->pos;
+    arg->pos += size;
+    return pos;
+}
+
+static int next_rand(struct bench_arg *arg, int size){
+    return rand_r(&arg->seed) % (MAX_FILE_SIZE - size + 1);
+}
+
+
+//workloads
+
+//create/delete churn
+static int op_churn(struct bench_arg *arg){
+    if(rsfs_create(arg->fs, arg->name)!=0) return -1;
+    return rsfs_delete(arg->fs, arg->name);
+}
+
+//open/close of one file shared by all threads, with read_pct percent readers
+static void prepare_openclose(struct rsfs *fs){
+    rsfs_create(fs, shared_name);
+}
+static int op_openclose(struct bench_arg *arg){
+    int flag = (rand_r(&arg->seed) % 100 < arg->cfg->read_pct) ? RSFS_RDONLY : RSFS_RDWR;
+    int fd = rsfs_open(arg->fs, shared_name, flag);
+    if(fd<0) return -1;
+    return rsfs_close(arg->fs, fd);
+}
+
+//open, read io_size bytes and close, read-only, on one full file shared by all threads;
+//openread goes through the reader/writer protocol, sealedread opens the file after rsfs_seal()
+static void prepare_shared_full(struct rsfs *fs, int seal){
+    char buf[MAX_FILE_SIZE];
+    memset(buf, 's', sizeof(buf));
+    rsfs_create(fs, shared_name);
+    int fd = rsfs_open(fs, shared_name, RSFS_RDWR);
+    rsfs_write(fs, fd, buf, sizeof(buf));
+    if(seal) rsfs_seal(fs, fd);
+    rsfs_close(fs, fd);
+}
+static void prepare_openread(struct rsfs *fs){ prepare_shared_full(fs, 0); }
+static void prepare_sealedread(struct rsfs *fs){ prepare_shared_full(fs, 1); }
+static int op_openread(struct bench_arg *arg){
+    int fd = rsfs_open(arg->fs, shared_name, RSFS_RDONLY);
+    if(fd<0) return -1;
+    int ret = rsfs_read(arg->fs, fd, arg->buf, io_size(arg));
+    rsfs_close(arg->fs, fd);
+    return ret;
+}
+
+//lookup of a random name in a directory of LOOKUP_DIR_SIZE entries, so most lookups miss the
+//dentry cache and search the directory's index; one in four names does not exist.
+//entries are directories (they take no inode); names alternate between ones that fit
+//the inline prefix of dir_entry and longer ones
+static void prepare_lookup(struct rsfs *fs){
+    rsfs_mkdir(fs, "big");
+    for(int i=0; i<LOOKUP_DIR_SIZE; i++){
+        if(i%2) snprintf(lookup_paths[i], sizeof(lookup_paths[i]), "big/entry_%d_long", i*7919);
+        else snprintf(lookup_paths[i], sizeof(lookup_paths[i]), "big/e%d", i*7919);
+        if(i%4!=3) rsfs_mkdir(fs, lookup_paths[i]);
+    }
+}
+static int op_lookup(struct bench_arg *arg){
+    int i = rand_r(&arg->seed) % LOOKUP_DIR_SIZE;
+    struct dir_entry *dir_entry = search_dir(arg->fs, lookup_paths[i]);
+    return (dir_entry!=NULL) == (i%4!=3) ? 0 : -1; //stop if a lookup is wrong
+}
+
+//read-only open/close of a file eight directories deep, i.e. path resolution
+static void prepare_deepopen(struct rsfs *fs){
+    char path[sizeof(deep_name)];
+    for(int i=3; i<(int)sizeof(deep_name); i+=3){ //each "dN/" prefix
+        memcpy(path, deep_name, i-1);
+        path[i-1] = '\0';
+        rsfs_mkdir(fs, path);
+    }
+    rsfs_create(fs, deep_name);
+}
+static int op_deepopen(struct bench_arg *arg){
+    int fd = rsfs_open(arg->fs, deep_name, RSFS_RDONLY);
+    if(fd<0) return -1;
+    return rsfs_close(arg->fs, fd);
+}
+
+//sequential read of a whole file shared by all threads whose blocks alternate with those of a
+//deleted file; defragread lets the defragmenter make it contiguous first. Each thread keeps the
+//file open for reading, so the defragmenter, which skips open files, is stopped before
+static void make_fragmented(struct rsfs *fs){
+    char buf[BLOCK_SIZE];
+    memset(buf, 'f', sizeof(buf));
+    rsfs_create(fs, shared_name);
+    rsfs_create(fs, "pad");
+    int fd = rsfs_open(fs, shared_name, RSFS_RDWR);
+    int pad = rsfs_open(fs, "pad", RSFS_RDWR);
+    for(int i=0; i<NUM_POINTER; i++){
+        rsfs_append(fs, fd, buf, BLOCK_SIZE);
+        rsfs_flush(fs, fd);
+        rsfs_append(fs, pad, buf, BLOCK_SIZE);
+        rsfs_flush(fs, pad);
+    }
+    rsfs_close(fs, pad);
+    rsfs_close(fs, fd);
+    rsfs_delete(fs, "pad");
+}
+static int shared_extents(struct rsfs *fs){
+    struct rsfs_dirent entries[4];
+    int n = rsfs_readdir(fs, "", entries, 4);
+    for(int i=0; i<n && i<4; i++) if(strcmp(entries[i].name, shared_name)==0) return entries[i].extents;
+    return -1;
+}
+static void prepare_fragread(struct rsfs *fs){
+    make_fragmented(fs);
+}
+static void prepare_defragread(struct rsfs *fs){
+    make_fragmented(fs);
+    if(rsfs_defrag_start(fs, 0)<0) return; //the log-structured layout has no defragmenter
+    for(int i=0; i<1000 && shared_extents(fs)>1; i++) usleep(1000);
+    rsfs_defrag_stop(fs);
+}
+static void setup_shared_reader(struct bench_arg *arg){
+    arg->fd = rsfs_open(arg->fs, shared_name, RSFS_RDONLY);
+}
+static void close_shared_reader(struct bench_arg *arg){
+    if(arg->fd>=0) rsfs_close(arg->fs, arg->fd);
+    arg->fd = -1;
+}
+static int op_wholeread(struct bench_arg *arg){
+    rsfs_fseek(arg->fs, arg->fd, 0);
+    return rsfs_read(arg->fs, arg->fd, arg->buf, MAX_FILE_SIZE);
+}
+
+static int op_seqwrite(struct bench_arg *arg){
+    int size = io_size(arg);
+    rsfs_fseek(arg->fs, arg->fd, next_seq(arg, size));
+    return rsfs_write(arg->fs, arg->fd, arg->buf, size);
+}
+
+static int op_seqread(struct bench_arg *arg){
+    int size = io_size(arg);
+    rsfs_fseek(arg->fs, arg->fd, next_seq(arg, size));
+    return rsfs_read(arg->fs, arg->fd, arg->buf, size);
+}
+
+static int op_randwrite(struct bench_arg *arg){
+    int size = io_size(arg);
+    rsfs_fseek(arg->fs, arg->fd, next_rand(arg, size));
+    return rsfs_write(arg->fs, arg->fd, arg->buf, size);
+}
+
+static int op_randread(struct bench_arg *arg){
+    int size = io_size(arg);
+    rsfs_fseek(arg->fs, arg->fd, next_rand(arg, size));
+    return rsfs_read(arg->fs, arg->fd, arg->buf, size);
+}
+
+//append stream; the file is emptied (untimed) when it is full
+static int op_append(struct bench_arg *arg){
+    int size = io_size(arg);
+    if(arg->pos + size > MAX_FILE_SIZE){
+        rsfs_truncate(arg->fs, arg->fd, 0);
+        arg->pos = 0;
+    }
+    rsfs_fseek(arg->fs, arg->fd, arg->pos);
+    int ret = rsfs_append(arg->fs, arg->fd, arg->buf, size);
+    arg->pos += size;
+    return ret;
+}
+
+//append stream through a buffered stream (rsfs_fopen); compare with append at a small -s.
+//The file is emptied when it is full, which also flushes the buffer
+static void setup_stream(struct bench_arg *arg){
+    rsfs_create(arg->fs, arg->name);
+    arg->stream = rsfs_fopen(arg->fs, arg->name, RSFS_APPEND);
+    arg->pos = 0;
+}
+static void close_stream(struct bench_arg *arg){
+    if(arg->stream) rsfs_fclose(arg->stream);
+    rsfs_delete(arg->fs, arg->name);
+    arg->stream = NULL;
+}
+static int op_streamappend(struct bench_arg *arg){
+    if(arg->stream==NULL) return -1;
+    int size = io_size(arg);
+    if(arg->pos + size > MAX_FILE_SIZE){
+        rsfs_fflush(arg->stream);
+        rsfs_truncate(arg->fs, arg->stream->fd, 0); //the next write goes to the new end
+        arg->pos = 0;
+    }
+    int ret = rsfs_fwrite(arg->stream, arg->buf, size);
+    arg->pos += size;
+    return ret;
+}
+
+//sequential writes and reads of LARGE_IO_SIZE bytes over a file of LARGE_FILE_SIZE bytes, wrapping
+//at its end; largewrite starts from an empty file, so its first pass also allocates the blocks
+static int64_t next_large(struct bench_arg *arg){
+    if(arg->pos + LARGE_IO_SIZE > LARGE_FILE_SIZE) arg->pos = 0;
+    int64_t pos = arg->pos;
+    arg->pos += LARGE_IO_SIZE;
+    return pos;
+}
+static void setup_large(struct bench_arg *arg){
+    open_own_file(arg, 0);
+    for(int64_t pos=0; arg->fd>=0 && pos<LARGE_FILE_SIZE; pos+=LARGE_IO_SIZE){
+        if(rsfs_write(arg->fs, arg->fd, arg->buf, LARGE_IO_SIZE)!=LARGE_IO_SIZE) break;
+    }
+    rsfs_flush(arg->fs, arg->fd);
+}
+static int op_largewrite(struct bench_arg *arg){
+    rsfs_fseek(arg->fs, arg->fd, next_large(arg));
+    return rsfs_write(arg->fs, arg->fd, arg->buf, LARGE_IO_SIZE)==LARGE_IO_SIZE ? 0 : -1;
+}
+static int op_largeread(struct bench_arg *arg){
+    if(rsfs_fseek(arg->fs, arg->fd, next_large(arg))<0) return -1;
+    return rsfs_read(arg->fs, arg->fd, arg->buf, LARGE_IO_SIZE)==LARGE_IO_SIZE ? 0 : -1;
+}
+
+//random reads of PEEK_SIZE bytes in a file of LARGE_FILE_SIZE bytes: randpeek copies them out with
+//rsfs_read(), mmappeek loads them from a mapping of the whole file made in setup
+static int64_t next_peek(struct bench_arg *arg){
+    return rand_r(&arg->seed) % (LARGE_FILE_SIZE - PEEK_SIZE + 1);
+}
+static void setup_mapped(struct bench_arg *arg){
+    setup_large(arg);
+    arg->map = rsfs_mmap(arg->fs, arg->fd, 0, LARGE_FILE_SIZE);
+}
+static void close_mapped(struct bench_arg *arg){
+    if(arg->map) rsfs_munmap(arg->fs, arg->map);
+    arg->map = NULL;
+    close_own_file(arg);
+}
+static int op_randpeek(struct bench_arg *arg){
+    rsfs_fseek(arg->fs, arg->fd, next_peek(arg));
+    return rsfs_read(arg->fs, arg->fd, arg->buf, PEEK_SIZE)==PEEK_SIZE ? 0 : -1;
+}
+static int op_mmappeek(struct bench_arg *arg){
+    if(arg->map==NULL) return -1;
+    memcpy(arg->buf, arg->map + next_peek(arg), PEEK_SIZE);
+    return 0;
+}
+
+//bulk copies and search over NUM_INODES files of BULK_FILE_SIZE bytes in two directories; the files
+//are laid out on the host once, with SCAN_NEEDLE planted across the end of the first large block
+//and in the middle of each; export and scan work on a copy imported into "imp" by prepare
+static void bulk_path(char *path, int size, const char *root, int k){
+    snprintf(path, size, "%s/d%d/f%d", root, k%2, k);
+}
+static int make_host_tree(){
+    if(host_root[0]) return 0;
+    snprintf(host_root, sizeof(host_root), "/tmp/rsfs_bench_%d", (int)getpid());
+    char path[128];
+    char *buf = malloc(BULK_FILE_SIZE);
+    if(buf==NULL) return -1;
+    for(int i=0; i<BULK_FILE_SIZE; i++) buf[i] = 'a' + i%26;
+    memcpy(buf + LARGE_BLOCK_SIZE - 3, SCAN_NEEDLE, strlen(SCAN_NEEDLE));
+    memcpy(buf + BULK_FILE_SIZE/2, SCAN_NEEDLE, strlen(SCAN_NEEDLE));
+    char root[96];
+    snprintf(root, sizeof(root), "%s/src", host_root);
+    mkdir(host_root, 0777);
+    mkdir(root, 0777);
+    for(int d=0; d<2; d++){
+        snprintf(path, sizeof(path), "%s/d%d", root, d);
+        mkdir(path, 0777);
+    }
+    int ret = 0;
+    for(int k=0; k<NUM_INODES && ret==0; k++){
+        bulk_path(path, sizeof(path), root, k);
+        FILE *f = fopen(path, "w");
+        if(f==NULL || fwrite(buf, 1, BULK_FILE_SIZE, f)!=BULK_FILE_SIZE) ret = -1;
+        if(f) fclose(f);
+    }
+    free(buf);
+    return ret;
+}
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw){
+    (void)st; (void)flag; (void)ftw;
+    return remove(path);
+}
+static void remove_host_tree(){
+    if(host_root[0]) nftw(host_root, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+static void host_dir(char *path, int size, const char *name){
+    snprintf(path, size, "%s/%s", host_root, name);
+}
+static void prepare_import(struct rsfs *fs){
+    (void)fs;
+    if(make_host_tree()<0) exit(2);
+}
+static void prepare_export(struct rsfs *fs){
+    char src[96];
+    prepare_import(fs);
+    host_dir(src, sizeof(src), "src");
+    if(rsfs_import_dir(fs, src, "imp", 0)!=NUM_INODES) exit(2);
+}
+static int op_import(struct bench_arg *arg){
+    char src[96];
+    host_dir(src, sizeof(src), "src");
+    return rsfs_import_dir(arg->fs, src, "imp", arg->pool_threads)==NUM_INODES ? 0 : -1;
+}
+static void clear_import(struct bench_arg *arg){
+    char path[64];
+    for(int k=0; k<NUM_INODES; k++){
+        bulk_path(path, sizeof(path), "imp", k);
+        rsfs_delete(arg->fs, path);
+    }
+}
+static int op_export(struct bench_arg *arg){
+    char out[96];
+    host_dir(out, sizeof(out), "out");
+    return rsfs_export_dir(arg->fs, "imp", out, arg->pool_threads)==NUM_INODES ? 0 : -1;
+}
+static int op_scan(struct bench_arg *arg){
+    int64_t matches = rsfs_scan(arg->fs, SCAN_NEEDLE, strlen(SCAN_NEEDLE), arg->pool_threads, NULL, NULL);
+    return matches==2*NUM_INODES ? 0 : -1;
+}
+
+//cut at a random position of a full file; the file is refilled (untimed) afterwards
+static int op_cut(struct bench_arg *arg){
+    int size = io_size(arg);
+    rsfs_fseek(arg->fs, arg->fd, next_rand(arg, size));
+    return rsfs_cut(arg->fs, arg->fd, size);
+}
+static void refill_after_cut(struct bench_arg *arg){
+    rsfs_fseek(arg->fs, arg->fd, MAX_FILE_SIZE - io_size(arg));
+    rsfs_append(arg->fs, arg->fd, arg->buf, io_size(arg));
+}
+
+static struct workload workloads[] = {
+    {.name="churn", .op=op_churn},
+    {.name="openclose", .prepare=prepare_openclose, .op=op_openclose},
+    {.name="deepopen", .prepare=prepare_deepopen, .op=op_deepopen},
+    {.name="lookup", .prepare=prepare_lookup, .op=op_lookup},
+    {.name="openread", .prepare=prepare_openread, .op=op_openread},
+    {.name="sealedread", .prepare=prepare_sealedread, .op=op_openread},
+    {.name="seqwrite", .setup=setup_full, .op=op_seqwrite, .teardown=close_own_file},
+    {.name="seqread", .setup=setup_full, .op=op_seqread, .teardown=close_own_file},
+    {.name="randwrite", .setup=setup_full, .op=op_randwrite, .teardown=close_own_file},
+    {.name="randread", .setup=setup_full, .op=op_randread, .teardown=close_own_file},
+    {.name="append", .setup=setup_empty, .op=op_append, .teardown=close_own_file},
+    {.name="cut", .setup=setup_full, .op=op_cut, .after=refill_after_cut, .teardown=close_own_file},
+    {.name="streamappend", .setup=setup_stream, .op=op_streamappend, .teardown=close_stream},
+    {.name="fragread", .prepare=prepare_fragread, .setup=setup_shared_reader, .op=op_wholeread, .teardown=close_shared_reader},
+    {.name="defragread", .prepare=prepare_defragread, .setup=setup_shared_reader, .op=op_wholeread, .teardown=close_shared_reader},
+    {.name="largewrite", .setup=setup_empty, .op=op_largewrite, .teardown=close_own_file, .large=1},
+    {.name="largeread", .setup=setup_large, .op=op_largeread, .teardown=close_own_file, .large=1},
+    {.name="randpeek", .setup=setup_large, .op=op_randpeek, .teardown=close_own_file, .large=1, .format_flags=RSFS_MEMFD},
+    {.name="mmappeek", .setup=setup_mapped, .op=op_mmappeek, .teardown=close_mapped, .large=1, .format_flags=RSFS_MEMFD},
+    {.name="import", .prepare=prepare_import, .op=op_import, .after=clear_import, .large=1, .pooled=1},
+    {.name="export", .prepare=prepare_export, .op=op_export, .large=1, .pooled=1},
+    {.name="scan", .prepare=prepare_export, .op=op_scan, .large=1, .pooled=1},
+};
+#define NUM_WORKLOADS (int)(sizeof(workloads)/sizeof(workloads[0]))
+
+
+//driver
+
+static struct workload *current; //workload being run
+
+static void *bench_thread(void *ptr){
+    struct bench_arg *arg = (struct bench_arg *)ptr;
+
+    if(arg->pin) pin_to_core(arg->id);
+    if(current->setup) current->setup(arg);
+
+    int refs_fd = open_counter(PERF_COUNT_HW_CACHE_REFERENCES);
+    int misses_fd = open_counter(PERF_COUNT_HW_CACHE_MISSES);
+    if(refs_fd>=0 && misses_fd>=0){
+        ioctl(refs_fd, PERF_EVENT_IOC_ENABLE, 0);
+        ioctl(misses_fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+
+    for(int i=0; i<arg->cfg->ops; i++){
+        uint64_t start = now_ns();
+        int ret = current->op(arg);
+        arg->lat[arg->done++] = now_ns() - start;
+        if(ret<0) break;
+        if(current->after) current->after(arg);
+    }
+
+    if(refs_fd>=0 && misses_fd>=0){
+        ioctl(refs_fd, PERF_EVENT_IOC_DISABLE, 0);
+        ioctl(misses_fd, PERF_EVENT_IOC_DISABLE, 0);
+        arg->counted = read(refs_fd, &arg->cache_refs, sizeof(uint64_t))==sizeof(uint64_t)
+                && read(misses_fd, &arg->cache_misses, sizeof(uint64_t))==sizeof(uint64_t);
+    }
+    if(refs_fd>=0) close(refs_fd);
+    if(misses_fd>=0) close(misses_fd);
+
+    if(current->teardown) current->teardown(arg);
+    return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b){
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x>y) - (x<y);
+}
+
+static uint64_t percentile(uint64_t *sorted, int n, double p){
+    if(n==0) return 0;
+    int i = (int)(p * (n-1) + 0.5);
+    return sorted[i];
+}
+
+static struct result *find_result(struct result *results, int n, const char *workload, const char *volumes,
+        const char *layout, int threads){
+    for(int i=0; i<n; i++){
+        if(results[i].threads==threads && strcmp(results[i].workload, workload)==0
+                && strcmp(results[i].volumes, volumes)==0 && strcmp(results[i].layout, layout)==0){
+            return &results[i];
+        }
+    }
+    return NULL;
+}
+
+//run workload w with nthreads threads and print its result line;
+//return 1 if it regressed against the baseline, 0 otherwise
+static int run(struct workload *w, int nthreads, int sharded, int layout, const struct bench_config *cfg,
+        struct result *baseline, int num_baseline, int first){
+    int nvolumes = sharded ? nthreads : 1;
+    int nworkers = w->pooled ? 1 : nthreads; //a pooled workload is driven by one thread
+    struct bench_config pooled_cfg = *cfg;
+    if(w->pooled && pooled_cfg.ops > POOLED_OPS) pooled_cfg.ops = POOLED_OPS;
+    if(w->pooled) cfg = &pooled_cfg;
+    struct rsfs *fs[nvolumes];
+    pthread_t threads[nworkers];
+    struct bench_arg args[nworkers];
+
+    for(int i=0; i<nvolumes; i++){
+        fs[i] = rsfs_format(layout | w->format_flags);
+        if(fs[i]==NULL) exit(2);
+        if(w->prepare) w->prepare(fs[i]);
+    }
+    for(int i=0; i<nworkers; i++){
+        args[i].fs = fs[i % nvolumes];
+        args[i].id = i;
+        args[i].pin = sharded;
+        args[i].cfg = cfg;
+        snprintf(args[i].name, sizeof(args[i].name), "t%d", i);
+        args[i].fd = -1;
+        args[i].stream = NULL;
+        args[i].map = NULL;
+        args[i].pool_threads = nthreads;
+        args[i].pos = 0;
+        args[i].seed = 12345 + i;
+        args[i].buf = malloc(BUF_SIZE);
+        args[i].lat = malloc(sizeof(uint64_t) * cfg->ops);
+        args[i].done = 0;
+        args[i].counted = 0;
+        if(args[i].buf==NULL || args[i].lat==NULL) exit(2);
+        memset(args[i].buf, 'a' + i%26, BUF_SIZE);
+    }
+
+    current = w;
+    uint64_t start = now_ns();
+    for(int i=0; i<nworkers; i++) pthread_create(&threads[i], NULL, bench_thread, &args[i]);
+    for(int i=0; i<nworkers; i++) pthread_join(threads[i], NULL);
+    double elapsed = (now_ns() - start) / 1e9;
+
+    //merge the latencies and cache counters of all threads
+    int total = 0, counted = 1;
+    uint64_t cache_refs = 0, cache_misses = 0;
+    for(int i=0; i<nworkers; i++){
+        total += args[i].done;
+        counted &= args[i].counted;
+        cache_refs += args[i].cache_refs;
+        cache_misses += args[i].cache_misses;
+    }
+    uint64_t *lat = malloc(sizeof(uint64_t) * (total ? total : 1));
+    if(lat==NULL) exit(2);
+    for(int i=0, k=0; i<nworkers; i++){
+        memcpy(lat + k, args[i].lat, sizeof(uint64_t) * args[i].done);
+        k += args[i].done;
+        free(args[i].lat);
+        free(args[i].buf);
+    }
+    qsort(lat, total, sizeof(uint64_t), cmp_u64);
+
+    const char *volumes = sharded ? "sharded" : "shared";
+    const char *layout_name = (layout==RSFS_LAYOUT_LOG) ? "log" : "inplace";
+    double ops_per_sec = total / elapsed;
+    printf("%s{\"workload\":\"%s\",\"volumes\":\"%s\",\"layout\":\"%s\",\"threads\":%d,\"ops\":%d,\"ops_per_sec\":%.0f,"
+            "\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu",
+            first ? "    " : "   ,", w->name, volumes, layout_name, nthreads, total, ops_per_sec,
+            (unsigned long long)percentile(lat, total, 0.50),
+            (unsigned long long)percentile(lat, total, 0.99),
+            (unsigned long long)percentile(lat, total, 0.999));
+    if(w->op==op_largewrite || w->op==op_largeread){
+        printf(",\"mb_per_sec\":%.1f", ops_per_sec * LARGE_IO_SIZE / (1024.0 * 1024.0));
+    }
+    if(w->pooled){
+        printf(",\"gb_per_sec\":%.2f", ops_per_sec * BULK_BYTES / 1e9);
+    }
+    if(counted && total>0){
+        printf(",\"cache_refs_per_op\":%.1f,\"cache_misses_per_op\":%.2f,\"cache_miss_pct\":%.1f",
+                (double)cache_refs / total, (double)cache_misses / total,
+                cache_refs ? cache_misses * 100.0 / cache_refs : 0.0);
+    }
+    if(w->prepare==prepare_fragread || w->prepare==prepare_defragread){
+        printf(",\"extents\":%d", shared_extents(fs[0])); //fragmentation of the file read
+    }
+    if(layout==RSFS_LAYOUT_LOG && total>0){
+        //the log's write and cleaning cost, summed over the volumes (prepare and setup included)
+        struct rsfs_log_stats log = {0};
+        for(int i=0; i<nvolumes; i++){
+            struct rsfs_stats stats;
+            rsfs_stats_snapshot(fs[i], &stats);
+            log.blocks_written += stats.log.blocks_written;
+            log.blocks_moved += stats.log.blocks_moved;
+            log.segments_cleaned += stats.log.segments_cleaned;
+            log.foreground_runs += stats.log.foreground_runs;
+        }
+        printf(",\"log_blocks_per_op\":%.2f,\"log_moves_per_op\":%.2f,\"log_segments_cleaned\":%llu,\"log_foreground_cleans\":%llu",
+                (double)log.blocks_written / total, (double)log.blocks_moved / total,
+                (unsigned long long)log.segments_cleaned, (unsigned long long)log.foreground_runs);
+    }
+
+    int regressed = 0;
+    struct result *base = find_result(baseline, num_baseline, w->name, volumes, layout_name, nthreads);
+    if(base){
+        double change = (ops_per_sec - base->ops_per_sec) * 100.0 / base->ops_per_sec;
+        regressed = (change < -cfg->threshold_pct);
+        printf(",\"baseline_ops_per_sec\":%.0f,\"change_pct\":%.1f,\"regression\":%s",
+                base->ops_per_sec, change, regressed ? "true" : "false");
+        if(regressed){
+            fprintf(stderr, "[bench] regression: %s/%s/%s/%d threads: %.0f -> %.0f ops/sec (%.1f%%)\n",
+                    w->name, volumes, layout_name, nthreads, base->ops_per_sec, ops_per_sec, change);
+        }
+    }
+    printf("}\n");
+    fflush(stdout);
+
+    free(lat);
+    for(int i=0; i<nvolumes; i++) rsfs_destroy(fs[i]);
+    return regressed;
+}
+
+//read the result lines of an earlier run; a result without a layout (older runs) is "inplace";
+//return the number of results
+static int load_baseline(const char *path, struct result *results){
+    FILE *f = fopen(path, "r");
+    if(f==NULL){
+        fprintf(stderr, "[bench] cannot open baseline %s\n", path);
+        return 0;
+    }
+    int n = 0;
+    char line[1024];
+    while(n<MAX_RESULTS && fgets(line, sizeof(line), f)){
+        char *p = strstr(line, "{\"workload\":");
+        if(p==NULL) continue;
+        struct result *r = &results[n];
+        char *layout = strstr(p, "\"layout\":");
+        char *threads = strstr(p, "\"threads\":");
+        strcpy(r->layout, "inplace");
+        if(layout && sscanf(layout, "\"layout\":\"%15[^\"]\"", r->layout)!=1) continue;
+        if(sscanf(p, "{\"workload\":\"%31[^\"]\",\"volumes\":\"%15[^\"]\"", r->workload, r->volumes)==2
+                && threads && sscanf(threads, "\"threads\":%d,\"ops\":%*d,\"ops_per_sec\":%lf", &r->threads, &r->ops_per_sec)==2){
+            n++;
+        }
+    }
+    fclose(f);
+    return n;
+}
+
+static void usage(const char *prog){
+    fprintf(stderr, "usage: %s [-w workload,...] [-t max_threads] [-n ops_per_thread] [-s io_size]\n"
+            "          [-r read_percent] [-V shared|sharded|both] [-L inplace|log|both]\n"
+            "          [-b baseline.json] [-T threshold_percent] [-x trace.json]\n"
+            "workloads:", prog);
+    for(int i=0; i<NUM_WORKLOADS; i++) fprintf(stderr, " %s", workloads[i].name);
+    fprintf(stderr, "\n");
+    exit(2);
+}
+
+int main(int argc, char *argv[]){
+    struct bench_config cfg = {NUM_INODES, 20000, BLOCK_SIZE, 80, 10};
+    char *selected = NULL; //comma-separated workload names; NULL runs all
+    char *baseline_path = NULL;
+    char *trace_path = NULL;
+    int run_shared = 1, run_sharded = 0;
+    int run_inplace = 1, run_log = 0;
+
+    int opt;
+    while((opt = getopt(argc, argv, "w:t:n:s:r:V:L:b:T:x:h"))!=-1){
+        switch(opt){
+            case 'w': selected = optarg; break;
+            case 't': cfg.max_threads = atoi(optarg); break;
+            case 'n': cfg.ops = atoi(optarg); break;
+            case 's': cfg.io_size = atoi(optarg); break;
+            case 'r': cfg.read_pct = atoi(optarg); break;
+            case 'V':
+                run_shared = strcmp(optarg, "sharded")!=0;
+                run_sharded = strcmp(optarg, "shared")!=0;
+                break;
+            case 'L':
+                run_inplace = strcmp(optarg, "log")!=0;
+                run_log = strcmp(optarg, "inplace")!=0;
+                break;
+            case 'b': baseline_path = optarg; break;
+            case 'T': cfg.threshold_pct = atoi(optarg); break;
+            case 'x': trace_path = optarg; break;
+            default: usage(argv[0]);
+        }
+    }
+    //a shared volume holds at most NUM_INODES files, one per thread
+    if(cfg.max_threads>NUM_INODES) cfg.max_threads = NUM_INODES;
+    if(cfg.max_threads<1) cfg.max_threads = 1;
+    if(cfg.ops<1) cfg.ops = 1;
+    if(cfg.io_size<1) cfg.io_size = 1;
+
+    static struct result baseline[MAX_RESULTS];
+    int num_baseline = baseline_path ? load_baseline(baseline_path, baseline) : 0;
+
+    //bytes of metadata per GB of data: per block, its pointer in the inode, its bitmap entry and its memory pointer
+    long long small_meta = (1LL<<30) / BLOCK_SIZE * (sizeof(int) + sizeof(int) + sizeof(void *));
+    long long large_meta = (1LL<<30) / LARGE_BLOCK_SIZE * (sizeof(int) + sizeof(uint8_t) + sizeof(void *));
+    printf("{\n  \"config\":{\"max_threads\":%d,\"ops_per_thread\":%d,\"io_size\":%d,\"read_pct\":%d,"
+            "\"block_size\":%d,\"max_file_size\":%d,\"large_block_size\":%d,\"large_file_size\":%d,"
+            "\"small_block_metadata_per_gb\":%lld,\"large_block_metadata_per_gb\":%lld},\n  \"results\":[\n",
+            cfg.max_threads, cfg.ops, cfg.io_size, cfg.read_pct, BLOCK_SIZE, MAX_FILE_SIZE,
+            LARGE_BLOCK_SIZE, LARGE_FILE_SIZE, small_meta, large_meta);
+
+    if(trace_path) rsfs_trace_enable(1);
+
+    int regressions = 0, first = 1;
+    for(int w=0; w<NUM_WORKLOADS; w++){
+        if(selected){
+            //match the name as a whole item of the comma-separated list
+            char list[256];
+            snprintf(list, sizeof(list), ",%s,", selected);
+            char item[64];
+            snprintf(item, sizeof(item), ",%s,", workloads[w].name);
+            if(strstr(list, item)==NULL) continue;
+        }
+        for(int n=1; n<=cfg.max_threads; n*=2){
+            for(int layout=RSFS_LAYOUT_INPLACE; layout<=RSFS_LAYOUT_LOG; layout++){
+                if(layout==RSFS_LAYOUT_INPLACE ? !run_inplace : !run_log) continue;
+                if(layout==RSFS_LAYOUT_LOG && workloads[w].large) continue;
+                if(run_shared){
+                    regressions += run(&workloads[w], n, 0, layout, &cfg, baseline, num_baseline, first);
+                    first = 0;
+                }
+                if(run_sharded && !workloads[w].pooled){
+                    regressions += run(&workloads[w], n, 1, layout, &cfg, baseline, num_baseline, first);
+                    first = 0;
+                }
+            }
+        }
+    }
+    printf("  ]\n}\n");
+    remove_host_tree();
+
+    if(trace_path){
+        rsfs_trace_enable(0);
+        if(rsfs_trace_dump(trace_path)<0) fprintf(stderr, "[bench] cannot write trace %s\n", trace_path);
+    }
+
+    return regressions ? 1 : 0;
+}
@@ -0,0 +1,281 @@
+/*
+    block map of a file: a file is laid out as a body of large blocks (LARGE_BLOCK_SIZE), then up to
+    NUM_MEDIUM_POINTER medium blocks (MEDIUM_BLOCK_SIZE), then a tail of NUM_POINTER small blocks
+    (BLOCK_SIZE); a file of up to TAIL_SIZE bytes only has a tail, so small files cost what they
+    always did, while a large one needs a single pointer per LARGE_BLOCK_SIZE bytes;
+    when a write runs past the tail the map grows: the tail is copied into a new medium block, and
+    once the medium blocks cover a large block they are copied into one; a write that runs further
+    takes large blocks directly, so large sequential writes copy nothing twice;
+    when the file shrinks, the blocks past its end are freed and its last bytes are moved back to
+    the smallest blocks that hold them;
+    the body and the medium blocks never have holes, only the tail does (see flush_entry in api.c);
+    the map is only changed by the writer of the file, which holds the inode's rw_mutex, or by
+    rsfs_delete(); files of the log-structured layout only have a tail, as its inode records only
+    hold the tail's pointers (see log.c);
+    the mappings of a file (see mmap.c) are invalidated before any of its medium or large blocks is freed
+*/
+
+#include "def.h"
+
+
+//helper: the layout of a file of length bytes: as many large blocks as it fills,
+//then medium blocks for what does not fit in the tail
+static void shape_of(int64_t length, int *num_large, int *num_medium){
+    *num_large = length / LARGE_BLOCK_SIZE;
+    int64_t rest = length - (int64_t)*num_large * LARGE_BLOCK_SIZE;
+    *num_medium = (rest <= TAIL_SIZE) ? 0 : (rest - TAIL_SIZE + MEDIUM_BLOCK_SIZE - 1) / MEDIUM_BLOCK_SIZE;
+}
+
+//helper: memory of block of class cls
+static char *class_block(struct rsfs *fs, int cls, int block){
+    return (char *)fs->classes[cls].blocks[block];
+}
+
+//file offset of the first byte of the tail of inode
+int64_t tail_start(struct inode *inode){
+    return (int64_t)inode->num_large * LARGE_BLOCK_SIZE + (int64_t)inode->num_medium * MEDIUM_BLOCK_SIZE;
+}
+
+//bytes the file of inode can hold before its block map has to grow
+int64_t file_capacity(struct inode *inode){
+    return tail_start(inode) + TAIL_SIZE;
+}
+
+//address of the byte at file offset pos of inode; *avail is set to the number of bytes from there
+//to the end of its block; return NULL if pos falls in a hole of the tail or past the capacity
+char *file_ptr(struct rsfs *fs, struct inode *inode, int64_t pos, int *avail){
+    int64_t body = (int64_t)inode->num_large * LARGE_BLOCK_SIZE;
+    if(pos<body){
+        int off = pos % LARGE_BLOCK_SIZE;
+        *avail = LARGE_BLOCK_SIZE - off;
+        return class_block(fs, RSFS_CLASS_LARGE, inode->large[pos / LARGE_BLOCK_SIZE]) + off;
+    }
+    pos -= body;
+    if(pos < inode->num_medium * MEDIUM_BLOCK_SIZE){
+        int off = pos % MEDIUM_BLOCK_SIZE;
+        *avail = MEDIUM_BLOCK_SIZE - off;
+        return class_block(fs, RSFS_CLASS_MEDIUM, inode->medium[pos / MEDIUM_BLOCK_SIZE]) + off;
+    }
+    pos -= inode->num_medium * MEDIUM_BLOCK_SIZE;
+    int off = pos % BLOCK_SIZE;
+    *avail = BLOCK_SIZE - off;
+    if(pos>=TAIL_SIZE || inode->block[pos / BLOCK_SIZE]<0) return NULL;
+    return (char *)fs->data_blocks[inode->block[pos / BLOCK_SIZE]] + off;
+}
+
+//copy n bytes of src to the file of inode at offset pos, or zeros if src is NULL;
+//every block of the range must be allocated
+void copy_into_file(struct rsfs *fs, struct inode *inode, int64_t pos, const char *src, int64_t n){
+    while(n>0){
+        int avail;
+        char *dst = file_ptr(fs, inode, pos, &avail);
+        int64_t k = (avail < n) ? avail : n;
+        if(src){
+            memcpy(dst, src, k);
+            src += k;
+        }else{
+            memset(dst, 0, k);
+        }
+        pos += k;
+        n -= k;
+    }
+}
+
+//copy n bytes of the file of inode at offset pos to dst; bytes in holes read as zeros
+void copy_from_file(struct rsfs *fs, struct inode *inode, int64_t pos, char *dst, int64_t n){
+    while(n>0){
+        int avail;
+        char *src = file_ptr(fs, inode, pos, &avail);
+        int64_t k = (avail < n) ? avail : n;
+        if(src) memcpy(dst, src, k);
+        else memset(dst, 0, k);
+        dst += k;
+        pos += k;
+        n -= k;
+    }
+}
+
+//free tail block idx of inode; the pointer is cleared under map_mutex first, so neither the
+//log cleaner nor the defragmenter (which may move the blocks of a file being deleted) frees it twice
+void free_file_block(struct rsfs *fs, struct inode *inode, int idx){
+    lock_mutex(fs, &inode->map_mutex, RSFS_LOCK_INODE_MAP);
+    int block = inode->block[idx];
+    inode->block[idx] = -1;
+    pthread_mutex_unlock(&inode->map_mutex);
+    if(block != -1) free_data_block(fs, block);
+}
+
+//helper: free every block of the tail of inode
+static void free_tail(struct rsfs *fs, struct inode *inode){
+    for(int i=0; i<NUM_POINTER; i++) free_file_block(fs, inode, i);
+}
+
+//helper: replace the table of large blocks of inode with large, of cap entries, and free the old one;
+//the pointer is swapped under map_mutex, so rsfs_readdir() can walk the table meanwhile
+static void set_large_table(struct rsfs *fs, struct inode *inode, int *large, int cap){
+    lock_mutex(fs, &inode->map_mutex, RSFS_LOCK_INODE_MAP);
+    int *old = inode->large;
+    inode->large = large;
+    inode->large_cap = cap;
+    pthread_mutex_unlock(&inode->map_mutex);
+    fs_free(fs, old);
+}
+
+//helper: append block to the body of inode, growing its table of pointers if it is full;
+//return 0 if succeed, or -1 if memory runs out (nothing is changed)
+static int push_large(struct rsfs *fs, struct inode *inode, int block){
+    if(inode->num_large==inode->large_cap){
+        int cap = inode->large_cap ? 2*inode->large_cap : 16;
+        int *large = fs_alloc(fs, sizeof(int) * cap);
+        if(large==NULL) return -1;
+        if(inode->num_large>0) memcpy(large, inode->large, sizeof(int) * inode->num_large);
+        set_large_table(fs, inode, large, cap);
+    }
+    inode->large[inode->num_large++] = block;
+    return 0;
+}
+
+//helper: move what follows the body of inode (its medium blocks and, unless these are all in use,
+//its tail) into a new large block at the end of the body; only the bytes before the end of the
+//file are copied; return 0 if succeed, or -1 if no large block is free
+static int promote_to_large(struct rsfs *fs, struct inode *inode){
+    int block = allocate_class_block(fs, RSFS_CLASS_LARGE);
+    if(block<0) return -1;
+
+    int64_t start = (int64_t)inode->num_large * LARGE_BLOCK_SIZE;
+    int64_t end = (inode->length < start + LARGE_BLOCK_SIZE) ? inode->length : start + LARGE_BLOCK_SIZE;
+    if(end>start) copy_from_file(fs, inode, start, class_block(fs, RSFS_CLASS_LARGE, block), end - start);
+
+    int full = (inode->num_medium==NUM_MEDIUM_POINTER); //then the tail already starts where the new block ends
+    if(push_large(fs, inode, block)<0){
+        free_class_block(fs, RSFS_CLASS_LARGE, block);
+        return -1;
+    }
+    if(inode->num_medium>0) invalidate_mappings(fs, inode);
+    while(inode->num_medium>0) free_class_block(fs, RSFS_CLASS_MEDIUM, inode->medium[--inode->num_medium]);
+    if(!full) free_tail(fs, inode);
+    return 0;
+}
+
+//helper: move the tail of inode into a new medium block; the caller makes sure one more fits;
+//return 0 if succeed, or -1 if no medium block is free
+static int promote_to_medium(struct rsfs *fs, struct inode *inode){
+    int block = allocate_class_block(fs, RSFS_CLASS_MEDIUM);
+    if(block<0) return -1;
+
+    int64_t start = tail_start(inode);
+    int64_t end = (inode->length < start + TAIL_SIZE) ? inode->length : start + TAIL_SIZE;
+    if(end>start) copy_from_file(fs, inode, start, class_block(fs, RSFS_CLASS_MEDIUM, block), end - start);
+
+    free_tail(fs, inode);
+    inode->medium[inode->num_medium++] = block;
+    return 0;
+}
+
+//grow the block map of inode until the file can hold end bytes; the bytes written so far must all
+//be in the blocks (the caller flushes its buffered writes first); return 0 if succeed, or -1 if a
+//class runs out of blocks (the map may have grown part of the way) or with the log-structured layout
+int grow_file(struct rsfs *fs, struct inode *inode, int64_t end){
+    if(end<=file_capacity(inode)) return 0;
+    if(fs->layout==RSFS_LAYOUT_LOG) return -1; //files stay in their tail
+
+    TRACE(fs, 'B', "grow_file");
+    int num_large, num_medium;
+    shape_of(end, &num_large, &num_medium);
+    int ret = 0;
+    while(ret==0 && end>file_capacity(inode)){
+        if(inode->num_large<num_large || inode->num_medium==NUM_MEDIUM_POINTER){
+            ret = promote_to_large(fs, inode);
+        }else{
+            ret = promote_to_medium(fs, inode);
+        }
+    }
+    TRACE(fs, 'E', "grow_file");
+    return ret;
+}
+
+//helper: replace the last large block of inode, which holds the last bytes of a file of length bytes,
+//with num_medium medium blocks and the tail; nothing changes if the smaller blocks can not be allocated
+static void demote_large(struct rsfs *fs, struct inode *inode, int64_t length, int num_medium){
+    int last = inode->large[inode->num_large-1];
+    char *src = class_block(fs, RSFS_CLASS_LARGE, last);
+    int rest = length - (int64_t)(inode->num_large-1) * LARGE_BLOCK_SIZE;
+    int in_tail = rest - num_medium * MEDIUM_BLOCK_SIZE;
+    int num_small = (in_tail>0) ? (in_tail + BLOCK_SIZE - 1) / BLOCK_SIZE : 0;
+
+    int medium[NUM_MEDIUM_POINTER], small[NUM_POINTER];
+    int got = 0;
+    while(got<num_medium && (medium[got] = allocate_class_block(fs, RSFS_CLASS_MEDIUM))>=0) got++;
+    if(got<num_medium || allocate_data_blocks(fs, num_small, small)<0){
+        while(got>0) free_class_block(fs, RSFS_CLASS_MEDIUM, medium[--got]);
+        return;
+    }
+
+    for(int i=0; i<num_medium; i++){
+        int n = rest - i * MEDIUM_BLOCK_SIZE;
+        memcpy(class_block(fs, RSFS_CLASS_MEDIUM, medium[i]), src + i * MEDIUM_BLOCK_SIZE, (n < MEDIUM_BLOCK_SIZE) ? n : MEDIUM_BLOCK_SIZE);
+        inode->medium[i] = medium[i];
+    }
+    for(int i=0; i<num_small; i++){
+        int n = in_tail - i * BLOCK_SIZE;
+        memcpy(fs->data_blocks[small[i]], src + num_medium * MEDIUM_BLOCK_SIZE + i * BLOCK_SIZE, (n < BLOCK_SIZE) ? n : BLOCK_SIZE);
+        inode->block[i] = small[i];
+    }
+    inode->num_medium = num_medium;
+    inode->num_large--;
+    free_class_block(fs, RSFS_CLASS_LARGE, last);
+}
+
+//helper: replace the last medium block of inode, which holds the last bytes of a file of length bytes,
+//with the tail; nothing changes if the small blocks can not be allocated
+static void demote_medium(struct rsfs *fs, struct inode *inode, int64_t length){
+    int last = inode->medium[inode->num_medium-1];
+    char *src = class_block(fs, RSFS_CLASS_MEDIUM, last);
+    int in_tail = length - (tail_start(inode) - MEDIUM_BLOCK_SIZE);
+    int num_small = (in_tail + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    int small[NUM_POINTER];
+    if(allocate_data_blocks(fs, num_small, small)<0) return;
+    for(int i=0; i<num_small; i++){
+        int n = in_tail - i * BLOCK_SIZE;
+        memcpy(fs->data_blocks[small[i]], src + i * BLOCK_SIZE, (n < BLOCK_SIZE) ? n : BLOCK_SIZE);
+        inode->block[i] = small[i];
+    }
+    inode->num_medium--;
+    free_class_block(fs, RSFS_CLASS_MEDIUM, last);
+}
+
+//shrink the block map of inode for a file of length bytes: if length ends before the tail, the tail
+//and the medium and large blocks past length are freed, and the last bytes are moved back into
+//medium blocks and the tail where they fit; the tail blocks of a file that ends in its tail are
+//left to the caller, which may keep preallocated ones
+void shrink_file(struct rsfs *fs, struct inode *inode, int64_t length){
+    if(length>=tail_start(inode)) return;
+
+    TRACE(fs, 'B', "shrink_file");
+    invalidate_mappings(fs, inode);
+    free_tail(fs, inode);
+    int64_t body = (int64_t)inode->num_large * LARGE_BLOCK_SIZE;
+    int keep = (length > body) ? (length - body + MEDIUM_BLOCK_SIZE - 1) / MEDIUM_BLOCK_SIZE : 0;
+    while(inode->num_medium>keep) free_class_block(fs, RSFS_CLASS_MEDIUM, inode->medium[--inode->num_medium]);
+    if(inode->num_medium==0){
+        keep = (length + LARGE_BLOCK_SIZE - 1) / LARGE_BLOCK_SIZE;
+        while(inode->num_large>keep) free_class_block(fs, RSFS_CLASS_LARGE, inode->large[--inode->num_large]);
+    }
+
+    int num_large, num_medium;
+    shape_of(length, &num_large, &num_medium);
+    if(inode->num_large>num_large) demote_large(fs, inode, length, num_medium);
+    if(inode->num_large==num_large && inode->num_medium>num_medium) demote_medium(fs, inode, length);
+    if(inode->num_large==0) set_large_table(fs, inode, NULL, 0); //the body is gone, and so is its table
+    TRACE(fs, 'E', "shrink_file");
+}
+
+//free every block of inode, of every class, and its table of large blocks
+void release_file_blocks(struct rsfs *fs, struct inode *inode){
+    invalidate_mappings(fs, inode);
+    free_tail(fs, inode);
+    while(inode->num_medium>0) free_class_block(fs, RSFS_CLASS_MEDIUM, inode->medium[--inode->num_medium]);
+    while(inode->num_large>0) free_class_block(fs, RSFS_CLASS_LARGE, inode->large[--inode->num_large]);
+    set_large_table(fs, inode, NULL, 0);
+}
@@ -0,0 +1,531 @@
+/*
+    bulk routines over a whole tree, run on a work-stealing pool (see pool.c): rsfs_import_dir()
+    copies a directory tree of the host into the volume, rsfs_export_dir() copies a tree of the
+    volume out to the host, and rsfs_scan() searches every file of the volume for a byte string;
+    import: a task per directory makes its subdirectories, creates all of its files with one insert
+    into the directory (insert_dir_batch), and queues a task per subdirectory and per file; a file
+    is reserved whole with rsfs_fallocate() first, so its block map is built once, in large blocks,
+    and then copied in chunks of BULK_CHUNK bytes; export walks the volume the same way;
+    scan: the walk opens every file for reading and queues a task per SCAN_CHUNK bytes of it, which
+    searches the blocks where they are (file_ptr), with no copy: 16 starts at a time are checked
+    for the first and the last byte of the pattern (SSE2, where the compiler has it), and only the
+    starts where both match are compared in full; a match that runs from one block into the next is
+    found in a small window copied from both; the chunks overlap by the pattern's length less one,
+    and each reports the matches that start in it; the task that finishes last closes the file
+*/
+
+#include "def.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+//an import or export: what its tasks share
+struct bulk_job{
+    struct rsfs *fs;
+    struct rsfs_pool *pool;
+    char **bufs; //BULK_CHUNK bytes per worker
+    int files; //files copied
+    int errors; //files and directories that could not be copied
+};
+
+//a task of an import or export: a directory or a file, by its path in the volume and on the host
+struct bulk_task{
+    struct bulk_job *job;
+    char *path;
+    char *host;
+};
+
+//a scan: what its tasks share
+struct scan_job{
+    struct rsfs *fs;
+    struct rsfs_pool *pool;
+    const char *pattern;
+    int len;
+    rsfs_scan_fn callback;
+    void *arg;
+    int64_t matches;
+    int stop; //set when the callback asks to stop
+};
+
+//a directory of a scan
+struct scan_dir{
+    struct scan_job *job;
+    char *path;
+};
+
+//a part of a file of a scan: the matches that start in [start, end)
+struct scan_chunk{
+    struct scan_file *file;
+    int64_t start;
+    int64_t end;
+};
+
+//a file of a scan, open for reading until its last chunk is done
+struct scan_file{
+    struct scan_job *job;
+    char *path;
+    int fd;
+    struct inode *inode;
+    int64_t length;
+    int chunks_left;
+    struct scan_chunk chunks[];
+};
+
+//helper: path of name in the directory dir ("" or "/" for the root of the volume)
+static char *join_path(const char *dir, const char *name){
+    size_t len = strlen(dir);
+    while(len>0 && dir[len-1]=='/') len--;
+    char *path = malloc(len + strlen(name) + 2);
+    if(path==NULL) return NULL;
+    if(len==0) strcpy(path, name);
+    else sprintf(path, "%.*s/%s", (int)len, dir, name);
+    return path;
+}
+
+//helper: queue fn on a new task for path and host (taking them over); count an error if it cannot be made
+static void submit_task(struct bulk_job *job, int worker, pool_fn fn, char *path, char *host){
+    struct bulk_task *t = malloc(sizeof(struct bulk_task));
+    if(t==NULL || path==NULL || host==NULL){
+        __atomic_add_fetch(&job->errors, 1, __ATOMIC_RELAXED);
+        free(t);
+        free(path);
+        free(host);
+        return;
+    }
+    t->job = job;
+    t->path = path;
+    t->host = host;
+    pool_submit(job->pool, worker, fn, t);
+}
+
+static void free_task(struct bulk_task *t){
+    free(t->path);
+    free(t->host);
+    free(t);
+}
+
+//helper: the copy buffer of worker, or a new one (to be freed in *own) outside the pool
+static char *task_buf(struct bulk_job *job, int worker, char **own){
+    *own = NULL;
+    if(worker>=0) return job->bufs[worker];
+    return *own = malloc(BULK_CHUNK);
+}
+
+//helper: write all n bytes of buf to the host file hfd; return 0 or -1
+static int write_all(int hfd, const char *buf, int64_t n){
+    while(n>0){
+        ssize_t k = write(hfd, buf, n);
+        if(k<0 && errno==EINTR) continue;
+        if(k<=0) return -1;
+        buf += k;
+        n -= k;
+    }
+    return 0;
+}
+
+//helper: run job on a pool of threads, starting with fn on path and host; return the files copied
+static int run_bulk(struct bulk_job *job, int threads, pool_fn fn, const char *path, const char *host){
+    job->pool = pool_create(threads);
+    if(job->pool==NULL) return -1;
+    int n = pool_threads(job->pool);
+    job->bufs = calloc(n, sizeof(char *));
+    for(int i=0; job->bufs && i<n; i++) job->bufs[i] = malloc(BULK_CHUNK);
+    for(int i=0; job->bufs && i<n; i++){
+        if(job->bufs[i]==NULL){
+            for(int j=0; j<n; j++) free(job->bufs[j]);
+            free(job->bufs);
+            job->bufs = NULL;
+        }
+    }
+    if(job->bufs==NULL){
+        pool_destroy(job->pool);
+        return -1;
+    }
+
+    submit_task(job, -1, fn, strdup(path), strdup(host));
+    pool_wait(job->pool);
+
+    pool_destroy(job->pool);
+    for(int i=0; i<n; i++) free(job->bufs[i]);
+    free(job->bufs);
+    if(DEBUG) printf("[bulk] %d files, %d errors.\n", job->files, job->errors);
+    return job->files;
+}
+
+
+//import
+
+//copy the host file t->host into the file t->path of the volume
+static void import_file(void *ptr, int worker){
+    struct bulk_task *t = (struct bulk_task *)ptr;
+    struct bulk_job *job = t->job;
+    struct rsfs *fs = job->fs;
+    char *own;
+    char *buf = task_buf(job, worker, &own);
+
+    int ok = 0;
+    struct stat st;
+    int hfd = open(t->host, O_RDONLY);
+    int fd = rsfs_open(fs, t->path, RSFS_RDWR);
+    if(buf && hfd>=0 && fd>=0 && fstat(hfd, &st)==0 && rsfs_truncate(fs, fd, 0)==0){
+        //reserve the whole file first; if it does not fit, the write that runs out fails below
+        if(st.st_size>0) rsfs_fallocate(fs, fd, 0, st.st_size);
+        ok = 1;
+        for(;;){
+            ssize_t n = read(hfd, buf, BULK_CHUNK);
+            if(n<0 && errno==EINTR) continue;
+            if(n<=0){
+                ok = (n==0);
+                break;
+            }
+            if(rsfs_write(fs, fd, buf, n)!=n){
+                ok = 0;
+                break;
+            }
+        }
+    }
+    if(fd>=0) rsfs_close(fs, fd);
+    if(hfd>=0) close(hfd);
+    __atomic_add_fetch(ok ? &job->files : &job->errors, 1, __ATOMIC_RELAXED);
+    free(own);
+    free_task(t);
+}
+
+//create the n files names[] of the directory path with one insert; a name that exists keeps its file,
+//which is then overwritten, and names past the last free inode are left for the copy to fail on
+static void create_files(struct rsfs *fs, const char *path, const char **names, int n){
+    int *inodes = malloc(sizeof(int) * (n > 0 ? n : 1));
+    struct dir_entry **entries = malloc(sizeof(struct dir_entry *) * (n > 0 ? n : 1));
+    if(inodes==NULL || entries==NULL){
+        free(inodes);
+        free(entries);
+        return;
+    }
+    int m = 0;
+    while(m<n && (inodes[m] = allocate_inode(fs))>=0) m++;
+    int created = (m>0) ? insert_dir_batch(fs, path, names, inodes, entries, m) : 0;
+    for(int i=0; i<m; i++){
+        if(created<0 || entries[i]==NULL) free_inode(fs, inodes[i]);
+    }
+    free(inodes);
+    free(entries);
+}
+
+//copy the host directory t->host into the directory t->path of the volume, which exists
+static void import_dir(void *ptr, int worker){
+    struct bulk_task *t = (struct bulk_task *)ptr;
+    struct bulk_job *job = t->job;
+    struct rsfs *fs = job->fs;
+
+    DIR *d = opendir(t->host);
+    if(d==NULL){
+        __atomic_add_fetch(&job->errors, 1, __ATOMIC_RELAXED);
+        free_task(t);
+        return;
+    }
+
+    //the files of the directory, created together once it is read
+    int n = 0, cap = 0;
+    char **names = NULL;
+    struct dirent *e;
+    while((e = readdir(d))!=NULL){
+        if(strcmp(e->d_name, ".")==0 || strcmp(e->d_name, "..")==0) continue;
+        char *host = join_path(t->host, e->d_name);
+        int type = e->d_type;
+        if(type==DT_UNKNOWN && host){ //symbolic links and special files are skipped
+            struct stat st;
+            if(lstat(host, &st)==0) type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+        if(type==DT_DIR){
+            char *path = join_path(t->path, e->d_name);
+            if(path) rsfs_mkdir(fs, path); //if it exists already, the task below finds out whether it is a directory
+            submit_task(job, worker, import_dir, path, host);
+        }else if(type==DT_REG){
+            if(n==cap){
+                cap = cap ? 2*cap : 16;
+                char **grown = realloc(names, sizeof(char *) * cap);
+                if(grown==NULL) break;
+                names = grown;
+            }
+            names[n] = strdup(e->d_name);
+            if(names[n]) n++;
+            free(host);
+        }else{
+            free(host);
+        }
+    }
+    closedir(d);
+
+    create_files(fs, t->path, (const char **)names, n);
+    for(int i=0; i<n; i++){
+        submit_task(job, worker, import_file, join_path(t->path, names[i]), join_path(t->host, names[i]));
+        free(names[i]);
+    }
+    free(names);
+    free_task(t);
+}
+
+//copy the tree under the host directory host_dir into the directory path of fs ("" or "/" for the root),
+//which is made if it does not exist, with threads threads (<=0: one per core); files that exist are
+//overwritten; symbolic links and special files are skipped;
+//return the number of files copied, or -1 if host_dir or path is not a directory
+int rsfs_import_dir(struct rsfs *fs, const char *host_dir, char *path, int threads){
+    struct stat st;
+    if(stat(host_dir, &st)<0 || !S_ISDIR(st.st_mode)) return -1;
+    rsfs_mkdir(fs, path); //-1 if it exists (or is the root)
+    if(rsfs_readdir(fs, path, NULL, 0)<0) return -1;
+
+    TRACE(fs, 'B', "rsfs_import_dir");
+    struct bulk_job job = {fs, NULL, NULL, 0, 0};
+    int ret = run_bulk(&job, threads, import_dir, path, host_dir);
+    TRACE(fs, 'E', "rsfs_import_dir");
+    return ret;
+}
+
+
+//export
+
+//copy the file t->path of the volume into the host file t->host
+static void export_file(void *ptr, int worker){
+    struct bulk_task *t = (struct bulk_task *)ptr;
+    struct bulk_job *job = t->job;
+    struct rsfs *fs = job->fs;
+    char *own;
+    char *buf = task_buf(job, worker, &own);
+
+    int ok = 0;
+    int fd = rsfs_open(fs, t->path, RSFS_RDONLY);
+    int hfd = (fd>=0) ? open(t->host, O_WRONLY | O_CREAT | O_TRUNC, 0666) : -1;
+    if(buf && hfd>=0){
+        int64_t n;
+        while((n = rsfs_read(fs, fd, buf, BULK_CHUNK))>0){
+            if(write_all(hfd, buf, n)<0) break;
+        }
+        ok = (n==0);
+    }
+    if(fd>=0) rsfs_close(fs, fd);
+    if(hfd>=0) close(hfd);
+    __atomic_add_fetch(ok ? &job->files : &job->errors, 1, __ATOMIC_RELAXED);
+    free(own);
+    free_task(t);
+}
+
+//copy the directory t->path of the volume into the host directory t->host, made if needed
+static void export_dir(void *ptr, int worker){
+    struct bulk_task *t = (struct bulk_task *)ptr;
+    struct bulk_job *job = t->job;
+    struct rsfs *fs = job->fs;
+
+    int n = rsfs_readdir(fs, t->path, NULL, 0);
+    struct rsfs_dirent *entries = (n>0) ? malloc(sizeof(struct rsfs_dirent) * n) : NULL;
+    if(entries){
+        int listed = rsfs_readdir(fs, t->path, entries, n); //entries made meanwhile are left out
+        if(listed < n) n = listed;
+    }
+    if(n<0 || (n>0 && entries==NULL) || (mkdir(t->host, 0777)<0 && errno!=EEXIST)){
+        __atomic_add_fetch(&job->errors, 1, __ATOMIC_RELAXED);
+        free(entries);
+        free_task(t);
+        return;
+    }
+    for(int i=0; i<n; i++){
+        pool_fn fn = entries[i].is_dir ? export_dir : export_file;
+        submit_task(job, worker, fn, join_path(t->path, entries[i].name), join_path(t->host, entries[i].name));
+    }
+    free(entries);
+    free_task(t);
+}
+
+//copy the tree under the directory path of fs ("" or "/" for the root) into the host directory host_dir,
+//which is made if it does not exist (its parent must), with threads threads (<=0: one per core);
+//host files that exist are overwritten; a name longer than RSFS_NAME_LEN-1 bytes cannot be copied;
+//return the number of files copied, or -1 if path is not a directory
+int rsfs_export_dir(struct rsfs *fs, char *path, const char *host_dir, int threads){
+    if(rsfs_readdir(fs, path, NULL, 0)<0) return -1;
+
+    TRACE(fs, 'B', "rsfs_export_dir");
+    struct bulk_job job = {fs, NULL, NULL, 0, 0};
+    int ret = run_bulk(&job, threads, export_dir, path, host_dir);
+    TRACE(fs, 'E', "rsfs_export_dir");
+    return ret;
+}
+
+
+//scan
+
+//helper: count a match at offset of file f and pass it to the callback, which may stop the scan
+static void report(struct scan_job *job, struct scan_file *f, int64_t offset){
+    __atomic_add_fetch(&job->matches, 1, __ATOMIC_RELAXED);
+    if(job->callback && job->callback(f->path, offset, job->arg)) __atomic_store_n(&job->stop, 1, __ATOMIC_RELAXED);
+}
+
+//helper: report the matches in buf[0..n) that start before limit, at offset base of the file
+static void search(struct scan_job *job, struct scan_file *f, const char *buf, int64_t n, int64_t limit, int64_t base){
+    const char *pat = job->pattern;
+    int plen = job->len;
+    int64_t last = n - plen; //last start of a match that fits in buf
+    if(last > limit - 1) last = limit - 1;
+    int64_t i = 0;
+
+#ifdef __SSE2__
+    //16 starts at a time: a start is a candidate if the first and the last byte of the pattern match there
+    const __m128i first = _mm_set1_epi8(pat[0]);
+    const __m128i final = _mm_set1_epi8(pat[plen-1]);
+    for(; i + 15 <= last; i += 16){
+        __m128i a = _mm_loadu_si128((const __m128i *)(buf + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(buf + i + plen - 1));
+        unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, final)));
+        while(mask){
+            int k = __builtin_ctz(mask);
+            if(memcmp(buf + i + k, pat, plen)==0){
+                report(job, f, base + i + k);
+                if(__atomic_load_n(&job->stop, __ATOMIC_RELAXED)) return;
+            }
+            mask &= mask - 1;
+        }
+    }
+#endif
+
+    while(i <= last){
+        const char *p = memchr(buf + i, pat[0], last - i + 1);
+        if(p==NULL) break;
+        i = p - buf;
+        if(memcmp(p, pat, plen)==0){
+            report(job, f, base + i);
+            if(__atomic_load_n(&job->stop, __ATOMIC_RELAXED)) return;
+        }
+        i++;
+    }
+}
+
+//helper: report the matches of chunk c, reading its blocks in place
+static void scan_range(struct scan_job *job, struct scan_chunk *c){
+    static const char zeros[BLOCK_SIZE]; //a hole of the tail
+    struct scan_file *f = c->file;
+    struct rsfs *fs = job->fs;
+    int plen = job->len;
+    int64_t limit = c->end + plen - 1; //a match starting before end may run this far
+    if(limit > f->length) limit = f->length;
+
+    lock_block_map(fs, f->inode); //keep the log cleaner from moving the blocks being searched
+    int64_t n;
+    for(int64_t pos = c->start; pos < limit && !__atomic_load_n(&job->stop, __ATOMIC_RELAXED); pos += n){
+        int avail;
+        const char *p = file_ptr(fs, f->inode, pos, &avail);
+        n = (avail < limit - pos) ? avail : limit - pos;
+        search(job, f, p ? p : zeros, n, c->end - pos, pos);
+
+        //a match that starts in this block and runs into the next ones: the starts from
+        //pos+n-plen+1 on, which the search of the block could not see, with the bytes that follow
+        if(plen>1 && pos + n < limit){
+            char window[2*SCAN_MAX_PATTERN];
+            int64_t from = (pos + n - (plen-1) > pos) ? pos + n - (plen-1) : pos;
+            int64_t to = (pos + n + plen - 1 < limit) ? pos + n + plen - 1 : limit;
+            int64_t end = (pos + n < c->end) ? pos + n : c->end;
+            copy_from_file(fs, f->inode, from, window, to - from);
+            search(job, f, window, to - from, end - from, from);
+        }
+    }
+    unlock_block_map(fs, f->inode);
+}
+
+static void scan_chunk(void *ptr, int worker){
+    (void)worker;
+    struct scan_chunk *c = (struct scan_chunk *)ptr;
+    struct scan_file *f = c->file;
+    if(!__atomic_load_n(&f->job->stop, __ATOMIC_RELAXED)) scan_range(f->job, c);
+    if(__atomic_sub_fetch(&f->chunks_left, 1, __ATOMIC_ACQ_REL)==0){
+        rsfs_close(f->job->fs, f->fd);
+        free(f->path);
+        free(f);
+    }
+}
+
+//helper: open the file path (taking it over) and queue a task per SCAN_CHUNK bytes of it
+static void scan_open(struct scan_job *job, int worker, char *path){
+    int fd = rsfs_open(job->fs, path, RSFS_RDONLY);
+    struct open_file_entry *ofe = (fd>=0) ? get_open_file_entry(job->fs, fd) : NULL;
+    struct inode *inode = ofe ? &job->fs->inodes[ofe->inode_number] : NULL;
+    int64_t length = inode ? inode->length : 0; //no writer can change it while fd is open
+    int nchunks = (length + SCAN_CHUNK - 1) / SCAN_CHUNK;
+    struct scan_file *f = (length >= job->len) ? malloc(sizeof(struct scan_file) + sizeof(struct scan_chunk) * nchunks) : NULL;
+    if(f==NULL){
+        if(fd>=0) rsfs_close(job->fs, fd);
+        free(path);
+        return;
+    }
+    f->job = job;
+    f->path = path;
+    f->fd = fd;
+    f->inode = inode;
+    f->length = length;
+    f->chunks_left = nchunks;
+    for(int i=0; i<nchunks; i++){
+        f->chunks[i].file = f;
+        f->chunks[i].start = (int64_t)i * SCAN_CHUNK;
+        f->chunks[i].end = (i==nchunks-1) ? length : (int64_t)(i+1) * SCAN_CHUNK;
+    }
+    for(int i=0; i<nchunks; i++) pool_submit(job->pool, worker, scan_chunk, &f->chunks[i]); //the last chunk to finish frees f
+}
+
+//open every file of the directory of d and queue its subdirectories
+static void scan_walk(void *ptr, int worker){
+    struct scan_dir *d = (struct scan_dir *)ptr;
+    struct scan_job *job = d->job;
+
+    int n = rsfs_readdir(job->fs, d->path, NULL, 0);
+    struct rsfs_dirent *entries = (n>0) ? malloc(sizeof(struct rsfs_dirent) * n) : NULL;
+    if(entries){
+        int listed = rsfs_readdir(job->fs, d->path, entries, n);
+        if(listed < n) n = listed;
+    }
+    for(int i=0; entries && i<n && !__atomic_load_n(&job->stop, __ATOMIC_RELAXED); i++){
+        char *path = join_path(d->path, entries[i].name);
+        if(path==NULL) continue;
+        if(!entries[i].is_dir){
+            scan_open(job, worker, path);
+            continue;
+        }
+        struct scan_dir *sub = malloc(sizeof(struct scan_dir));
+        if(sub==NULL){
+            free(path);
+            continue;
+        }
+        sub->job = job;
+        sub->path = path;
+        pool_submit(job->pool, worker, scan_walk, sub);
+    }
+    free(entries);
+    free(d->path);
+    free(d);
+}
+
+//search every file of fs for the len bytes of pattern (1 to SCAN_MAX_PATTERN) with threads threads
+//(<=0: one per core); callback, if not NULL, gets the path of the file and the offset of every match,
+//from any of the threads and in no particular order, and stops the scan by returning nonzero (the
+//other threads stop soon after); the caller must not hold a file of fs open with RSFS_RDWR, as the
+//scan opens every file for reading; return the number of matches reported, or -1 if it fails
+int64_t rsfs_scan(struct rsfs *fs, const char *pattern, int len, int threads, rsfs_scan_fn callback, void *arg){
+    if(pattern==NULL || len<=0 || len>SCAN_MAX_PATTERN) return -1;
+    struct scan_job job = {fs, NULL, pattern, len, callback, arg, 0, 0};
+    struct scan_dir *root = malloc(sizeof(struct scan_dir));
+    job.pool = pool_create(threads);
+    if(root==NULL || job.pool==NULL || (root->path = strdup(""))==NULL){
+        free(root);
+        if(job.pool) pool_destroy(job.pool);
+        return -1;
+    }
+    root->job = &job;
+
+    TRACE(fs, 'B', "rsfs_scan");
+    pool_submit(job.pool, -1, scan_walk, root);
+    pool_wait(job.pool);
+    pool_destroy(job.pool);
+    TRACE(fs, 'E', "rsfs_scan");
+    return job.matches;
+}
@@ -0,0 +1,256 @@
+/*
+    client library of rsfsd (see rsfsd.c): calls are added to a frame with rsfs_client_add(),
+    sent as one frame with rsfs_client_send(), and answered by rsfs_client_recv(), which fills
+    in the calls of the oldest frame sent; up to RSFSD_MAX_INFLIGHT frames may be sent before
+    their replies are read, so a client can keep the server busy without waiting for each one;
+    rsfs_client_call() and the rsfs_remote_* calls send one call and wait for it;
+    a client is used by one thread at a time
+*/
+
+#include "def.h"
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+struct rsfs_client{
+    int sock;
+    char *out; //frame being built: header, then its requests
+    int out_len;
+    struct rsfs_call *calls[RSFSD_MAX_INFLIGHT+1][RSFSD_MAX_BATCH]; //calls of each frame sent (ring) and of the one being built
+    int counts[RSFSD_MAX_INFLIGHT+1];
+    int head; //slot of the oldest frame sent
+    int inflight; //frames sent and not answered yet
+    char *in; //reply being read
+};
+
+//connect to the rsfsd listening on socket_path; return the client, or NULL if it fails
+struct rsfs_client *rsfs_connect(const char *socket_path){
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(socket_path)>=sizeof(addr.sun_path)) return NULL;
+    strcpy(addr.sun_path, socket_path);
+
+    struct rsfs_client *client = calloc(1, sizeof(struct rsfs_client));
+    if(client==NULL) return NULL;
+    client->out = malloc(RSFSD_MAX_FRAME);
+    client->in = malloc(RSFSD_MAX_FRAME);
+    client->sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(client->out==NULL || client->in==NULL || client->sock<0
+            || connect(client->sock, (struct sockaddr *)&addr, sizeof(addr))<0){
+        if(client->sock>=0) close(client->sock);
+        free(client->out);
+        free(client->in);
+        free(client);
+        return NULL;
+    }
+    client->out_len = sizeof(struct rsfsd_frame);
+    return client;
+}
+
+//close the connection of client and release it; replies not read yet are dropped
+void rsfs_disconnect(struct rsfs_client *client){
+    if(client==NULL) return;
+    close(client->sock);
+    free(client->out);
+    free(client->in);
+    free(client);
+}
+
+//helper: slot of the frame being built
+static int building(struct rsfs_client *client){
+    return (client->head + client->inflight) % (RSFSD_MAX_INFLIGHT+1);
+}
+
+//add call to the frame being built; return 0 if succeed, or -1 if the op is unknown
+//or the frame has no room left for it (send the frame first)
+int rsfs_client_add(struct rsfs_client *client, struct rsfs_call *call){
+    if(call->op<0 || call->op>=RSFSD_NUM_OPS) return -1;
+    int slot = building(client);
+    if(client->counts[slot]==RSFSD_MAX_BATCH) return -1;
+
+    const void *payload = call->data;
+    int len = call->len;
+    if(call->path){
+        payload = call->path;
+        len = strlen(call->path);
+        if(len>RSFSD_MAX_PATH) return -1;
+    }
+    if(len<0 || len>0xffff || client->out_len + (int)sizeof(struct rsfsd_request) + len > RSFSD_MAX_FRAME) return -1;
+
+    struct rsfsd_request req = {(uint8_t)call->op, 0, (uint16_t)len, call->fd, call->arg, call->arg2};
+    memcpy(client->out + client->out_len, &req, sizeof(req));
+    if(len>0) memcpy(client->out + client->out_len + sizeof(req), payload, len);
+    client->out_len += sizeof(req) + len;
+    client->calls[slot][client->counts[slot]++] = call;
+    return 0;
+}
+
+//helper: write all n bytes of buf to sock; return 0 if succeed, or -1 otherwise
+static int write_all(int sock, const char *buf, int n){
+    while(n>0){
+        ssize_t done = send(sock, buf, n, MSG_NOSIGNAL);
+        if(done<0){
+            if(errno==EINTR) continue;
+            return -1;
+        }
+        buf += done;
+        n -= done;
+    }
+    return 0;
+}
+
+//helper: read exactly n bytes from sock into buf; return 0 if succeed, or -1 otherwise
+static int read_all(int sock, char *buf, int n){
+    while(n>0){
+        ssize_t done = recv(sock, buf, n, 0);
+        if(done<0 && errno==EINTR) continue;
+        if(done<=0) return -1;
+        buf += done;
+        n -= done;
+    }
+    return 0;
+}
+
+//send the frame being built (even if empty) without waiting for its reply;
+//return 0 if succeed, or -1 if RSFSD_MAX_INFLIGHT frames are waiting for replies or the connection failed
+int rsfs_client_send(struct rsfs_client *client){
+    if(client->inflight==RSFSD_MAX_INFLIGHT) return -1;
+
+    int slot = building(client);
+    struct rsfsd_frame frame = {client->out_len - sizeof(struct rsfsd_frame), RSFSD_MAGIC, client->counts[slot]};
+    memcpy(client->out, &frame, sizeof(frame));
+    int ret = write_all(client->sock, client->out, client->out_len);
+
+    client->out_len = sizeof(struct rsfsd_frame);
+    if(ret<0){
+        client->counts[slot] = 0;
+        return -1;
+    }
+    client->inflight++;
+    return 0;
+}
+
+//wait for the reply to the oldest frame sent and fill in ret (and out) of each of its calls;
+//return the number of calls answered, or -1 if no frame is waiting or the connection failed
+int rsfs_client_recv(struct rsfs_client *client){
+    if(client->inflight==0) return -1;
+
+    struct rsfsd_frame frame;
+    if(read_all(client->sock, (char *)&frame, sizeof(frame))<0) return -1;
+    if(frame.magic!=RSFSD_MAGIC || frame.len > RSFSD_MAX_FRAME - sizeof(frame)) return -1;
+    if(read_all(client->sock, client->in, frame.len)<0) return -1;
+
+    int slot = client->head;
+    int count = client->counts[slot];
+    if(frame.count!=count) return -1;
+
+    char *p = client->in;
+    for(int i=0; i<count; i++){
+        struct rsfsd_response resp;
+        memcpy(&resp, p, sizeof(resp));
+        p += sizeof(resp);
+        struct rsfs_call *call = client->calls[slot][i];
+        call->ret = resp.ret;
+        if(resp.len>0 && call->out){
+            memcpy(call->out, p, (int)resp.len < call->out_size ? (int)resp.len : call->out_size);
+        }
+        p += resp.len;
+    }
+
+    client->counts[slot] = 0;
+    client->head = (slot+1) % (RSFSD_MAX_INFLIGHT+1);
+    client->inflight--;
+    return count;
+}
+
+//send call on its own and wait for its reply; frames sent before are answered first;
+//return call->ret, or -1 if it could not be sent
+int64_t rsfs_client_call(struct rsfs_client *client, struct rsfs_call *call){
+    call->ret = -1;
+    if(client->counts[building(client)]>0 && rsfs_client_send(client)<0) return -1; //calls already added go first
+    if(rsfs_client_add(client, call)<0 || rsfs_client_send(client)<0) return -1;
+    while(client->inflight>0){
+        if(rsfs_client_recv(client)<0) return -1;
+    }
+    return call->ret;
+}
+
+//helper: make one call and return its result
+static int64_t remote(struct rsfs_client *client, int op, int fd, int64_t arg, int64_t arg2, const char *path,
+        const void *data, int len, void *out, int out_size){
+    struct rsfs_call call = {op, fd, arg, arg2, path, data, len, out, out_size, -1};
+    return rsfs_client_call(client, &call);
+}
+
+//the rsfs_* API, remotely: each call is one round trip
+
+int rsfs_remote_create(struct rsfs_client *client, const char *path){
+    return remote(client, RSFSD_OP_CREATE, -1, 0, 0, path, NULL, 0, NULL, 0);
+}
+
+int rsfs_remote_open(struct rsfs_client *client, const char *path, int access_flag){
+    return remote(client, RSFSD_OP_OPEN, -1, access_flag, 0, path, NULL, 0, NULL, 0);
+}
+
+int rsfs_remote_close(struct rsfs_client *client, int fd){
+    return remote(client, RSFSD_OP_CLOSE, fd, 0, 0, NULL, NULL, 0, NULL, 0);
+}
+
+//reads, writes and appends of more than RSFSD_MAX_PAYLOAD bytes are cut short to it, and return the bytes done
+
+int64_t rsfs_remote_read(struct rsfs_client *client, int fd, void *buf, int64_t size){
+    if(size>RSFSD_MAX_PAYLOAD) size = RSFSD_MAX_PAYLOAD; //the reply has to fit in one frame
+    return remote(client, RSFSD_OP_READ, fd, size, 0, NULL, NULL, 0, buf, (int)size);
+}
+
+int64_t rsfs_remote_write(struct rsfs_client *client, int fd, const void *buf, int64_t size){
+    if(size>RSFSD_MAX_PAYLOAD) size = RSFSD_MAX_PAYLOAD; //the data is sent in one request
+    return remote(client, RSFSD_OP_WRITE, fd, 0, 0, NULL, buf, (int)size, NULL, 0);
+}
+
+int64_t rsfs_remote_append(struct rsfs_client *client, int fd, const void *buf, int64_t size){
+    if(size>RSFSD_MAX_PAYLOAD) size = RSFSD_MAX_PAYLOAD;
+    return remote(client, RSFSD_OP_APPEND, fd, 0, 0, NULL, buf, (int)size, NULL, 0);
+}
+
+int64_t rsfs_remote_fseek(struct rsfs_client *client, int fd, int64_t offset){
+    return remote(client, RSFSD_OP_FSEEK, fd, offset, 0, NULL, NULL, 0, NULL, 0);
+}
+
+int64_t rsfs_remote_cut(struct rsfs_client *client, int fd, int64_t size){
+    return remote(client, RSFSD_OP_CUT, fd, size, 0, NULL, NULL, 0, NULL, 0);
+}
+
+int rsfs_remote_delete(struct rsfs_client *client, const char *path){
+    return remote(client, RSFSD_OP_DELETE, -1, 0, 0, path, NULL, 0, NULL, 0);
+}
+
+int rsfs_remote_fallocate(struct rsfs_client *client, int fd, int64_t offset, int64_t len){
+    return remote(client, RSFSD_OP_FALLOCATE, fd, offset, len, NULL, NULL, 0, NULL, 0);
+}
+
+int rsfs_remote_truncate(struct rsfs_client *client, int fd, int64_t length){
+    return remote(client, RSFSD_OP_TRUNCATE, fd, length, 0, NULL, NULL, 0, NULL, 0);
+}
+
+int rsfs_remote_flush(struct rsfs_client *client, int fd){
+    return remote(client, RSFSD_OP_FLUSH, fd, 0, 0, NULL, NULL, 0, NULL, 0);
+}
+
+int rsfs_remote_mkdir(struct rsfs_client *client, const char *path){
+    return remote(client, RSFSD_OP_MKDIR, -1, 0, 0, path, NULL, 0, NULL, 0);
+}
+
+int rsfs_remote_rmdir(struct rsfs_client *client, const char *path){
+    return remote(client, RSFSD_OP_RMDIR, -1, 0, 0, path, NULL, 0, NULL, 0);
+}
+
+int rsfs_remote_readdir(struct rsfs_client *client, const char *path, struct rsfs_dirent *entries, int max){
+    return remote(client, RSFSD_OP_READDIR, -1, 0, max, path, NULL, 0, entries, max * (int)sizeof(struct rsfs_dirent));
+}
+
+int rsfs_remote_seal(struct rsfs_client *client, int fd){
+    return remote(client, RSFSD_OP_SEAL, fd, 0, 0, NULL, NULL, 0, NULL, 0);
+}
@@ -0,0 +1,167 @@
+/*
+    the original single-volume API: thin wrappers that forward every call
+    to a default volume created by RSFS_init()
+*/
+
+#include "def.h"
+
+static struct rsfs *default_fs; //the volume used by the RSFS_* calls
+
+//initialize the default volume; return 0 if succeed, or -1 otherwise
+int RSFS_init(){
+    default_fs = rsfs_init();
+    return default_fs ? 0 : -1;
+}
+
+//initialize the default volume with the given layout; return 0 if succeed, or -1 otherwise
+int RSFS_format(int layout){
+    default_fs = rsfs_format(layout);
+    return default_fs ? 0 : -1;
+}
+
+//mount the shared-memory volume name as the default volume, creating it if no process has;
+//return 0 if succeed, or -1 otherwise
+int RSFS_init_shared(const char *name){
+    default_fs = rsfs_open_shared(name);
+    return default_fs ? 0 : -1;
+}
+
+int RSFS_recover(){
+    return rsfs_recover(default_fs);
+}
+
+void RSFS_stat(){
+    rsfs_stat(default_fs);
+}
+
+int RSFS_create(char *file_name){
+    return rsfs_create(default_fs, file_name);
+}
+
+int RSFS_open(char *file_name, int access_flag){
+    return rsfs_open(default_fs, file_name, access_flag);
+}
+
+int64_t RSFS_append(int fd, void *buf, int64_t size){
+    return rsfs_append(default_fs, fd, buf, size);
+}
+
+int64_t RSFS_fseek(int fd, int64_t offset){
+    return rsfs_fseek(default_fs, fd, offset);
+}
+
+int64_t RSFS_read(int fd, void *buf, int64_t size){
+    return rsfs_read(default_fs, fd, buf, size);
+}
+
+int RSFS_close(int fd){
+    return rsfs_close(default_fs, fd);
+}
+
+int64_t RSFS_write(int fd, void *buf, int64_t size){
+    return rsfs_write(default_fs, fd, buf, size);
+}
+
+int64_t RSFS_cut(int fd, int64_t size){
+    return rsfs_cut(default_fs, fd, size);
+}
+
+int RSFS_delete(char *file_name){
+    return rsfs_delete(default_fs, file_name);
+}
+
+int RSFS_fallocate(int fd, int64_t offset, int64_t len){
+    return rsfs_fallocate(default_fs, fd, offset, len);
+}
+
+int RSFS_truncate(int fd, int64_t length){
+    return rsfs_truncate(default_fs, fd, length);
+}
+
+int RSFS_flush(int fd){
+    return rsfs_flush(default_fs, fd);
+}
+
+int RSFS_mkdir(char *path){
+    return rsfs_mkdir(default_fs, path);
+}
+
+int RSFS_rmdir(char *path){
+    return rsfs_rmdir(default_fs, path);
+}
+
+int RSFS_readdir(char *path, struct rsfs_dirent *entries, int max){
+    return rsfs_readdir(default_fs, path, entries, max);
+}
+
+int RSFS_seal(int fd){
+    return rsfs_seal(default_fs, fd);
+}
+
+void *RSFS_mmap(int fd, int64_t offset, int64_t len){
+    return rsfs_mmap(default_fs, fd, offset, len);
+}
+
+int RSFS_munmap(void *addr){
+    return rsfs_munmap(default_fs, addr);
+}
+
+int RSFS_import_dir(const char *host_dir, char *path){
+    return rsfs_import_dir(default_fs, host_dir, path, 0);
+}
+
+int RSFS_export_dir(char *path, const char *host_dir){
+    return rsfs_export_dir(default_fs, path, host_dir, 0);
+}
+
+int64_t RSFS_scan(const char *pattern, rsfs_scan_fn callback, void *arg){
+    return rsfs_scan(default_fs, pattern, strlen(pattern), 0, callback, arg);
+}
+
+int RSFS_defrag_start(int blocks_per_sec){
+    return rsfs_defrag_start(default_fs, blocks_per_sec);
+}
+
+void RSFS_defrag_stop(){
+    rsfs_defrag_stop(default_fs);
+}
+
+struct rsfs_stream *RSFS_fopen(char *file_name, int access_flag){
+    return rsfs_fopen(default_fs, file_name, access_flag);
+}
+
+int RSFS_setvbuf(struct rsfs_stream *stream, int mode, int size){
+    return rsfs_setvbuf(stream, mode, size);
+}
+
+int64_t RSFS_fwrite(struct rsfs_stream *stream, void *buf, int64_t size){
+    return rsfs_fwrite(stream, buf, size);
+}
+
+int64_t RSFS_fread(struct rsfs_stream *stream, void *buf, int64_t size){
+    return rsfs_fread(stream, buf, size);
+}
+
+int RSFS_fflush(struct rsfs_stream *stream){
+    return rsfs_fflush(stream);
+}
+
+int RSFS_fsetpos(struct rsfs_stream *stream, int64_t offset){
+    return rsfs_fsetpos(stream, offset);
+}
+
+int RSFS_fclose(struct rsfs_stream *stream){
+    return rsfs_fclose(stream);
+}
+
+int RSFS_stats_snapshot(struct rsfs_stats *stats){
+    return rsfs_stats_snapshot(default_fs, stats);
+}
+
+void RSFS_trace_enable(int on){
+    rsfs_trace_enable(on);
+}
+
+int RSFS_trace_dump(const char *path){
+    return rsfs_trace_dump(path);
+}
@@ -1,45 +1,262 @@
 /*
-    Allocation of data block, data block bitmaps and mutex to guard M.E. access; 
-    routines for managing them
+    routines for managing the data blocks and the data block bitmap of a file system;
+    the blocks, the bitmap and the mutex guarding them live in struct rsfs;
+    with the log-structured layout, the bitmap marks live blocks and new blocks are
+    always taken at the head of the log (see log.c);
+    the medium and large blocks that hold the bytes of a file before its tail (see blockmap.c)
+    are managed by class, each with a bitmap and a mutex of its own; the log-structured layout
+    does not use them; with RSFS_MEMFD their memory is the volume's memfd (see mmap.c)
 */
 
 #include "def.h"
 
 
-//allocation of data block and data block bitmaps
-void *data_blocks[BLOCK_SIZE];
-int data_bitmap[NUM_DBLOCKS];
-pthread_mutex_t data_bitmap_mutex;
-
-
 //to allocate an empty data block and return the block-number;
 //if no free data block is available, return -1
-int allocate_data_block(){
+int allocate_data_block(struct rsfs *fs){
 
     int block_number=-1; //init
 
-    pthread_mutex_lock(&data_bitmap_mutex);
+    TRACE(fs, 'B', "allocate_data_block");
+    lock_mutex(fs, &fs->data_bitmap_mutex, RSFS_LOCK_DATA_BITMAP);
 
-    for(int i=0; i<NUM_DBLOCKS; i++){
-        if(data_bitmap[i]==0){//find an available data block
-            block_number=i;
-            data_bitmap[i]=1; //mark it as allocated
-            break;
+    if(fs->num_free_dblocks-fs->num_reserved_dblocks<=0){//the remaining blocks are reserved
+        pthread_mutex_unlock(&fs->data_bitmap_mutex);
+        TRACE(fs, 'E', "allocate_data_block");
+        return -1;
+    }
+
+    if(fs->layout==RSFS_LAYOUT_LOG){
+        if(log_take_blocks_locked(fs, 1, &block_number)==1) fs->num_free_dblocks--;
+        else block_number=-1;
+    }else{
+        for(int i=0; i<NUM_DBLOCKS; i++){
+            if(fs->data_bitmap[i]==0){//find an available data block
+                block_number=i;
+                fs->data_bitmap[i]=1; //mark it as allocated
+                fs->num_free_dblocks--;
+                break;
+            }
         }
     }
 
-    pthread_mutex_unlock(&data_bitmap_mutex);
+    pthread_mutex_unlock(&fs->data_bitmap_mutex);
+    TRACE(fs, 'E', "allocate_data_block");
 
     return block_number;
 }
 
 //to free a data block with the provided block_number
-void free_data_block(int block_number){
+void free_data_block(struct rsfs *fs, int block_number){
+
+    TRACE(fs, 'B', "free_data_block");
+    lock_mutex(fs, &fs->data_bitmap_mutex, RSFS_LOCK_DATA_BITMAP);
+
+    fs->data_bitmap[block_number]=0; //reset it to available
+    fs->num_free_dblocks++;
+    if(fs->layout==RSFS_LAYOUT_LOG) fs->seg_live[block_number/SEGMENT_BLOCKS]--; //now a dead block of its segment
+
+    pthread_mutex_unlock(&fs->data_bitmap_mutex);
+    TRACE(fs, 'E', "free_data_block");
+}
+
+
+//helper: allocate n data blocks into blocks[], preferring a contiguous run;
+//from_reserved tells whether the blocks were reserved earlier by reserve_data_blocks();
+//the caller holds data_bitmap_mutex
+static int allocate_data_blocks_locked(struct rsfs *fs, int n, int *blocks, int from_reserved){
+
+    int available = from_reserved ? fs->num_free_dblocks : fs->num_free_dblocks-fs->num_reserved_dblocks;
+    if(n>available) return -1; //not enough free blocks
+
+    if(fs->layout==RSFS_LAYOUT_LOG){
+        if(log_take_blocks_locked(fs, n, blocks)<0) return -1; //contiguous in the log by construction
+        fs->num_free_dblocks-=n;
+        if(from_reserved) fs->num_reserved_dblocks-=n;
+        return n;
+    }
+
+    //first pass: look for a contiguous run of n free blocks
+    int run_start=-1, run_len=0;
+    for(int i=0; i<NUM_DBLOCKS && run_len<n; i++){
+        if(fs->data_bitmap[i]==0){
+            if(run_len==0) run_start=i;
+            run_len++;
+        }else{
+            run_len=0;
+        }
+    }
+
+    int found=0;
+    if(run_len==n){
+        for(int i=0; i<n; i++) blocks[found++]=run_start+i;
+    }else{
+        //second pass: take whatever free blocks there are
+        for(int i=0; i<NUM_DBLOCKS && found<n; i++){
+            if(fs->data_bitmap[i]==0) blocks[found++]=i;
+        }
+    }
+
+    for(int i=0; i<n; i++) fs->data_bitmap[blocks[i]]=1; //mark them as allocated
+    fs->num_free_dblocks-=n;
+    if(from_reserved) fs->num_reserved_dblocks-=n;
+
+    return n;
+}
+
+//to allocate n empty data blocks at once and store their block-numbers in blocks[];
+//a contiguous run of n free blocks is preferred, otherwise any n free blocks are taken;
+//return n if succeed, or -1 (nothing allocated) if fewer than n blocks are free
+int allocate_data_blocks(struct rsfs *fs, int n, int *blocks){
+
+    if(n<=0) return 0;
+
+    TRACE(fs, 'B', "allocate_data_blocks");
+    lock_mutex(fs, &fs->data_bitmap_mutex, RSFS_LOCK_DATA_BITMAP);
+    int ret = allocate_data_blocks_locked(fs, n, blocks, 0);
+    pthread_mutex_unlock(&fs->data_bitmap_mutex);
+    TRACE(fs, 'E', "allocate_data_blocks");
+
+    return ret;
+}
+
+//same as allocate_data_blocks(), but the n blocks are taken out of an earlier reservation
+int allocate_reserved_data_blocks(struct rsfs *fs, int n, int *blocks){
+
+    if(n<=0) return 0;
+
+    TRACE(fs, 'B', "allocate_reserved_data_blocks");
+    lock_mutex(fs, &fs->data_bitmap_mutex, RSFS_LOCK_DATA_BITMAP);
+    int ret = allocate_data_blocks_locked(fs, n, blocks, 1);
+    pthread_mutex_unlock(&fs->data_bitmap_mutex);
+    TRACE(fs, 'E', "allocate_reserved_data_blocks");
+
+    return ret;
+}
+
+//to reserve up to n free data blocks for a later allocate_reserved_data_blocks();
+//reserved blocks stay free in the bitmap but cannot be taken by other allocations;
+//return the number of blocks actually reserved
+int reserve_data_blocks(struct rsfs *fs, int n){
+
+    TRACE(fs, 'B', "reserve_data_blocks");
+    lock_mutex(fs, &fs->data_bitmap_mutex, RSFS_LOCK_DATA_BITMAP);
+
+    int available = fs->num_free_dblocks-fs->num_reserved_dblocks;
+    if(n>available) n=available;
+    if(n<0) n=0;
+    fs->num_reserved_dblocks+=n;
 
-    pthread_mutex_lock(&data_bitmap_mutex);
+    pthread_mutex_unlock(&fs->data_bitmap_mutex);
+    TRACE(fs, 'E', "reserve_data_blocks");
 
-    data_bitmap[block_number]=0; //reset it to available
+    return n;
+}
+
+//to give back n reserved data blocks that will not be allocated
+void unreserve_data_blocks(struct rsfs *fs, int n){
+
+    TRACE(fs, 'B', "unreserve_data_blocks");
+    lock_mutex(fs, &fs->data_bitmap_mutex, RSFS_LOCK_DATA_BITMAP);
+
+    fs->num_reserved_dblocks-=n;
+
+    pthread_mutex_unlock(&fs->data_bitmap_mutex);
+    TRACE(fs, 'E', "unreserve_data_blocks");
+}
+
+
+//set up the block classes of fs: medium blocks of MEDIUM_BLOCK_SIZE and large blocks of LARGE_BLOCK_SIZE;
+//only the bitmaps and the tables of block pointers are allocated here, the blocks on first use
+//(or, if fs has a memfd, the blocks are pointed at their place in it);
+//return 0 if succeed, or -1 if memory runs out
+int init_block_classes(struct rsfs *fs){
+
+    static const int sizes[RSFS_NUM_CLASSES] = {MEDIUM_BLOCK_SIZE, LARGE_BLOCK_SIZE};
+    static const int counts[RSFS_NUM_CLASSES] = {NUM_MEDIUM_BLOCKS, NUM_LARGE_BLOCKS};
 
-    pthread_mutex_unlock(&data_bitmap_mutex);
+    for(int c=0; c<RSFS_NUM_CLASSES; c++){
+        struct block_class *bc = &fs->classes[c];
+        bc->block_size = sizes[c];
+        bc->num_blocks = counts[c];
+        bc->blocks = fs_alloc(fs, sizeof(void *) * counts[c]);
+        bc->bitmap = fs_alloc(fs, counts[c]);
+        if(bc->blocks==NULL || bc->bitmap==NULL) return -1;
+        if(fs->memfd_base){
+            for(int i=0; i<counts[c]; i++) bc->blocks[i] = memfd_block(fs, c, i);
+        }
+        bc->num_free = counts[c];
+        bc->next = 0;
+        init_mutex(fs, &bc->mutex, 1);
+    }
+    return 0;
 }
 
+//free the memory of every block of every class of fs, and the classes' tables
+void destroy_block_classes(struct rsfs *fs){
+
+    for(int c=0; c<RSFS_NUM_CLASSES; c++){
+        struct block_class *bc = &fs->classes[c];
+        if(bc->blocks && fs->memfd_base==NULL){
+            for(int i=0; i<bc->num_blocks; i++) fs_free(fs, bc->blocks[i]);
+        }
+        fs_free(fs, bc->blocks);
+        fs_free(fs, bc->bitmap);
+        bc->blocks = NULL;
+        bc->bitmap = NULL;
+    }
+}
+
+//to allocate a block of class cls and return the block-number;
+//the search starts after the block allocated last, so a file written in order gets consecutive blocks;
+//if no free block is available (or its memory can not be allocated), return -1
+int allocate_class_block(struct rsfs *fs, int cls){
+
+    struct block_class *bc = &fs->classes[cls];
+    int block_number=-1; //init
+
+    TRACE(fs, 'B', "allocate_class_block");
+    lock_mutex(fs, &bc->mutex, RSFS_LOCK_BLOCK_CLASS);
+
+    if(bc->num_free>0){
+        for(int k=0; k<bc->num_blocks; k++){
+            int i = (bc->next + k) % bc->num_blocks;
+            if(bc->bitmap[i]==0){//find an available block
+                block_number=i;
+                bc->bitmap[i]=1; //mark it as allocated
+                bc->num_free--;
+                bc->next=i+1;
+                break;
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&bc->mutex);
+
+    //the block is ours now, so its memory can be set up without the mutex
+    if(block_number>=0 && bc->blocks[block_number]==NULL){
+        bc->blocks[block_number] = fs_alloc(fs, bc->block_size);
+        if(bc->blocks[block_number]==NULL){
+            free_class_block(fs, cls, block_number);
+            block_number=-1;
+        }
+    }
+    TRACE(fs, 'E', "allocate_class_block");
+
+    return block_number;
+}
+
+//to free a block of class cls with the provided block_number; its memory is kept for the next allocation
+void free_class_block(struct rsfs *fs, int cls, int block_number){
+
+    struct block_class *bc = &fs->classes[cls];
+
+    TRACE(fs, 'B', "free_class_block");
+    lock_mutex(fs, &bc->mutex, RSFS_LOCK_BLOCK_CLASS);
+
+    bc->bitmap[block_number]=0; //reset it to available
+    bc->num_free++;
+
+    pthread_mutex_unlock(&bc->mutex);
+    TRACE(fs, 'E', "free_class_block");
+}
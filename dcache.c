@@ -0,0 +1,77 @@
+/*
+    dentry cache: remembers the result of looking up a path component in a directory,
+    keyed by (parent directory, component), including negative results, so that path
+    resolution mostly takes a shared stripe lock instead of each directory's mutex;
+    entries are added and replaced only while the parent's mutex is held (see dir.c),
+    which orders them with the inserts and deletes of the parent
+*/
+
+#include "def.h"
+
+//helper: the set of a key
+static int set_of(struct dir *parent, uint32_t hash){
+    uintptr_t p = (uintptr_t)parent;
+    return (int)((hash ^ (uint32_t)(p>>6) ^ (uint32_t)(p>>18)) & (DCACHE_BUCKETS-1));
+}
+
+//helper: the way of set holding the key, or -1; the caller holds the stripe lock of set
+static int find_way(struct dcache_entry *set, struct dir *parent, const char *name, int len, uint32_t hash){
+    for(int w=0; w<DCACHE_WAYS; w++){
+        struct dcache_entry *e = &set[w];
+        if(e->parent==parent && e->hash==hash && e->len==len && memcmp(e->name, name, len)==0) return w;
+    }
+    return -1;
+}
+
+void dcache_init(struct rsfs *fs){
+    memset(fs->dcache.sets, 0, sizeof(fs->dcache.sets));
+    memset(fs->dcache.victim, 0, sizeof(fs->dcache.victim));
+    for(int i=0; i<DCACHE_STRIPES; i++) pthread_rwlock_init(&fs->dcache.locks[i], NULL);
+}
+
+void dcache_destroy(struct rsfs *fs){
+    for(int i=0; i<DCACHE_STRIPES; i++) pthread_rwlock_destroy(&fs->dcache.locks[i]);
+}
+
+//look up name[0..len) in parent; return 1 and set *entry (NULL for a negative entry) if cached, or 0
+int dcache_lookup(struct rsfs *fs, struct dir *parent, const char *name, int len, uint32_t hash, struct dir_entry **entry){
+    if(fs->shm) return 0; //not used by shared volumes: its rwlocks can not be recovered from a dead process
+    if(len>=DCACHE_NAME_LEN){
+        stats_dcache(fs, 0);
+        return 0;
+    }
+
+    int s = set_of(parent, hash);
+    pthread_rwlock_t *lock = &fs->dcache.locks[s % DCACHE_STRIPES];
+
+    pthread_rwlock_rdlock(lock);
+    int w = find_way(fs->dcache.sets[s], parent, name, len, hash);
+    if(w>=0) *entry = fs->dcache.sets[s][w].entry;
+    pthread_rwlock_unlock(lock);
+
+    stats_dcache(fs, w>=0);
+    return w>=0;
+}
+
+//cache that name[0..len) in parent is entry (NULL: does not exist), replacing what was cached for it;
+//the caller holds parent->mutex
+void dcache_insert(struct rsfs *fs, struct dir *parent, const char *name, int len, uint32_t hash, struct dir_entry *entry){
+    if(fs->shm || len>=DCACHE_NAME_LEN) return;
+
+    int s = set_of(parent, hash);
+    pthread_rwlock_t *lock = &fs->dcache.locks[s % DCACHE_STRIPES];
+    struct dcache_entry *set = fs->dcache.sets[s];
+
+    pthread_rwlock_wrlock(lock);
+    int w = find_way(set, parent, name, len, hash);
+    if(w<0){ //take the victim way, round robin
+        w = fs->dcache.victim[s];
+        fs->dcache.victim[s] = (w+1) % DCACHE_WAYS;
+        set[w].parent = parent;
+        set[w].hash = hash;
+        set[w].len = len;
+        memcpy(set[w].name, name, len);
+    }
+    set[w].entry = entry;
+    pthread_rwlock_unlock(lock);
+}
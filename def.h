@@ -7,6 +7,7 @@
 #include <string.h>
 #include <pthread.h>
 #include <stdio.h>
+#include <stdint.h>
 
 
 //global constants
@@ -14,10 +15,54 @@
 #define NUM_DBLOCKS 32 //total number of data blocks
 #define NUM_POINTER 8 //total number of (direct) pointers for each inode; i.e., each file can have at most this number of data blocks
 #define BLOCK_SIZE 32 //size of each data block (unit: byte)
-#define NUM_OPEN_FILE 8 //maximum number of files that can be open at a time in the whole system
+#define MEDIUM_BLOCK_SIZE 4096 //size of a block of the medium class (unit: byte)
+#define LARGE_BLOCK_SIZE 65536 //size of a block of the large class (unit: byte)
+#define NUM_MEDIUM_BLOCKS 4096 //total number of medium blocks; each is allocated on first use
+#define NUM_LARGE_BLOCKS 65536 //total number of large blocks; each is allocated on first use
+#define NUM_MEDIUM_POINTER (LARGE_BLOCK_SIZE/MEDIUM_BLOCK_SIZE) //most medium blocks between the body and the tail of a file
+#define TAIL_SIZE (NUM_POINTER*BLOCK_SIZE) //bytes held by the small blocks at the tail of a file
+#define OPEN_FILE_CHUNK 64 //the open file table of a volume grows by this many entries at a time
+#define FD_INDEX_BITS 16 //low bits of a descriptor: index of its open file entry; the rest is the entry's generation
+#define MAX_OPEN_FILE (1<<FD_INDEX_BITS) //maximum number of files that can be open at a time in a volume
+#define DIRTY_BUFFER_SIZE TAIL_SIZE //size of the per-open-file buffer of written but unflushed data
+#define DIR_INITIAL_BUCKETS 8 //initial size of the index of a directory; doubled as the directory grows (a power of two)
+#define DIR_NAME_PREFIX 8 //leading bytes of a name kept inline in dir_entry
+#define DIR_POOL_ENTRIES 16 //dir_entry are allocated from a directory's pool this many at a time
+#define DIR_ARENA_SIZE 512 //names are copied into a directory's arena in chunks of this many bytes
+#define DIR_REUSE_SCAN 8 //free entries of a directory a create looks through for a name buffer that fits
+#define DCACHE_BUCKETS 256 //number of sets of the dentry cache of a volume (a power of two)
+#define DCACHE_WAYS 4 //entries per set of the dentry cache
+#define DCACHE_STRIPES 32 //number of locks striped over the sets of the dentry cache
+#define DCACHE_NAME_LEN 32 //components this long or longer are not cached
+#define RSFS_NAME_LEN 64 //size of rsfs_dirent.name; longer names are truncated by rsfs_readdir()
+#define BULK_CHUNK (1<<20) //bytes copied per call by rsfs_import_dir() and rsfs_export_dir()
+#define SCAN_CHUNK (1<<20) //bytes of a file searched by one task of rsfs_scan()
+#define SCAN_MAX_PATTERN 256 //longest pattern of rsfs_scan()
+
+#define SEGMENT_BLOCKS 4 //log-structured layout: blocks per segment
+#define NUM_SEGMENTS (NUM_DBLOCKS/SEGMENT_BLOCKS) //log-structured layout: number of segments
+#define LOG_RESERVED_BLOCKS (2*SEGMENT_BLOCKS+NUM_INODES) //log-structured layout: blocks kept back for the cleaner and the inode records
+#define LOG_CLEAN_TARGET 2 //log-structured layout: the background cleaner keeps this many clean segments
+#define LOG_CLEAN_MAX_LIVE 2 //log-structured layout: the background cleaner only cleans segments with at most this many live blocks
+#define LOG_CLEANER_INTERVAL_MS 10 //log-structured layout: the background cleaner checks the log this often
+#define DEFRAG_INTERVAL_MS 10 //the defragmenter walks the inodes this often
+
+#define RSFS_STREAM_BUFSIZE (4*BLOCK_SIZE) //default buffer size of a stream (rsfs_fopen)
+#define RSFS_IOFBF 0 //stream buffering mode: flush when the buffer is full
+#define RSFS_IOLBF 1 //stream buffering mode: also flush after a write holding a newline
+#define RSFS_IONBF 2 //stream buffering mode: no buffering
+#define RSFS_SHM_SIZE (64ull<<20) //bytes of the shared-memory segment of a shared volume (sparse)
+#define RSFS_SHM_BASE 0x600000000000ull //start of the address range shared volumes are mapped at, in every process
+#define RSFS_SHM_SLOTS 16 //slots of RSFS_SHM_SIZE bytes in that range; a volume is created in the first one free in its creator
+#define INODE_DEAD (1<<30) //flag in inode.refcount: the file was deleted and is freed by its last reference
 
 #define RSFS_RDONLY 0 //a value for access_flag in RSFS_open(): file is open for read only
 #define RSFS_RDWR 1 //a value for access_flag in RSFS_open(): file is open for read and write  
+#define RSFS_APPEND 2 //a value for access_flag in RSFS_fopen() only: read and write, every write goes to the end of the file
+
+#define RSFS_LAYOUT_INPLACE 0 //a value for layout in rsfs_format(): data blocks are overwritten in place
+#define RSFS_LAYOUT_LOG 1 //a value for layout in rsfs_format(): data blocks and inodes are appended to a log of segments
+#define RSFS_MEMFD 0x100 //or'ed into layout in rsfs_format() (in place only): the medium and large blocks live in a memfd, so files can be mapped with rsfs_mmap()
 
 #define RSFS_SEEK_SET 0 //a value for whence in RSFS_fseek()
 #define RSFS_SEEK_CUR 1 //a value for whence in RSFS_fseek()
@@ -25,99 +70,656 @@
 
 #define DEBUG 0 //1-enable debug, 0-disable debug prints
 
-//directory entry
+struct dir;
+struct rsfs_shm;
+struct rsfs_client;
+struct rsfs_pool;
+
+//directory entry: one cache line, allocated from the pool of its directory;
+//the fields compared while walking an index chain come first, and a name of up to
+//DIR_NAME_PREFIX bytes is compared without dereferencing name
 struct dir_entry{
-    char *name; //file name
-    int inode_number; //inode_number identifying the inode of the file
+    uint32_t hash; //hash of name (hash_name)
+    uint16_t len; //length of name
+    char prefix[DIR_NAME_PREFIX]; //first bytes of name, zero-padded
+    uint16_t name_cap; //bytes of the buffer of name, which a reuse of the entry may fill with a longer name
+    struct dir_entry *hash_next; //next entry in the same bucket of the parent's index
+    const char *name; //file name (one path component), NUL-terminated, in the arena of the directory
+    int inode_number; //inode_number identifying the inode of the file; -1 for a directory
+    struct dir *dir; //the directory this entry names, or NULL if it names a file
     struct dir_entry *next; //pointers to form a doubly-linked list of directory entries
     struct dir_entry *prev;
+} __attribute__((aligned(64)));
+
+//a chunk of memory owned by a directory (entry pool or name arena); freed with the directory
+struct dir_chunk{
+    struct dir_chunk *next; //other chunks of the same pool or arena
+    int size; //bytes in data
+    int used; //bytes of data handed out
+    char data[] __attribute__((aligned(64)));
 };
 
-//root directory: a linked list of dir_entry (directory entries) 
-struct root_dir{
+//directory: dir_entry (directory entries) indexed by a hash table of their names,
+//and also kept in a linked list in creation order
+struct dir{
+    struct dir_entry **buckets; //index: chains of entries linked by hash_next
+    int num_buckets; //size of the index (a power of two)
+    int num_entries; //number of entries
     struct dir_entry *head; //pointer to the first entry of the list
     struct dir_entry *tail; //pointer to the last entry of the list
-    pthread_mutex_t mutex; //mutex to guard mutually-exclusive access of the list
+    struct dir *parent; //directory containing this one; the root is its own parent
+    int removed; //1 once removed by rsfs_rmdir(); nothing can be inserted anymore
+    struct dir *next_removed; //list of removed directories of the volume, freed by rsfs_destroy()
+    struct dir_chunk *pool; //chunks of dir_entry; chunks are never freed before the directory
+    struct dir_chunk *arena; //chunks of names
+    struct dir_entry *free_entries; //entries of deleted files, with their names, reused by later creates (linked by next)
+    pthread_mutex_t mutex; //mutex to guard mutually-exclusive access of the index and the list
 };
-extern struct root_dir root_dir; //global variable of the root directory
 
-//inode data structure: inodes implemented in inode.c
+//an entry listed by rsfs_readdir()
+struct rsfs_dirent{
+    char name[RSFS_NAME_LEN];
+    int is_dir; //1 for a directory, 0 for a file
+    int64_t length; //length of the file; 0 for a directory
+    int extents; //runs of consecutive data blocks of the file (1: contiguous); 0 for a directory or a file without blocks
+};
+
+//buffered stream over an open file (stream.c), created by rsfs_fopen(); used by one thread at a time
+struct rsfs_stream{
+    struct rsfs *fs;
+    int fd; //descriptor the stream reads and writes through
+    int access_flag; //RSFS_RDONLY or RSFS_RDWR (also for a stream opened with RSFS_APPEND)
+    int append; //1 if opened with RSFS_APPEND: buffered writes are placed at the end of the file when flushed
+    int mode; //RSFS_IOFBF, RSFS_IOLBF or RSFS_IONBF
+    char *buf; //size bytes, holding either buffered writes or read-ahead data
+    int size;
+    int64_t pos; //position of the stream in the file
+    int64_t wstart; //file offset of the buffered writes
+    int wlen; //number of buffered bytes not written to the file yet
+    int64_t rstart; //file offset of the read-ahead data (a block boundary)
+    int rlen; //number of read-ahead bytes, 0 if none
+    int used; //1 after the first read or write; rsfs_setvbuf() is not allowed anymore
+    int error; //1 once a flush could not write all the buffered data; rsfs_fwrite() then fails and rsfs_fclose() returns -1
+};
+
+//dentry cache: a set-associative cache of path component lookups, keyed by (parent, name);
+//a negative entry (entry==NULL) records that the name does not exist in the parent
+struct dcache_entry{
+    struct dir *parent; //NULL if the way is empty
+    uint32_t hash;
+    int len;
+    char name[DCACHE_NAME_LEN];
+    struct dir_entry *entry;
+};
+
+struct dcache{
+    struct dcache_entry sets[DCACHE_BUCKETS][DCACHE_WAYS];
+    int victim[DCACHE_BUCKETS]; //way of each set to replace next
+    pthread_rwlock_t locks[DCACHE_STRIPES]; //set i is guarded by locks[i % DCACHE_STRIPES]
+};
+
+//a class of data blocks larger than BLOCK_SIZE (data_block.c); the memory of a block is allocated
+//when the block is first handed out and kept for reuse until the volume is destroyed
+enum rsfs_class{
+    RSFS_CLASS_MEDIUM, RSFS_CLASS_LARGE,
+    RSFS_NUM_CLASSES
+};
+
+struct block_class{
+    int block_size; //bytes per block
+    int num_blocks;
+    void **blocks; //memory of each block, NULL until it is first allocated
+    uint8_t *bitmap; //1: allocated
+    int num_free; //number of free blocks
+    int next; //where the search for a free block starts
+    pthread_mutex_t mutex; //mutex to guard mutually-exclusive access of the bitmap
+};
+
+//inode data structure: inodes managed in inode.c;
+//a file is laid out as a body of large blocks, up to NUM_MEDIUM_POINTER medium blocks and a tail of
+//small blocks (see blockmap.c); the body and the medium blocks never have holes
 struct inode {
-    int block[NUM_POINTER]; //(direct) pointers to data blocks; note: value<0 means the block is not used
-    int length; //length of the file of the inode
+    int block[NUM_POINTER]; //(direct) pointers to the small data blocks of the tail; note: value<0 means the block is not used
+    int64_t length; //length of the file of the inode
+    int *large; //pointers to the large blocks of the body, large_cap of them, in the volume's memory; NULL until needed
+    int large_cap;
+    int num_large; //large blocks in the body: the first num_large*LARGE_BLOCK_SIZE bytes
+    int medium[NUM_MEDIUM_POINTER]; //pointers to the medium blocks after the body
+    int num_medium; //medium blocks in use; the tail starts after them
 
     //following are used to regulate concurrent reading and exclusive writing;
     //recall the solution of reader/writer's problem discussed in class
     int num_current_reader;
     pthread_mutex_t rw_mutex;
     pthread_mutex_t read_mutex;
-};
-extern struct inode inodes[NUM_INODES]; //global array of inodes
-extern pthread_mutex_t inodes_mutex; //mutex to guard mutually-exclusive access of inodes
 
-//inode bitmap: implemented in inode.c
-extern int inode_bitmap[NUM_INODES]; //global inode bitmap
-extern pthread_mutex_t inode_bitmap_mutex; //mutex to guard mutually-exclusive access of the bitmap
+    //a sealed file (rsfs_seal) is read-only for good; its opens skip the protocol above and only count references
+    int sealed; //1 once sealed; never cleared until the inode is freed
+    int refcount; //number of sealed descriptors of the file and pins of the defragmenter, plus INODE_DEAD once it is deleted
 
-//data bitmap: implemented in data_block.c
-extern int data_bitmap[NUM_DBLOCKS]; //global data-block bitmap
-extern pthread_mutex_t data_bitmap_mutex; //mutex to guard mutually-exclusive access of the bitmap
-
-//data blocks: implemented in data_block.c
-extern void *data_blocks[BLOCK_SIZE]; //global array of pointers to the data blocks
+    //log-structured layout: held while block[] or the blocks' contents are used, so the cleaner does not move them meanwhile;
+    //never held while waiting for another lock, and initialized once, as the cleaner may take it for a free inode
+    pthread_mutex_t map_mutex;
+};
 
-//open file entry: open_file_table implemented in open_file_table.c 
+//open file entry: open_file_table managed in open_file_table.c 
 struct open_file_entry{
     int used; //0-the entry is not in use, or 1- it is in use (already allocated)
+    int generation; //bumped each time the entry is freed; part of the descriptor, so stale descriptors are rejected
+    int next_free; //index of the next entry on the free stack (only meaningful while the entry is free)
     pthread_mutex_t entry_mutex; //mutex to guard M.E. access to this entry
-    struct dir_entry *dir_entry; //pointer to the directory entry of the opened file
-    int position; //current position of the file
+    int inode_number; //inode of the opened file (not its dir_entry, which is reused once the file is deleted)
+    int64_t position; //current position of the file
     int access_flag; //RSFS_RDONLY or RSFS_RDWR - how the file can be accessed by the process/thread openning this file
+    int sealed; //1 if the entry holds a reference to a sealed file instead of the inode's locks
+    int pid; //process that opened the file (shared volumes only); see rsfs_recover()
+
+    //delayed allocation: writes are kept here and their data blocks are allocated when flushed
+    char *dirty; //buffer of DIRTY_BUFFER_SIZE bytes; NULL until the first write
+    int64_t dirty_start; //file offset of dirty[0]
+    int dirty_len; //number of buffered bytes; 0 means there is nothing to flush
+    int reserved; //number of data blocks reserved for the buffered range
 };
-extern struct open_file_entry open_file_table[NUM_OPEN_FILE]; //global table (array) of open_file_entries 
-extern pthread_mutex_t open_file_table_mutex; //mutex to guard M.E. access to the table
 
+//stats: implemented in stats.c
+//API calls counted by the stats (index of rsfs_stats.ops)
+enum rsfs_op{
+    RSFS_OP_CREATE, RSFS_OP_OPEN, RSFS_OP_APPEND, RSFS_OP_FSEEK, RSFS_OP_READ, RSFS_OP_CLOSE,
+    RSFS_OP_WRITE, RSFS_OP_CUT, RSFS_OP_DELETE, RSFS_OP_FALLOCATE, RSFS_OP_TRUNCATE, RSFS_OP_FLUSH,
+    RSFS_OP_MKDIR, RSFS_OP_RMDIR, RSFS_OP_READDIR, RSFS_OP_SEAL,
+    RSFS_NUM_OPS
+};
 
-//routines for directory management: implemented in dir.c
-struct dir_entry *search_dir(char *file_name); //get the dir_entry for file_name
-struct dir_entry *insert_dir(char *file_name); //create a dir_entry for file_name and insert it to the root directory; the dir_entry is returned
-int delete_dir(char *file_name); //delete the dir_entry for the given file name from the global directory
+//named mutexes whose acquisitions are counted (index of rsfs_stats.locks);
+//the per-inode and per-entry mutexes are counted together for all inodes/entries
+enum rsfs_lock{
+    RSFS_LOCK_DIR, RSFS_LOCK_INODES, RSFS_LOCK_INODE_BITMAP, RSFS_LOCK_DATA_BITMAP,
+    RSFS_LOCK_OPEN_FILE_TABLE, RSFS_LOCK_INODE_RW, RSFS_LOCK_INODE_READ, RSFS_LOCK_ENTRY,
+    RSFS_LOCK_FS_STAT, RSFS_LOCK_INODE_MAP, RSFS_LOCK_BLOCK_CLASS, RSFS_LOCK_MMAP,
+    RSFS_NUM_LOCKS
+};
+
+#define RSFS_LAT_BUCKETS 32 //latency histogram: bucket i counts calls that took [2^i, 2^(i+1)) ns; the last one is open-ended
+#define RSFS_STATS_SLOTS 16 //counters are striped over this many slots per volume, one per thread (threads share slots beyond this)
+
+struct rsfs_op_stats{
+    uint64_t calls; //number of calls
+    uint64_t errors; //number of calls that returned <0
+    uint64_t bytes; //bytes read, written, appended or cut
+    uint64_t lat_hist[RSFS_LAT_BUCKETS]; //log2-bucketed latency
+};
+
+struct rsfs_lock_stats{
+    uint64_t acquisitions; //number of times the mutex was taken
+    uint64_t contended; //acquisitions that had to wait
+    uint64_t wait_ns; //total time spent waiting
+};
+
+//counters of the dentry cache
+struct rsfs_dcache_stats{
+    uint64_t hits; //lookups answered by the cache (including negative entries)
+    uint64_t misses; //lookups that searched the directory
+};
+
+//counters of the log-structured layout (all 0 for the in-place layout)
+struct rsfs_log_stats{
+    uint64_t blocks_written; //blocks appended to the log: new and moved data blocks and inode records
+    uint64_t inode_records; //inode records appended
+    uint64_t cleaner_runs; //times the cleaner looked for segments to clean
+    uint64_t foreground_runs; //of which were run by a writer because no segment was clean
+    uint64_t segments_cleaned; //segments made clean
+    uint64_t blocks_moved; //live blocks copied out of segments being cleaned
+    int clean_segments; //segments that are clean now
+};
+
+//counters of the defragmenter (defrag.c)
+struct rsfs_defrag_stats{
+    uint64_t passes; //walks over the inodes
+    uint64_t files_defragmented; //files copied into a contiguous run
+    uint64_t blocks_moved; //data blocks copied
+    uint64_t busy_skips; //fragmented or not, files skipped because they were open
+};
+
+//counters of the mappings of files (mmap.c)
+struct rsfs_mmap_stats{
+    uint64_t maps; //mappings made by rsfs_mmap()
+    uint64_t segments; //mmap() calls they took: one per run of blocks that are consecutive in the memfd
+    uint64_t invalidated; //mappings made inaccessible because the blocks of their file were relinked
+    int live; //mappings not unmapped yet
+};
+
+//counters of a shared volume (shm.c)
+struct rsfs_shm_stats{
+    uint64_t owner_deaths; //robust mutexes taken over from a process that died holding them
+    uint64_t recovered_files; //descriptors of dead processes closed by rsfs_recover()
+};
+
+//counters of one slot; updated with relaxed atomics by the threads that own the slot
+struct rsfs_stats_slot{
+    struct rsfs_op_stats ops[RSFS_NUM_OPS];
+    struct rsfs_lock_stats locks[RSFS_NUM_LOCKS];
+    struct rsfs_dcache_stats dcache;
+} __attribute__((aligned(64)));
+
+//a snapshot of the stats of a volume, filled by rsfs_stats_snapshot()
+struct rsfs_stats{
+    struct rsfs_op_stats ops[RSFS_NUM_OPS];
+    struct rsfs_lock_stats locks[RSFS_NUM_LOCKS];
+    struct rsfs_dcache_stats dcache;
+    struct rsfs_log_stats log;
+    struct rsfs_defrag_stats defrag;
+    struct rsfs_shm_stats shm;
+    struct rsfs_mmap_stats mmap;
+    int free_inodes; //inodes not allocated
+    int free_dblocks; //data blocks not allocated (including reserved ones)
+    int reserved_dblocks; //free data blocks reserved for delayed allocation
+    int free_class_blocks[RSFS_NUM_CLASSES]; //medium and large blocks not allocated
+    int open_files; //open file entries in use
+};
+
+//tracing: implemented in trace.c
+#define TRACE_RING_SIZE 4096 //events kept per thread; older ones are overwritten
+
+extern int trace_enabled; //1 while tracing is switched on by rsfs_trace_enable()
+
+//record a trace event of fs with phase 'B' (begin), 'E' (end) or 'i' (instant);
+//name must be a string that outlives the trace (e.g. a literal); costs one branch when tracing is off
+#define TRACE(fs, phase, name) do{ if(__builtin_expect(trace_enabled, 0)) trace_event((fs), (phase), (name)); }while(0)
+
+//a mapping made by rsfs_mmap(): the len bytes at addr show a range of the file of inode_number (mmap.c)
+struct rsfs_mapping{
+    char *addr;
+    size_t len; //a multiple of the page size
+    int inode_number;
+    int valid; //0 once the blocks of the file were relinked and the range made inaccessible
+    struct rsfs_mapping *next;
+};
+
+//a file system (volume): everything a volume owns, so independent volumes can live in one process;
+//created by rsfs_init() (or rsfs_open_shared()) and released by rsfs_destroy()
+struct rsfs{
+    int id; //number of the volume within the process (the pid of its trace events)
+    int layout; //RSFS_LAYOUT_INPLACE or RSFS_LAYOUT_LOG, chosen by rsfs_format()
+    struct rsfs_shm *shm; //segment holding a shared volume (shm.c); NULL for a private one
+    struct rsfs_shm_stats shm_stats;
+
+    struct dir root_dir; //root directory
+    struct dcache dcache; //dentry cache (dcache.c)
+    struct dir *removed_dirs; //directories removed so far, freed by rsfs_destroy(); linked by next_removed
+
+    struct inode inodes[NUM_INODES]; //array of inodes
+    pthread_mutex_t inodes_mutex; //mutex to guard mutually-exclusive access of inodes
+    int inode_bitmap[NUM_INODES]; //inode bitmap
+    pthread_mutex_t inode_bitmap_mutex; //mutex to guard mutually-exclusive access of the bitmap
+
+    void *data_blocks[NUM_DBLOCKS]; //array of pointers to the data blocks
+    int data_bitmap[NUM_DBLOCKS]; //data-block bitmap
+    pthread_mutex_t data_bitmap_mutex; //mutex to guard mutually-exclusive access of the bitmap
+    int num_free_dblocks; //number of free data blocks (guarded by data_bitmap_mutex)
+    int num_reserved_dblocks; //number of free data blocks reserved for delayed allocation (guarded by data_bitmap_mutex)
+    struct block_class classes[RSFS_NUM_CLASSES]; //medium and large blocks, each class with its own bitmap and mutex
+
+    //memfd holding the medium and large blocks and the mappings of files (mmap.c), with RSFS_MEMFD
+    char *memfd_base; //the whole memfd, mapped; NULL if the blocks are not in a memfd
+    size_t memfd_size;
+    int memfd;
+    struct rsfs_mapping *mappings; //guarded by mmap_mutex
+    int num_mappings; //number of mappings; read without the mutex to skip invalidation when there are none
+    pthread_mutex_t mmap_mutex;
+    struct rsfs_mmap_stats mmap_stats; //guarded by mmap_mutex
+
+    //log-structured layout (log.c), all guarded by data_bitmap_mutex
+    int seg_live[NUM_SEGMENTS]; //number of live blocks in each segment
+    int log_head_seg; //segment at the head of the log
+    int log_head_off; //next block to write in the head segment
+    int imap[NUM_INODES]; //inode map: block holding the latest record of each inode, -1 if none
+    int imap_stale; //bit i: the record of inode i is older than its block map
+    struct rsfs_log_stats log_stats;
+    pthread_t cleaner; //background cleaner thread
+    int cleaner_running; //1 while the cleaner thread exists
+    int cleaner_stop; //set to make the cleaner exit
+    pthread_cond_t cleaner_cond; //wakes the cleaner
+
+    //defragmenter (defrag.c)
+    struct rsfs_defrag_stats defrag_stats; //guarded by data_bitmap_mutex
+    pthread_t defrag; //defragmenter thread
+    int defrag_running; //1 while the defragmenter thread exists
+    int defrag_rate; //blocks it may move per second, <=0: no limit
+    int defrag_stop; //set to make the defragmenter exit (guarded by defrag_mutex)
+    pthread_mutex_t defrag_mutex;
+    pthread_cond_t defrag_cond; //wakes the defragmenter to exit
+
+    struct open_file_entry *open_file_chunks[MAX_OPEN_FILE/OPEN_FILE_CHUNK]; //open file table: chunks of OPEN_FILE_CHUNK entries
+    int num_open_file_chunks; //number of chunks allocated so far
+    uint64_t open_file_free_head; //lock-free stack of free entries (see open_file_table.c)
+    int num_open_files; //number of entries in use
+    pthread_mutex_t open_file_table_mutex; //mutex to guard growing the table
+
+    pthread_mutex_t mutex_for_fs_stat; //serializes rsfs_stat() output
+
+    struct rsfs_stats_slot stats_slots[RSFS_STATS_SLOTS]; //per-thread counters, summed by rsfs_stats_snapshot()
+};
+
+
+//routines for stats: implemented in stats.c
+uint64_t stats_now(); //current time in ns, for stats_record()
+void stats_record(struct rsfs *fs, int op, uint64_t start, int64_t ret, int64_t bytes); //count a finished API call started at start
+void lock_mutex(struct rsfs *fs, pthread_mutex_t *mutex, int lock_id); //pthread_mutex_lock() that counts acquisitions and wait time
+void stats_dcache(struct rsfs *fs, int hit); //count a dentry cache lookup
+
+
+extern const char *rsfs_op_names[RSFS_NUM_OPS]; //name of each enum rsfs_op
+extern const char *rsfs_lock_names[RSFS_NUM_LOCKS]; //name of each enum rsfs_lock
+
+
+//routines for tracing: implemented in trace.c
+void trace_event(struct rsfs *fs, char phase, const char *name); //append an event to the calling thread's ring (use TRACE)
+
+
+//routines for directory management: implemented in dir.c; paths are relative to the root ("a/b", "/a/b" and "a//b" are the same)
+uint32_t hash_name(const char *name, int len); //hash of a path component
+int init_dir(struct rsfs *fs, struct dir *dir, struct dir *parent); //initialize an empty directory
+struct dir *resolve_parent(struct rsfs *fs, const char *path, const char **name, int *len); //get the directory holding the last component of path
+struct dir_entry *search_dir(struct rsfs *fs, char *path); //get the dir_entry for path
+struct dir_entry *insert_dir(struct rsfs *fs, char *path, int inode_number); //create the dir_entry of a file at path and return it; NULL if it exists
+int insert_dir_batch(struct rsfs *fs, const char *path, const char **names, const int *inode_numbers,
+        struct dir_entry **entries, int n); //create the dir_entry of n files of the directory at path under one lock
+int delete_dir(struct rsfs *fs, char *path); //delete the dir_entry of the file at path and return its inode number, or -1
+int make_dir(struct rsfs *fs, char *path); //create a directory at path
+int remove_dir(struct rsfs *fs, char *path); //remove the empty directory at path
+int list_dir(struct rsfs *fs, char *path, struct rsfs_dirent *entries, int max); //list the directory at path
+void print_dir(struct rsfs *fs, struct dir *dir, const char *prefix); //print the entries under dir for rsfs_stat()
+void destroy_dir(struct rsfs *fs, struct dir *dir); //free everything under dir
+
+
+//routines for the dentry cache: implemented in dcache.c
+void dcache_init(struct rsfs *fs);
+void dcache_destroy(struct rsfs *fs);
+int dcache_lookup(struct rsfs *fs, struct dir *parent, const char *name, int len, uint32_t hash, struct dir_entry **entry); //1 if cached (entry may be NULL), 0 if not
+void dcache_insert(struct rsfs *fs, struct dir *parent, const char *name, int len, uint32_t hash, struct dir_entry *entry); //cache a lookup result; the caller holds parent->mutex
 
 
 //routines for inode management: implemented in inode.c
-int allocate_inode(); //allocate an unused inode, and the inode_number is returned
-void free_inode(int inode_number); //free (release) an inode
+int allocate_inode(struct rsfs *fs); //allocate an unused inode, and the inode_number is returned
+void free_inode(struct rsfs *fs, int inode_number); //free (release) an inode
+void release_inode(struct rsfs *fs, int inode_number); //free the data blocks and the inode of a deleted file
+int get_inode(struct rsfs *fs, int inode_number); //take a reference that keeps a delete from freeing the inode; -1 if it was deleted
+void put_inode(struct rsfs *fs, int inode_number); //drop a reference; the last one of a deleted file frees it
 
 
 //routines for data block management: implemented in data_block.c
-int allocate_data_block(); //allocate an unused data block, and the block_number is returned
-void free_data_block(int block_number); //free (release) a data block
+int allocate_data_block(struct rsfs *fs); //allocate an unused data block, and the block_number is returned
+void free_data_block(struct rsfs *fs, int block_number); //free (release) a data block
+int allocate_data_blocks(struct rsfs *fs, int n, int *blocks); //allocate n data blocks (contiguous if possible) into blocks[]; return n or -1
+int allocate_reserved_data_blocks(struct rsfs *fs, int n, int *blocks); //same as allocate_data_blocks(), consuming n reserved blocks
+int reserve_data_blocks(struct rsfs *fs, int n); //reserve up to n free data blocks for later allocation; return the number reserved
+void unreserve_data_blocks(struct rsfs *fs, int n); //give back n reserved data blocks
+int init_block_classes(struct rsfs *fs); //set up the medium and large classes; return 0 or -1
+void destroy_block_classes(struct rsfs *fs); //free the memory of the blocks of every class
+int allocate_class_block(struct rsfs *fs, int cls); //allocate a block of class cls (RSFS_CLASS_*), and the block_number is returned; -1 if none is free
+void free_class_block(struct rsfs *fs, int cls, int block_number); //free (release) a block of class cls
+
+
+//routines for the block map of a file: implemented in blockmap.c
+int64_t tail_start(struct inode *inode); //file offset of the first byte of the tail
+int64_t file_capacity(struct inode *inode); //bytes the file can hold without growing its block map
+char *file_ptr(struct rsfs *fs, struct inode *inode, int64_t pos, int *avail); //address of byte pos and bytes left in its block; NULL if not allocated
+void copy_into_file(struct rsfs *fs, struct inode *inode, int64_t pos, const char *src, int64_t n); //copy n bytes of src (zeros if NULL) to pos
+void copy_from_file(struct rsfs *fs, struct inode *inode, int64_t pos, char *dst, int64_t n); //copy n bytes at pos to dst; holes read as zeros
+int grow_file(struct rsfs *fs, struct inode *inode, int64_t end); //grow the block map to hold end bytes; return 0 or -1
+void shrink_file(struct rsfs *fs, struct inode *inode, int64_t length); //free the blocks past length and move its last bytes to smaller blocks
+void free_file_block(struct rsfs *fs, struct inode *inode, int idx); //free tail block idx of inode, if any
+void release_file_blocks(struct rsfs *fs, struct inode *inode); //free every block of inode
+
+
+//routines for the log-structured layout: implemented in log.c
+int log_init(struct rsfs *fs); //set up the log and start the cleaner; return 0 or -1
+void log_destroy(struct rsfs *fs); //stop the cleaner
+int log_clean_segments_locked(struct rsfs *fs); //number of clean segments; the caller holds data_bitmap_mutex
+int log_take_blocks_locked(struct rsfs *fs, int n, int *blocks); //take n blocks at the head of the log; the caller holds data_bitmap_mutex
+void lock_block_map(struct rsfs *fs, struct inode *inode); //keep the cleaner off the blocks of inode (no-op for the in-place layout)
+void unlock_block_map(struct rsfs *fs, struct inode *inode);
+int log_relocate_block(struct rsfs *fs, struct inode *inode, int idx); //move block idx of inode to the head of the log before it is modified
+void log_write_inode(struct rsfs *fs, int inode_number); //append a record of the inode to the log
+void log_delete_inode(struct rsfs *fs, int inode_number); //drop the record of a freed inode
+
+
+//routines for shared volumes and the memory of a volume: implemented in shm.c
+void *fs_alloc(struct rsfs *fs, size_t size); //zeroed, 64-byte aligned memory of the volume; NULL if it runs out
+void fs_free(struct rsfs *fs, void *p); //free memory taken by fs_alloc()
+void init_mutex(struct rsfs *fs, pthread_mutex_t *mutex, int robust); //process-shared (and robust if robust) on a shared volume
+void init_cond(struct rsfs *fs, pthread_cond_t *cond); //process-shared on a shared volume
+void mutex_owner_died(struct rsfs *fs, pthread_mutex_t *mutex); //take over a robust mutex locked with EOWNERDEAD
+void take_mutex(struct rsfs *fs, pthread_mutex_t *mutex); //uncounted pthread_mutex_lock() that takes over from a dead owner
+void shm_detach(struct rsfs *fs); //unmap a shared volume
+
+
+//routines for the memfd of a volume and the mappings of files: implemented in mmap.c
+int memfd_init(struct rsfs *fs); //create the memfd the medium and large blocks live in; return 0 or -1
+void memfd_destroy(struct rsfs *fs); //unmap every mapping and release the memfd
+char *memfd_block(struct rsfs *fs, int cls, int block); //memory of block of class cls in the memfd
+void invalidate_mappings(struct rsfs *fs, struct inode *inode); //make the mappings of the file of inode inaccessible before its blocks are relinked
+
+
+//routines for the work-stealing pool of the bulk routines: implemented in pool.c
+typedef void (*pool_fn)(void *arg, int worker); //a task; worker is the index of the thread running it, or -1 outside the pool
+struct rsfs_pool *pool_create(int nthreads); //start nthreads workers (<=0: one per core); NULL if it fails
+int pool_threads(struct rsfs_pool *pool); //number of workers
+void pool_submit(struct rsfs_pool *pool, int worker, pool_fn fn, void *arg); //queue fn on the deque of worker (-1: round robin)
+void pool_wait(struct rsfs_pool *pool); //wait until every task queued, and every task they queued, has run
+uint64_t pool_steals(struct rsfs_pool *pool); //tasks taken from another worker's deque
+void pool_destroy(struct rsfs_pool *pool); //stop the idle workers and free the pool
+
+
+//routines for the defragmenter: implemented in defrag.c
+int inode_extents(struct inode *inode); //number of runs of consecutive data blocks of inode
+
+
+//api - buffered streams: implemented in stream.c
+struct rsfs_stream *rsfs_fopen(struct rsfs *fs, char *path, int access_flag); //open path (RSFS_RDONLY, RSFS_RDWR or RSFS_APPEND) as a fully buffered stream; NULL if it fails
+int rsfs_setvbuf(struct rsfs_stream *stream, int mode, int size); //set the buffering mode (RSFS_IO*BF) and buffer size before the first read or write
+int64_t rsfs_fwrite(struct rsfs_stream *stream, void *buf, int64_t size); //buffered write at the stream's position; return the bytes taken or -1
+int64_t rsfs_fread(struct rsfs_stream *stream, void *buf, int64_t size); //buffered read at the stream's position; return the bytes read or -1
+int rsfs_fflush(struct rsfs_stream *stream); //write the buffered data with one rsfs_write(); return 0, or -1 with the unwritten bytes kept
+int rsfs_fsetpos(struct rsfs_stream *stream, int64_t offset); //move the stream's position; return 0 or -1
+int rsfs_fclose(struct rsfs_stream *stream); //flush, close and release the stream; return 0, or -1 if any flush failed
+
+
+//remote access: rsfsd (rsfsd.c) serves a volume over a Unix domain socket to clients using client.c;
+//a frame is a struct rsfsd_frame followed by count requests (or, from the server, count responses),
+//each followed by its payload; the server answers every frame with one frame, in order, so a client
+//may send several frames before reading the replies; all fields are in host byte order
+#define RSFSD_MAGIC 0x5253 //rsfsd_frame.magic
+#define RSFSD_MAX_FRAME 65536 //largest frame, header included
+#define RSFSD_MAX_BATCH 256 //most requests in one frame
+#define RSFSD_MAX_PATH 1024 //longest path in a request
+#define RSFSD_MAX_INFLIGHT 16 //frames a client may have sent and not yet had answered
+#define RSFSD_DEFAULT_SOCKET "/tmp/rsfsd.sock"
+
+//operations of a request: the rsfs_* call of the same name
+enum rsfsd_op{
+    RSFSD_OP_CREATE, RSFSD_OP_OPEN, RSFSD_OP_CLOSE, RSFSD_OP_READ, RSFSD_OP_WRITE, RSFSD_OP_APPEND,
+    RSFSD_OP_FSEEK, RSFSD_OP_CUT, RSFSD_OP_DELETE, RSFSD_OP_FALLOCATE, RSFSD_OP_TRUNCATE, RSFSD_OP_FLUSH,
+    RSFSD_OP_MKDIR, RSFSD_OP_RMDIR, RSFSD_OP_READDIR, RSFSD_OP_SEAL,
+    RSFSD_NUM_OPS
+};
+
+struct rsfsd_frame{
+    uint32_t len; //bytes after the header
+    uint16_t magic; //RSFSD_MAGIC
+    uint16_t count; //requests or responses in the frame
+};
 
+struct rsfsd_request{
+    uint8_t op; //enum rsfsd_op
+    uint8_t pad;
+    uint16_t len; //payload bytes: the path (not NUL-terminated), or the data of a write or append
+    int32_t fd;
+    int64_t arg; //access flag, size, offset or length
+    int64_t arg2; //length of a fallocate, most entries of a readdir
+};
+
+struct rsfsd_response{
+    int64_t ret; //return value of the call
+    uint32_t len; //payload bytes: the data of a read, or the struct rsfs_dirent of a readdir
+    uint32_t pad;
+};
+
+//most data one read, write or append carries: what fits in a frame of that request or response alone;
+//larger calls are cut short to it, as read() and write() may be
+#define RSFSD_MAX_PAYLOAD (RSFSD_MAX_FRAME - (int)sizeof(struct rsfsd_frame) \
+        - (int)(sizeof(struct rsfsd_request) > sizeof(struct rsfsd_response) ? sizeof(struct rsfsd_request) : sizeof(struct rsfsd_response)))
+
+//a call made through a client: filled in by the caller, except ret (and out), which arrive with the reply
+struct rsfs_call{
+    int op; //enum rsfsd_op
+    int fd;
+    int64_t arg;
+    int64_t arg2;
+    const char *path; //for the calls taking a path
+    const void *data; //data of a write or append, len bytes
+    int len;
+    void *out; //where the data of a read or the entries of a readdir go, out_size bytes at most
+    int out_size;
+    int64_t ret;
+};
 
-//routines for open file entry management: implemented in open_file_table.c
-int allocate_open_file_entry(int access_flag, struct dir_entry *dir_entry); 
-        //allocate_open_file_entry: allocate an open file entry and initialize it with provided parameters
-void free_open_file_entry(int fd); //free (release) an open file entry
 
+//api - remote volumes: implemented in client.c; every call goes to the rsfsd listening on the socket
+struct rsfs_client *rsfs_connect(const char *socket_path); //connect to rsfsd; NULL if it fails
+void rsfs_disconnect(struct rsfs_client *client); //close the connection; the server closes the files left open through it
+int rsfs_client_add(struct rsfs_client *client, struct rsfs_call *call); //add call to the frame being built; return 0 or -1 if it does not fit
+int rsfs_client_send(struct rsfs_client *client); //send the frame being built without waiting for its reply; return 0 or -1
+int rsfs_client_recv(struct rsfs_client *client); //wait for the reply to the oldest frame sent and fill in its calls; return their number or -1
+int64_t rsfs_client_call(struct rsfs_client *client, struct rsfs_call *call); //send one call and wait for it; return call->ret, or -1
+int rsfs_remote_create(struct rsfs_client *client, const char *path);
+int rsfs_remote_open(struct rsfs_client *client, const char *path, int access_flag);
+int rsfs_remote_close(struct rsfs_client *client, int fd);
+int64_t rsfs_remote_read(struct rsfs_client *client, int fd, void *buf, int64_t size); //reads, writes and appends move at most RSFSD_MAX_PAYLOAD bytes
+int64_t rsfs_remote_write(struct rsfs_client *client, int fd, const void *buf, int64_t size);
+int64_t rsfs_remote_append(struct rsfs_client *client, int fd, const void *buf, int64_t size);
+int64_t rsfs_remote_fseek(struct rsfs_client *client, int fd, int64_t offset);
+int64_t rsfs_remote_cut(struct rsfs_client *client, int fd, int64_t size);
+int rsfs_remote_delete(struct rsfs_client *client, const char *path);
+int rsfs_remote_fallocate(struct rsfs_client *client, int fd, int64_t offset, int64_t len);
+int rsfs_remote_truncate(struct rsfs_client *client, int fd, int64_t length);
+int rsfs_remote_flush(struct rsfs_client *client, int fd);
+int rsfs_remote_mkdir(struct rsfs_client *client, const char *path);
+int rsfs_remote_rmdir(struct rsfs_client *client, const char *path);
+int rsfs_remote_seal(struct rsfs_client *client, int fd);
+int rsfs_remote_readdir(struct rsfs_client *client, const char *path, struct rsfs_dirent *entries, int max);
 
 
-//api - basic: already implemented in api.c
+//routines for open file entry management: implemented in open_file_table.c
+int allocate_open_file_entry(struct rsfs *fs, int access_flag, int inode_number); 
+        //allocate_open_file_entry: allocate an open file entry and initialize it with provided parameters
+struct open_file_entry *get_open_file_entry(struct rsfs *fs, int fd); //get the entry of fd, or NULL if fd is not (or no longer) valid
+void free_open_file_entry(struct rsfs *fs, int fd); //free (release) an open file entry
+int grow_open_file_table(struct rsfs *fs); //add OPEN_FILE_CHUNK free entries to the table
+
+
+
+typedef int (*rsfs_scan_fn)(const char *path, int64_t offset, void *arg); //called by rsfs_scan() for every match; nonzero stops the scan
+
+//api - per volume: implemented in api.c; every call works on the volume fs
+struct rsfs *rsfs_init(); //create and initialize a volume with the in-place layout; NULL if it fails
+struct rsfs *rsfs_format(int layout); //create and initialize a volume with the given layout (RSFS_LAYOUT_*); NULL if it fails
+int volume_setup(struct rsfs *fs, int layout); //initialize the zeroed volume fs; return 0 or -1
+struct rsfs *rsfs_open_shared(const char *name); //mount (creating it if needed) the shared-memory volume name; NULL if it fails
+int rsfs_unlink_shared(const char *name); //remove the shared-memory volume name
+int rsfs_recover(struct rsfs *fs); //close the descriptors of dead processes; return how many were closed
+void rsfs_destroy(struct rsfs *fs); //release a volume and everything in it
+void rsfs_stat(struct rsfs *fs); //print the volume's stat
+int rsfs_create(struct rsfs *fs, char *path);
+int rsfs_open(struct rsfs *fs, char *path, int access_flag);
+int64_t rsfs_append(struct rsfs *fs, int fd, void *buf, int64_t size);
+int64_t rsfs_fseek(struct rsfs *fs, int fd, int64_t offset);
+int64_t rsfs_read(struct rsfs *fs, int fd, void *buf, int64_t size);
+int rsfs_close(struct rsfs *fs, int fd);
+int64_t rsfs_write(struct rsfs *fs, int fd, void *buf, int64_t size);
+int64_t rsfs_cut(struct rsfs *fs, int fd, int64_t size);
+int rsfs_delete(struct rsfs *fs, char *path);
+int rsfs_fallocate(struct rsfs *fs, int fd, int64_t offset, int64_t len);
+int rsfs_truncate(struct rsfs *fs, int fd, int64_t length);
+int rsfs_flush(struct rsfs *fs, int fd);
+int rsfs_mkdir(struct rsfs *fs, char *path);
+int rsfs_rmdir(struct rsfs *fs, char *path);
+int rsfs_readdir(struct rsfs *fs, char *path, struct rsfs_dirent *entries, int max);
+int rsfs_seal(struct rsfs *fs, int fd);
+void *rsfs_mmap(struct rsfs *fs, int fd, int64_t offset, int64_t len); //map [offset, offset+len) of the file of fd contiguously; NULL if it fails
+int rsfs_munmap(struct rsfs *fs, void *addr); //remove a mapping made by rsfs_mmap(); return 0 or -1
+int rsfs_import_dir(struct rsfs *fs, const char *host_dir, char *path, int threads); //copy a host tree into the directory path; return the files copied or -1
+int rsfs_export_dir(struct rsfs *fs, char *path, const char *host_dir, int threads); //copy the tree under path to a host directory; return the files copied or -1
+int64_t rsfs_scan(struct rsfs *fs, const char *pattern, int len, int threads, rsfs_scan_fn callback, void *arg); //search every file for pattern; return the matches or -1
+int rsfs_defrag_start(struct rsfs *fs, int blocks_per_sec); //start the background defragmenter (in-place layout); return 0 or -1
+void rsfs_defrag_stop(struct rsfs *fs); //stop the defragmenter
+int rsfs_stats_snapshot(struct rsfs *fs, struct rsfs_stats *stats); //sum the counters of fs into stats
+void rsfs_trace_enable(int on); //switch tracing of all volumes on (1) or off (0)
+int rsfs_trace_dump(const char *path); //write the traced events of all threads to path as Chrome trace JSON
+
+
+//api - compatibility: implemented in compat.c; the original single-volume API,
+//where every call works on a default volume created by RSFS_init()
 int RSFS_init(); //initialize thesystem (provided)
+int RSFS_format(int layout); //initialize the system with the given layout (RSFS_LAYOUT_*) instead; return 0 if succeed
+int RSFS_init_shared(const char *name); //mount the shared-memory volume name instead, creating it if no process has; return 0 if succeed
+int RSFS_recover(); //close the files left open by processes that died; return the number closed
 void RSFS_stat(); //print the file's stat (provided)
 
-//api - basic: required to be implemented in api.c
-int RSFS_create(char *file_name); //create an empty file and return the file handler (i.e., index of the entry in open_file_table)
-int RSFS_open(char *file_name, int access_flag); //open an existing file and return the file handler
-int RSFS_append(int fd, void *buf, int size); //append to the end of the file, and return the actual number of bytes appended
-int RSFS_fseek(int fd, int offset); //change the current location of the file
-int RSFS_read(int fd, void *buf, int size); //read from file, and return the actual number of bytes read
-int RSFS_close(int fd); //close the file
-
-//api - advanced: to be implemented in api.c
-int RSFS_write(int fd, void *buf, int size);
-int RSFS_cut(int fd, int size); 
+int RSFS_create(char *file_name); //create an empty file; return 0 if succeed
+int RSFS_open(char *file_name, int access_flag); //open an existing file and return the file descriptor
+int64_t RSFS_append(int fd, void *buf, int64_t size); //append to the end of the file, and return the actual number of bytes appended
+int64_t RSFS_fseek(int fd, int64_t offset); //change the current location of the file
+int64_t RSFS_read(int fd, void *buf, int64_t size); //read from file, and return the actual number of bytes read
+int RSFS_close(int fd); //close the file; return 0, or -1 if its buffered writes could not be written out (the file is closed either way)
+
+//api - advanced
+int64_t RSFS_write(int fd, void *buf, int64_t size);
+int64_t RSFS_cut(int fd, int64_t size);
 int RSFS_delete(char *file_name); //delete the file with the provided file_name
 
+//api - space management
+int RSFS_fallocate(int fd, int64_t offset, int64_t len); //reserve data blocks for [offset, offset+len) without changing the file length
+int RSFS_truncate(int fd, int64_t length); //set the file length to length, freeing or reserving data blocks (no data is moved)
+int RSFS_flush(int fd); //allocate data blocks for the buffered writes of fd and copy them in
+
+//api - directories; file names in the calls above may be paths such as "docs/a.txt"
+int RSFS_mkdir(char *path); //create a directory; return 0 if succeed, -1 if path exists, -2 if its parent does not
+int RSFS_rmdir(char *path); //remove an empty directory; return 0 if succeed
+int RSFS_readdir(char *path, struct rsfs_dirent *entries, int max); //list up to max entries of a directory ("" or "/" for the root); return the number of entries in it, or -1
+
+//api - sealed files
+int RSFS_seal(int fd); //flush the file of fd (open with RSFS_RDWR) and make it read-only for good; fd stays open for reading; return 0 if succeed, -1 if deleted
+
+//api - mappings, on a volume formatted with RSFS_MEMFD; the blocks are mapped themselves, so nothing is copied
+void *RSFS_mmap(int fd, int64_t offset, int64_t len); //map [offset, offset+len) of the file (offset a multiple of MEDIUM_BLOCK_SIZE, range before the tail); NULL if it fails
+int RSFS_munmap(void *addr); //remove the mapping at addr; return 0 if succeed
+
+//api - bulk copies and search, run on one thread per core
+int RSFS_import_dir(const char *host_dir, char *path); //copy the files and directories under a host directory into the directory path (made if needed); return the number of files copied, or -1
+int RSFS_export_dir(char *path, const char *host_dir); //copy the files and directories under path into a host directory (made if needed); return the number of files copied, or -1
+int64_t RSFS_scan(const char *pattern, rsfs_scan_fn callback, void *arg); //call callback(path, offset, arg) for every match of the string pattern in every file (nonzero stops the scan); return the number of matches, or -1
+
+//api - defragmenter
+int RSFS_defrag_start(int blocks_per_sec); //start copying fragmented files that are not open into contiguous blocks, at most blocks_per_sec (<=0: no limit); return 0 if succeed
+void RSFS_defrag_stop(); //stop the defragmenter
+
+//api - buffered streams, in the manner of stdio; a stream is used by one thread at a time
+struct rsfs_stream *RSFS_fopen(char *file_name, int access_flag); //open a file as a stream with a buffer of RSFS_STREAM_BUFSIZE bytes; RSFS_APPEND writes at the end; NULL if it fails
+int RSFS_setvbuf(struct rsfs_stream *stream, int mode, int size); //RSFS_IOFBF, RSFS_IOLBF or RSFS_IONBF, before the first read or write; return 0 if succeed
+int64_t RSFS_fwrite(struct rsfs_stream *stream, void *buf, int64_t size); //buffered write; the file gets the data in one RSFS_write when the buffer is flushed
+int64_t RSFS_fread(struct rsfs_stream *stream, void *buf, int64_t size); //buffered read, refilled in whole blocks; return the number of bytes read
+int RSFS_fflush(struct rsfs_stream *stream); //write out the buffered data; return 0 if succeed
+int RSFS_fsetpos(struct rsfs_stream *stream, int64_t offset); //move the stream's position; return 0 if succeed
+int RSFS_fclose(struct rsfs_stream *stream); //flush and close the stream; return 0 if succeed
+
+//api - stats
+int RSFS_stats_snapshot(struct rsfs_stats *stats); //fill stats with the counters of the file system; return 0 if succeed
+
+//api - tracing
+void RSFS_trace_enable(int on); //switch event tracing on (1) or off (0)
+int RSFS_trace_dump(const char *path); //write the traced events to path as Chrome/Perfetto trace JSON; return 0 if succeed
+
 
 
 
@@ -0,0 +1,177 @@
+/*
+    online defragmenter for the in-place layout: a background thread, started by rsfs_defrag_start(),
+    that finds files whose data blocks are scattered over the block space and copies them into
+    one contiguous run of free blocks, so sequential reads walk consecutive memory;
+    a file is only touched while no one has it open: the thread takes the inode's rw_mutex with
+    a trylock and skips the file if that fails, and skips sealed files, whose readers hold no lock;
+    inode_bitmap_mutex is only held for that check, and the thread then pins the inode with a
+    reference (get_inode), so a delete meanwhile leaves freeing it to the thread's put_inode;
+    the blocks are moved and the pointers swapped under data_bitmap_mutex and the inode's map_mutex;
+    only the small blocks of a file's tail are moved, the medium and large blocks stay where they are;
+    the number of blocks moved per second is limited with a token bucket
+*/
+
+#include "def.h"
+#include <time.h>
+
+//helper: number of runs of consecutive block numbers among the n entries of blocks (holes are skipped)
+static int count_runs(const int *blocks, int n){
+    int extents = 0, prev = -2;
+    for(int i=0; i<n; i++){
+        int block = blocks[i];
+        if(block<0) continue;
+        if(block!=prev+1) extents++;
+        prev = block;
+    }
+    return extents;
+}
+
+//number of extents of inode: runs of consecutive block numbers among its data blocks in file order,
+//counted per block size class (holes are skipped); 0 for a file without blocks, 1 for a contiguous small file
+int inode_extents(struct inode *inode){
+    return count_runs(inode->large, inode->num_large) + count_runs(inode->medium, inode->num_medium)
+            + count_runs(inode->block, NUM_POINTER);
+}
+
+//helper: first run of n free blocks, or -1; the caller holds data_bitmap_mutex
+static int find_free_run_locked(struct rsfs *fs, int n){
+    int run = 0;
+    for(int i=0; i<NUM_DBLOCKS; i++){
+        run = fs->data_bitmap[i] ? 0 : run+1;
+        if(run==n) return i-n+1;
+    }
+    return -1;
+}
+
+//helper: make inode_number contiguous if it is fragmented and not in use, spending at most budget blocks;
+//return the number of blocks moved (0 if the file was left alone)
+static int defrag_inode(struct rsfs *fs, int inode_number, int budget){
+    struct inode *inode = &fs->inodes[inode_number];
+    int moved = 0;
+
+    //the bitmap is checked, and rw_mutex tried, under inode_bitmap_mutex, as allocate_inode() initializes rw_mutex
+    lock_mutex(fs, &fs->inode_bitmap_mutex, RSFS_LOCK_INODE_BITMAP);
+    if(!fs->inode_bitmap[inode_number] || __atomic_load_n(&inode->sealed, __ATOMIC_ACQUIRE)){
+        pthread_mutex_unlock(&fs->inode_bitmap_mutex);
+        return 0;
+    }
+    if(pthread_mutex_trylock(&inode->rw_mutex)!=0){ //open for reading or writing; try again later
+        pthread_mutex_unlock(&fs->inode_bitmap_mutex);
+        lock_mutex(fs, &fs->data_bitmap_mutex, RSFS_LOCK_DATA_BITMAP);
+        fs->defrag_stats.busy_skips++;
+        pthread_mutex_unlock(&fs->data_bitmap_mutex);
+        return 0;
+    }
+    if(__atomic_load_n(&inode->sealed, __ATOMIC_ACQUIRE) || get_inode(fs, inode_number)<0){ //sealed meanwhile, or being deleted
+        pthread_mutex_unlock(&inode->rw_mutex);
+        pthread_mutex_unlock(&fs->inode_bitmap_mutex);
+        return 0;
+    }
+    pthread_mutex_unlock(&fs->inode_bitmap_mutex); //the reference keeps the inode from being freed and reused
+
+    TRACE(fs, 'B', "defrag_inode");
+    lock_mutex(fs, &fs->data_bitmap_mutex, RSFS_LOCK_DATA_BITMAP);
+    lock_mutex(fs, &inode->map_mutex, RSFS_LOCK_INODE_MAP);
+
+    int n = 0;
+    for(int i=0; i<NUM_POINTER; i++) n += (inode->block[i]>=0);
+    int start;
+    int dead = __atomic_load_n(&inode->refcount, __ATOMIC_ACQUIRE) & INODE_DEAD; //deleted meanwhile: not worth moving
+    if(!dead && count_runs(inode->block, NUM_POINTER)>1 && n<=budget && (start = find_free_run_locked(fs, n))>=0){
+        //copy every block into the run in file order, then give the old blocks back
+        for(int i=0, k=0; i<NUM_POINTER; i++){
+            int block = inode->block[i];
+            if(block<0) continue;
+            memcpy(fs->data_blocks[start+k], fs->data_blocks[block], BLOCK_SIZE);
+            fs->data_bitmap[start+k] = 1;
+            fs->data_bitmap[block] = 0;
+            inode->block[i] = start+k;
+            k++;
+        }
+        moved = n;
+        fs->defrag_stats.files_defragmented++;
+        fs->defrag_stats.blocks_moved += n;
+    }
+
+    pthread_mutex_unlock(&inode->map_mutex);
+    pthread_mutex_unlock(&fs->data_bitmap_mutex);
+    TRACE(fs, 'E', "defrag_inode");
+    pthread_mutex_unlock(&inode->rw_mutex);
+    put_inode(fs, inode_number); //frees the file if it was deleted meanwhile
+
+    return moved;
+}
+
+//helper: the defragmenter; every DEFRAG_INTERVAL_MS it walks the inodes, round robin,
+//while the token bucket holds enough blocks for the next file
+static void *defrag_main(void *arg){
+    struct rsfs *fs = (struct rsfs *)arg;
+    double rate = fs->defrag_rate; //blocks per second, <=0: no limit
+    double burst = rate * DEFRAG_INTERVAL_MS / 1000.0;
+    if(burst<NUM_POINTER) burst = NUM_POINTER; //a whole file must fit in the bucket
+    double tokens = burst;
+    int next = 0; //inode the next pass starts at
+
+    struct timespec last;
+    clock_gettime(CLOCK_MONOTONIC, &last);
+
+    pthread_mutex_lock(&fs->defrag_mutex);
+    while(!fs->defrag_stop){
+        pthread_mutex_unlock(&fs->defrag_mutex);
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double elapsed = (now.tv_sec - last.tv_sec) + (now.tv_nsec - last.tv_nsec) / 1e9;
+        last = now;
+        tokens = (rate<=0) ? NUM_DBLOCKS : tokens + rate * elapsed;
+        if(tokens>burst && rate>0) tokens = burst;
+
+        for(int k=0; k<NUM_INODES; k++){
+            int i = (next + k) % NUM_INODES;
+            tokens -= defrag_inode(fs, i, (int)tokens);
+            next = i+1;
+        }
+        lock_mutex(fs, &fs->data_bitmap_mutex, RSFS_LOCK_DATA_BITMAP);
+        fs->defrag_stats.passes++;
+        pthread_mutex_unlock(&fs->data_bitmap_mutex);
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += DEFRAG_INTERVAL_MS * 1000000L;
+        if(deadline.tv_nsec >= 1000000000L){
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_mutex_lock(&fs->defrag_mutex);
+        if(!fs->defrag_stop) pthread_cond_timedwait(&fs->defrag_cond, &fs->defrag_mutex, &deadline);
+    }
+    pthread_mutex_unlock(&fs->defrag_mutex);
+
+    return NULL;
+}
+
+//start the defragmenter of fs, moving at most blocks_per_sec blocks per second (<=0: no limit);
+//return 0 if succeed, or -1 if it is running already, fs uses the log-structured layout,
+//whose blocks are placed by the log and its cleaner, or fs is shared by several processes
+int rsfs_defrag_start(struct rsfs *fs, int blocks_per_sec){
+    if(fs->layout!=RSFS_LAYOUT_INPLACE || fs->shm || fs->defrag_running) return -1;
+
+    fs->defrag_rate = blocks_per_sec;
+    fs->defrag_stop = 0;
+    if(pthread_create(&fs->defrag, NULL, defrag_main, fs)!=0) return -1;
+    fs->defrag_running = 1;
+    return 0;
+}
+
+//stop the defragmenter of fs, if it is running; a file being moved is finished first
+void rsfs_defrag_stop(struct rsfs *fs){
+    if(!fs->defrag_running) return;
+
+    pthread_mutex_lock(&fs->defrag_mutex);
+    fs->defrag_stop = 1;
+    pthread_cond_signal(&fs->defrag_cond);
+    pthread_mutex_unlock(&fs->defrag_mutex);
+
+    pthread_join(fs->defrag, NULL);
+    fs->defrag_running = 0;
+}
@@ -1,113 +1,513 @@
 /*
-    allocation of global variable root_dir (root directory); 
-    routines for directory management
+    routines for directory management;
+    every directory indexes its entries in a hash table of names (and keeps them in a list,
+    in creation order, for listing); paths such as "a/b/c" are resolved one component at a
+    time through the dentry cache (dcache.c), falling back to the directory's index on a miss;
+    a directory owns the memory of its entries (a pool of dir_entry) and of their names (an
+    arena the names are copied into), so both live exactly as long as the directory;
+    the entry of a deleted file goes, with its name, on a free list of the directory and is reused
+    by a later create: the dentry cache holds a negative entry for the name by then, and open files
+    keep the inode number rather than the entry; only files take entries from the list, so a thread
+    still holding a stale pointer from a lookup reads a file's inode number, never a directory's -1
 */
 
 
 #include "def.h"
 
-struct root_dir root_dir; //global root directory
+_Static_assert(sizeof(struct dir_entry)==64, "dir_entry is meant to fill one cache line");
 
-//helper: search for dir entry matching provided file_name
-struct dir_entry *search_dir_internal(char *file_name){
-    //start from head entry
-    struct dir_entry *dir_entry = root_dir.head;
-    
-    //loop through all entries
+//hash of a path component (FNV-1a)
+uint32_t hash_name(const char *name, int len){
+    uint32_t hash = 2166136261u;
+    for(int i=0; i<len; i++){
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+//initialize an empty directory of fs whose parent is parent (NULL for the root);
+//return 0 if succeed, or -1 if memory runs out
+int init_dir(struct rsfs *fs, struct dir *dir, struct dir *parent){
+    dir->buckets = (struct dir_entry **)fs_alloc(fs, DIR_INITIAL_BUCKETS * sizeof(struct dir_entry *));
+    if(dir->buckets==NULL) return -1;
+    dir->num_buckets = DIR_INITIAL_BUCKETS;
+    dir->num_entries = 0;
+    dir->head = dir->tail = NULL;
+    dir->parent = parent ? parent : dir; //the root is its own parent
+    dir->removed = 0;
+    dir->next_removed = NULL;
+    dir->pool = dir->arena = NULL;
+    dir->free_entries = NULL;
+    init_mutex(fs, &dir->mutex, 1);
+    return 0;
+}
+
+//helper: take size bytes aligned to align from the chunks of *list, adding a chunk of at least
+//chunk_size bytes when the newest one is full; return NULL if memory runs out
+static void *chunk_alloc(struct rsfs *fs, struct dir_chunk **list, int size, int align, int chunk_size){
+    struct dir_chunk *chunk = *list;
+    int offset = chunk ? (chunk->used + align-1) & ~(align-1) : 0;
+    if(chunk==NULL || offset + size > chunk->size){
+        int bytes = (size > chunk_size) ? size : chunk_size;
+        chunk = (struct dir_chunk *)fs_alloc(fs, sizeof(struct dir_chunk) + bytes);
+        if(chunk==NULL) return NULL;
+        chunk->next = *list;
+        chunk->size = bytes;
+        *list = chunk;
+        offset = 0;
+    }
+    chunk->used = offset + size;
+    return chunk->data + offset;
+}
+
+static void free_chunks(struct rsfs *fs, struct dir_chunk *chunk){
+    while(chunk){
+        struct dir_chunk *next = chunk->next;
+        fs_free(fs, chunk);
+        chunk = next;
+    }
+}
+
+//helper: whether dir_entry is named name[0..len); most mismatches are decided by the inline fields
+static int name_equals(struct dir_entry *dir_entry, const char *name, int len, uint32_t hash){
+    if(dir_entry->hash!=hash || dir_entry->len!=len) return 0;
+    if(len<=DIR_NAME_PREFIX) return memcmp(dir_entry->prefix, name, len)==0;
+    return memcmp(dir_entry->prefix, name, DIR_NAME_PREFIX)==0
+        && memcmp(dir_entry->name + DIR_NAME_PREFIX, name + DIR_NAME_PREFIX, len - DIR_NAME_PREFIX)==0;
+}
+
+//helper: search dir for the entry named by name[0..len); the caller holds dir->mutex
+static struct dir_entry *search_dir_internal(struct dir *dir, const char *name, int len, uint32_t hash){
+    struct dir_entry *dir_entry = dir->buckets[hash & (dir->num_buckets-1)];
     while(dir_entry){
-        if(strcmp(dir_entry->name,file_name)==0){
+        if(name_equals(dir_entry, name, len, hash)){
             break; //break when finding a match
-        } 
-        dir_entry = dir_entry->next;
+        }
+        dir_entry = dir_entry->hash_next;
     }
-    
-    //return the found match; NULL is not found
     return dir_entry;
 }
 
-//search for the dir_entry for provided file_name
-struct dir_entry *search_dir(char *file_name){    
+//helper: double the index of dir; the caller holds dir->mutex
+static void grow_dir_index(struct rsfs *fs, struct dir *dir){
+    int num_buckets = dir->num_buckets * 2;
+    struct dir_entry **buckets = (struct dir_entry **)fs_alloc(fs, num_buckets * sizeof(struct dir_entry *));
+    if(buckets==NULL) return; //keep the smaller index; lookups just get slower
 
-    pthread_mutex_lock(&root_dir.mutex);
+    for(struct dir_entry *e = dir->head; e; e = e->next){
+        int b = e->hash & (num_buckets-1);
+        e->hash_next = buckets[b];
+        buckets[b] = e;
+    }
+    fs_free(fs, dir->buckets);
+    dir->buckets = buckets;
+    dir->num_buckets = num_buckets;
+}
+
+//helper: look up one path component in dir, through the dentry cache;
+//a miss is resolved in the directory's index and the result (found or not) is cached
+//while dir->mutex is still held, so it cannot race with an insert or delete
+static struct dir_entry *lookup(struct rsfs *fs, struct dir *dir, const char *name, int len){
+    uint32_t hash = hash_name(name, len);
+    struct dir_entry *dir_entry;
 
-    struct dir_entry *dir_entry = search_dir_internal(file_name);
-    
-    pthread_mutex_unlock(&root_dir.mutex);
+    if(dcache_lookup(fs, dir, name, len, hash, &dir_entry)) return dir_entry;
+
+    lock_mutex(fs, &dir->mutex, RSFS_LOCK_DIR);
+    dir_entry = search_dir_internal(dir, name, len, hash);
+    dcache_insert(fs, dir, name, len, hash, dir_entry);
+    pthread_mutex_unlock(&dir->mutex);
 
     return dir_entry;
 }
 
-//insert an entry with provided file_name and return it;
-//if such entry exists already, return it directly
-struct dir_entry *insert_dir(char *file_name){
-    
-    pthread_mutex_lock(&root_dir.mutex);
-
-    //search for the entry
-    struct dir_entry *dir_entry = search_dir_internal(file_name);
-    
-    if(!dir_entry){//if not found
-        
-        //construct a new dir_entry
-        dir_entry = (struct dir_entry *)malloc(sizeof(struct dir_entry));
-        if(dir_entry==NULL){
+//helper: get the next component of *path and advance *path past it;
+//return its length, or 0 at the end of the path
+static int next_component(const char **path, const char **name){
+    const char *p = *path;
+    while(*p=='/') p++;
+    *name = p;
+    while(*p && *p!='/') p++;
+    *path = p;
+    return (int)(p - *name);
+}
+
+//resolve all but the last component of path to a directory;
+//the last component is returned in *name/*len (len is 0 if the path names the root);
+//return NULL if an intermediate component does not exist or is not a directory
+struct dir *resolve_parent(struct rsfs *fs, const char *path, const char **name, int *len){
+    struct dir *dir = &fs->root_dir;
+    const char *component;
+    int n = next_component(&path, &component);
+
+    while(n>0){
+        const char *next;
+        int next_len = next_component(&path, &next);
+        if(next_len==0){ //component is the last one
+            *name = component;
+            *len = n;
+            return dir;
+        }
+
+        if(n==1 && component[0]=='.'){
+            //stay in dir
+        }else if(n==2 && component[0]=='.' && component[1]=='.'){
+            dir = dir->parent;
+        }else{
+            struct dir_entry *dir_entry = lookup(fs, dir, component, n);
+            if(dir_entry==NULL || dir_entry->dir==NULL) return NULL;
+            dir = dir_entry->dir;
+        }
+        component = next;
+        n = next_len;
+    }
+
+    *name = NULL;
+    *len = 0;
+    return dir;
+}
+
+//search for the dir_entry for provided path; NULL if it does not exist
+struct dir_entry *search_dir(struct rsfs *fs, char *path){
+
+    const char *name;
+    int len;
+    struct dir *dir = resolve_parent(fs, path, &name, &len);
+    if(dir==NULL || len==0) return NULL;
+
+    return lookup(fs, dir, name, len);
+}
+
+//helper: take an entry of a deleted file of dir whose name buffer holds len+1 bytes, or NULL;
+//the caller holds dir->mutex
+static struct dir_entry *reuse_entry(struct dir *dir, int len){
+    struct dir_entry **link = &dir->free_entries;
+    for(int i=0; *link && i<DIR_REUSE_SCAN; i++, link = &(*link)->next){
+        struct dir_entry *dir_entry = *link;
+        if(dir_entry->name_cap > len){
+            *link = dir_entry->next;
+            return dir_entry;
+        }
+    }
+    return NULL;
+}
+
+//helper: create an entry named name[0..len) in dir for the file inode_number, or for the directory subdir;
+//the caller holds dir->mutex and has checked it does not exist
+static struct dir_entry *add_entry(struct rsfs *fs, struct dir *dir, const char *name, int len, uint32_t hash,
+        int inode_number, struct dir *subdir){
+
+    if(len>=UINT16_MAX) return NULL;
+
+    //reuse the entry of a deleted file, or construct a new dir_entry from the pool, with its name interned in the arena
+    struct dir_entry *dir_entry = subdir ? NULL : reuse_entry(dir, len);
+    char *copy;
+    if(dir_entry){
+        copy = (char *)dir_entry->name;
+    }else{
+        int cap = (len + 8) & ~7; //rounded up, so a reuse finds room for names of about the same length
+        if(cap>UINT16_MAX) cap = UINT16_MAX;
+        dir_entry = (struct dir_entry *)chunk_alloc(fs, &dir->pool, sizeof(struct dir_entry),
+                __alignof__(struct dir_entry), DIR_POOL_ENTRIES*sizeof(struct dir_entry));
+        copy = (char *)chunk_alloc(fs, &dir->arena, cap, 1, DIR_ARENA_SIZE);
+        if(dir_entry==NULL || copy==NULL){
             printf("[insert_dir] fail to allocate a space for dir_entry.\n");
-            pthread_mutex_unlock(&root_dir.mutex);
-            return NULL;
+            return NULL; //whatever was taken stays in the pool and arena until the directory is freed
         }
+        dir_entry->name_cap = (uint16_t)cap;
+    }
+    memcpy(copy, name, len);
+    copy[len] = '\0';
+
+    dir_entry->hash = hash;
+    dir_entry->len = (uint16_t)len;
+    memset(dir_entry->prefix, 0, DIR_NAME_PREFIX);
+    memcpy(dir_entry->prefix, name, (len < DIR_NAME_PREFIX) ? len : DIR_NAME_PREFIX);
+    dir_entry->name = copy;
+    dir_entry->inode_number = inode_number;
+    dir_entry->dir = subdir;
+    dir_entry->next = dir_entry->prev = NULL; //initialize the links
+
+    //append the dir_entry to the list of dir
+    if(dir->tail){//the dir is non-empty
+        dir->tail->next = dir_entry;
+        dir_entry->prev = dir->tail;
+        dir->tail = dir_entry;
+    }else{//the dir is empty
+        dir->head = dir->tail = dir_entry;
+    }
+
+    //add it to the index
+    int b = hash & (dir->num_buckets-1);
+    dir_entry->hash_next = dir->buckets[b];
+    dir->buckets[b] = dir_entry;
+    if(++dir->num_entries > 2*dir->num_buckets) grow_dir_index(fs, dir);
 
-        dir_entry->name = file_name;
-        dir_entry->inode_number = -1; //mark that inode_number is not assigned 
-        dir_entry->next = dir_entry->prev = NULL; //initialize the links
-
-        //append the dir_entry to root_dir
-        if(root_dir.tail){//the root_dir is non-empty
-            root_dir.tail->next = dir_entry;
-            dir_entry->prev = root_dir.tail;
-            root_dir.tail = dir_entry;
-        }else{//the root_dir is empty
-            root_dir.head = root_dir.tail = dir_entry;
+    dcache_insert(fs, dir, name, len, hash, dir_entry); //replaces a negative entry, if any
+
+    return dir_entry;
+}
+
+//helper: remove dir_entry from dir; the caller holds dir->mutex;
+//the entry stays in the pool of dir (see delete_dir for its reuse)
+static void unlink_entry(struct rsfs *fs, struct dir *dir, struct dir_entry *dir_entry){
+
+    //remove it from the index
+    struct dir_entry **link = &dir->buckets[dir_entry->hash & (dir->num_buckets-1)];
+    while(*link!=dir_entry) link = &(*link)->hash_next;
+    *link = dir_entry->hash_next;
+
+    //remove it from the list
+    if(dir_entry->prev){//not the head entry
+        dir_entry->prev->next = dir_entry->next;
+        if(dir_entry->next){//it is not the tail entry
+            dir_entry->next->prev = dir_entry->prev;
+        }else{//it is the tail entry
+            dir->tail = dir_entry->prev;
+        }
+    }else{//it is the head entry
+        dir->head = dir_entry->next;
+        if(dir_entry->next){//it is not the tail entry
+            dir_entry->next->prev=NULL;
+        }else{//it is the tail entry
+            dir->tail = NULL;
         }
-    } 
+    }
+    dir->num_entries--;
+
+    dcache_insert(fs, dir, dir_entry->name, dir_entry->len, dir_entry->hash, NULL); //now a negative entry
+}
+
+//helper: resolve path to the directory it names ("" or "/" for the root); NULL if it is not a directory
+static struct dir *resolve_dir(struct rsfs *fs, const char *path){
+    const char *name;
+    int len;
+    struct dir *parent = resolve_parent(fs, path, &name, &len);
+    if(parent==NULL || len==0) return parent;
+    struct dir_entry *dir_entry = lookup(fs, parent, name, len);
+    return (dir_entry==NULL) ? NULL : dir_entry->dir;
+}
+
+//insert an entry for the file at path with the given inode_number and return it;
+//return NULL if the parent directory does not exist or the entry exists already
+struct dir_entry *insert_dir(struct rsfs *fs, char *path, int inode_number){
+
+    const char *name;
+    int len;
+    struct dir *dir = resolve_parent(fs, path, &name, &len);
+    if(dir==NULL || len==0) return NULL;
+    uint32_t hash = hash_name(name, len);
 
-    pthread_mutex_unlock(&root_dir.mutex);
+    lock_mutex(fs, &dir->mutex, RSFS_LOCK_DIR);
+
+    struct dir_entry *dir_entry = NULL;
+    if(!dir->removed && search_dir_internal(dir, name, len, hash)==NULL){
+        dir_entry = add_entry(fs, dir, name, len, hash, inode_number, NULL);
+    }
+
+    pthread_mutex_unlock(&dir->mutex);
 
     return dir_entry;
 }
 
-//delete the entry matching provided file_name if it exists;
-//return 0 if succeed (found and deleted) or -1 if errs
-int delete_dir(char *file_name){
+//insert entries for n files of the directory at path, names[i] (one component each) with inode_numbers[i],
+//taking the directory's mutex once for all of them; entries[i] is set to the new entry, or NULL if
+//names[i] exists already or is empty; return the number of entries created, or -1 if path is not a directory
+int insert_dir_batch(struct rsfs *fs, const char *path, const char **names, const int *inode_numbers,
+        struct dir_entry **entries, int n){
+
+    struct dir *dir = resolve_dir(fs, path);
+    if(dir==NULL) return -1;
 
-    pthread_mutex_lock(&root_dir.mutex);
+    lock_mutex(fs, &dir->mutex, RSFS_LOCK_DIR);
+
+    int created = 0;
+    for(int i=0; i<n; i++){
+        int len = strlen(names[i]);
+        entries[i] = NULL;
+        if(dir->removed || len==0 || memchr(names[i], '/', len)) continue;
+        uint32_t hash = hash_name(names[i], len);
+        if(search_dir_internal(dir, names[i], len, hash)) continue;
+        entries[i] = add_entry(fs, dir, names[i], len, hash, inode_numbers[i], NULL);
+        if(entries[i]) created++;
+    }
+
+    pthread_mutex_unlock(&dir->mutex);
+
+    return created;
+}
+
+//delete the file entry matching provided path if it exists;
+//return the inode number of the entry unlinked (read under the directory's mutex, so it is the
+//file this call removed), or -1 if errs (including when path is a directory)
+int delete_dir(struct rsfs *fs, char *path){
+
+    const char *name;
+    int len;
+    struct dir *dir = resolve_parent(fs, path, &name, &len);
+    if(dir==NULL || len==0) return -1;
+
+    lock_mutex(fs, &dir->mutex, RSFS_LOCK_DIR);
 
     int ret = -1;
 
     //search for the matching dir_entry
-    struct dir_entry *dir_entry = search_dir_internal(file_name); 
+    struct dir_entry *dir_entry = search_dir_internal(dir, name, len, hash_name(name, len));
 
-    //if found, delete it
-    if(dir_entry){
-        if(dir_entry->prev){//not the head entry
-            dir_entry->prev->next = dir_entry->next;
-            if(dir_entry->next){//it is not the tail entry
-                dir_entry->next->prev = dir_entry->prev;
-            }else{//it is the tail entry
-                root_dir.tail = dir_entry->prev;
-            } 
-        }else{//it is the head entry
-            root_dir.head = dir_entry->next;
-            if(dir_entry->next){//it is not the tail entry
-                dir_entry->next->prev=NULL;
-            }else{//it is the tail entry
-                root_dir.tail = NULL;
-            }
+    //if found, delete it and keep the entry, with its name, for a later create in dir
+    if(dir_entry && dir_entry->dir==NULL){
+        ret = dir_entry->inode_number;
+        unlink_entry(fs, dir, dir_entry);
+        dir_entry->next = dir->free_entries;
+        dir->free_entries = dir_entry;
+    }
+
+    pthread_mutex_unlock(&dir->mutex);
+
+    return ret;
+}
+
+//create the directory at path;
+//return 0 if succeed, -1 if path exists already, or -2 if the parent does not exist or memory runs out
+int make_dir(struct rsfs *fs, char *path){
+
+    const char *name;
+    int len;
+    struct dir *parent = resolve_parent(fs, path, &name, &len);
+    if(parent==NULL || len==0) return -2;
+    uint32_t hash = hash_name(name, len);
+
+    struct dir *dir = (struct dir *)fs_alloc(fs, sizeof(struct dir));
+    if(dir==NULL || init_dir(fs, dir, parent)<0){
+        fs_free(fs, dir);
+        return -2;
+    }
+
+    lock_mutex(fs, &parent->mutex, RSFS_LOCK_DIR);
+
+    int ret;
+    if(parent->removed){
+        ret = -2;
+    }else if(search_dir_internal(parent, name, len, hash)){
+        ret = -1;
+    }else{
+        ret = add_entry(fs, parent, name, len, hash, -1, dir) ? 0 : -2;
+    }
+
+    pthread_mutex_unlock(&parent->mutex);
+
+    if(ret<0){
+        free_chunks(fs, dir->pool);
+        free_chunks(fs, dir->arena);
+        fs_free(fs, dir->buckets);
+        fs_free(fs, dir);
+    }
+    return ret;
+}
+
+//remove the empty directory at path; return 0 if succeed, or -1 if it does not exist, is not a directory or is not empty
+int remove_dir(struct rsfs *fs, char *path){
+
+    const char *name;
+    int len;
+    struct dir *parent = resolve_parent(fs, path, &name, &len);
+    if(parent==NULL || len==0) return -1;
+
+    lock_mutex(fs, &parent->mutex, RSFS_LOCK_DIR);
+
+    int ret = -1;
+    struct dir_entry *dir_entry = search_dir_internal(parent, name, len, hash_name(name, len));
+    if(dir_entry && dir_entry->dir){
+        struct dir *dir = dir_entry->dir;
+        lock_mutex(fs, &dir->mutex, RSFS_LOCK_DIR); //parent before child, as in print_dir()
+        if(dir->num_entries==0){
+            dir->removed = 1; //a concurrent insert that already resolved dir now fails
+            unlink_entry(fs, parent, dir_entry);
+
+            //keep it on the list of removed directories of the volume
+            struct dir *head = __atomic_load_n(&fs->removed_dirs, __ATOMIC_RELAXED);
+            do{
+                dir->next_removed = head;
+            }while(!__atomic_compare_exchange_n(&fs->removed_dirs, &head, dir, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+            ret = 0;
         }
-        ret = 0;
+        pthread_mutex_unlock(&dir->mutex);
     }
 
-    pthread_mutex_unlock(&root_dir.mutex);
+    pthread_mutex_unlock(&parent->mutex);
 
     return ret;
 }
 
+//list the directory at path: copy up to max entries into entries[];
+//return the number of entries in the directory (which may exceed max), or -1 if path is not a directory
+int list_dir(struct rsfs *fs, char *path, struct rsfs_dirent *entries, int max){
+
+    struct dir *dir = resolve_dir(fs, path);
+    if(dir==NULL) return -1;
+
+    lock_mutex(fs, &dir->mutex, RSFS_LOCK_DIR);
+
+    int n = 0;
+    for(struct dir_entry *e = dir->head; e; e = e->next, n++){
+        if(n>=max) continue;
+        snprintf(entries[n].name, sizeof(entries[n].name), "%s", e->name);
+        entries[n].is_dir = (e->dir!=NULL);
+        entries[n].length = e->dir ? 0 : fs->inodes[e->inode_number].length;
+        entries[n].extents = 0;
+        if(e->dir==NULL){ //the table of large blocks may be replaced meanwhile (see blockmap.c)
+            struct inode *inode = &fs->inodes[e->inode_number];
+            lock_mutex(fs, &inode->map_mutex, RSFS_LOCK_INODE_MAP);
+            entries[n].extents = inode_extents(inode);
+            pthread_mutex_unlock(&inode->map_mutex);
+        }
+    }
+
+    pthread_mutex_unlock(&dir->mutex);
+
+    return n;
+}
+
+//print every entry under dir, one line each, with its path below prefix; directories end with '/'
+void print_dir(struct rsfs *fs, struct dir *dir, const char *prefix){
+
+    lock_mutex(fs, &dir->mutex, RSFS_LOCK_DIR);
+
+    for(struct dir_entry *e = dir->head; e; e = e->next){
+        char path[256];
+        snprintf(path, sizeof(path), "%s%s%s", prefix, e->name, e->dir ? "/" : "");
+        if(e->dir){
+            printf("%16s%10d%10s\n", path, e->dir->num_entries, "-");
+            print_dir(fs, e->dir, path);
+        }else{
+            printf("%16s%10lld%10d\n", path, (long long)fs->inodes[e->inode_number].length, e->inode_number);
+        }
+    }
+
+    pthread_mutex_unlock(&dir->mutex);
+}
+
+//free dir, everything under it and, for the root, the removed directories of the volume; only for rsfs_destroy()
+void destroy_dir(struct rsfs *fs, struct dir *dir){
+    for(struct dir_entry *e = dir->head; e; e = e->next){
+        if(e->dir){
+            destroy_dir(fs, e->dir);
+            fs_free(fs, e->dir);
+        }
+    }
+    free_chunks(fs, dir->pool);
+    free_chunks(fs, dir->arena);
+    fs_free(fs, dir->buckets);
+
+    if(dir==&fs->root_dir){
+        struct dir *removed = fs->removed_dirs;
+        while(removed){ //a removed directory has no entries left, only its pool and arena
+            struct dir *next = removed->next_removed;
+            destroy_dir(fs, removed);
+            fs_free(fs, removed);
+            removed = next;
+        }
+        fs->removed_dirs = NULL;
+    }
+}
@@ -1,55 +1,80 @@
 /*
-    allocation of inodes, inode bitmap, and mutexes to guard them;
-    routines for inode management
+    routines for inode management;
+    the inodes, the inode bitmap and the mutexes guarding them live in struct rsfs
 */
 
 #include "def.h"
 
 
-//allocation of inodes, inode bitmap and mutexes
-struct inode inodes[NUM_INODES];
-pthread_mutex_t inodes_mutex;
-int inode_bitmap[NUM_INODES];
-pthread_mutex_t inode_bitmap_mutex;
-
-
 //to allocate an empty inode and return the inode-number;  
 //if no free inode is available, return -1
-int allocate_inode(){
+int allocate_inode(struct rsfs *fs){
 
     int inode_number=-1; //init 
 
-    pthread_mutex_lock(&inode_bitmap_mutex);
+    TRACE(fs, 'B', "allocate_inode");
+    lock_mutex(fs, &fs->inode_bitmap_mutex, RSFS_LOCK_INODE_BITMAP);
 
     for(int i=0; i<NUM_INODES; i++){
-        if(inode_bitmap[i]==0){//find an available inode
+        if(fs->inode_bitmap[i]==0){//find an available inode
             
             inode_number=i;
-            inode_bitmap[i]=1; //mark it as allocated
+            fs->inode_bitmap[i]=1; //mark it as allocated
             
             //initialize the inode
-            inodes[i].length=0;
-            for(int j=0; j<NUM_POINTER; j++) inodes[i].block[j]=-1;
-            inodes[i].num_current_reader=0;
-            pthread_mutex_init(&inodes[i].read_mutex,NULL);
-            pthread_mutex_init(&inodes[i].rw_mutex,NULL);
+            fs->inodes[i].length=0;
+            for(int j=0; j<NUM_POINTER; j++) fs->inodes[i].block[j]=-1;
+            fs->inodes[i].num_large=0;
+            fs->inodes[i].num_medium=0;
+            fs->inodes[i].num_current_reader=0;
+            fs->inodes[i].sealed=0;
+            fs->inodes[i].refcount=0;
+            init_mutex(fs, &fs->inodes[i].read_mutex, 1);
+            init_mutex(fs, &fs->inodes[i].rw_mutex, 0);
 
             break;
         }
     }
 
-    pthread_mutex_unlock(&inode_bitmap_mutex);
+    pthread_mutex_unlock(&fs->inode_bitmap_mutex);
+    TRACE(fs, 'E', "allocate_inode");
 
     return inode_number;
 }
 
 //to free an inode with provided inode_number
-void free_inode(int inode_number){
+void free_inode(struct rsfs *fs, int inode_number){
 
-    pthread_mutex_lock(&inode_bitmap_mutex);
+    TRACE(fs, 'B', "free_inode");
+    lock_mutex(fs, &fs->inode_bitmap_mutex, RSFS_LOCK_INODE_BITMAP);
     
-    inode_bitmap[inode_number]=0; //mark it as available
+    fs->inode_bitmap[inode_number]=0; //mark it as available
     
-    pthread_mutex_unlock(&inode_bitmap_mutex);
+    pthread_mutex_unlock(&fs->inode_bitmap_mutex);
+    log_delete_inode(fs, inode_number);
+    TRACE(fs, 'E', "free_inode");
+}
+
+//to free the data blocks and the inode of a deleted file
+void release_inode(struct rsfs *fs, int inode_number){
+    release_file_blocks(fs, &fs->inodes[inode_number]); //free the blocks of every class and set the pointers to -1
+    free_inode(fs, inode_number);
 }
 
+//to take a reference to an inode, which keeps a delete from freeing it until put_inode();
+//return 0, or -1 if the file was deleted
+int get_inode(struct rsfs *fs, int inode_number){
+    struct inode *inode = &fs->inodes[inode_number];
+    int ref = __atomic_load_n(&inode->refcount, __ATOMIC_RELAXED);
+    do{
+        if(ref & INODE_DEAD) return -1;
+    }while(!__atomic_compare_exchange_n(&inode->refcount, &ref, ref+1, 1, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+    return 0;
+}
+
+//to drop a reference taken by get_inode(); the last one of a deleted file frees it
+void put_inode(struct rsfs *fs, int inode_number){
+    if(__atomic_sub_fetch(&fs->inodes[inode_number].refcount, 1, __ATOMIC_ACQ_REL)==INODE_DEAD){
+        release_inode(fs, inode_number);
+    }
+}
@@ -0,0 +1,331 @@
+/*
+    routines for the log-structured layout (RSFS_LAYOUT_LOG, chosen by rsfs_format());
+    the data blocks form NUM_SEGMENTS segments of SEGMENT_BLOCKS blocks, and a block is only
+    ever written at the head of the log: new blocks are taken there, a block about to be
+    modified is moved there first (log_relocate_block), and every change of an inode's block
+    map appends a record of the inode there, located through the inode map (fs->imap);
+    the blocks of the head segment may still be modified in place, as a segment buffer would be;
+    the cleaner reclaims dead blocks by moving the live blocks out of the segments with the
+    lowest live ratio, so whole segments become clean for the head again; blocks of sealed files
+    are read with no lock and never moved, so a segment holding one is not cleaned until the file
+    is freed, and a volume full of sealed data can leave the log full; the cleaner runs in a
+    background thread, and in a writing thread when only one clean segment is left, which
+    is kept for the cleaner to move blocks into;
+    all of the log's state is guarded by data_bitmap_mutex; an inode's map_mutex is taken
+    after it and is never held while waiting for anything else, so the cleaner can wait for it
+*/
+
+#include "def.h"
+#include <time.h>
+#include <errno.h>
+
+//inode record: what a persisted volume needs to find an inode's data again
+struct log_inode_record{
+    uint16_t length;
+    uint8_t inode_number;
+    int8_t block[NUM_POINTER]; //-1: not used
+};
+
+_Static_assert(sizeof(struct log_inode_record) <= BLOCK_SIZE, "an inode record must fit in one data block");
+_Static_assert(NUM_DBLOCKS <= 127, "inode records store block numbers in int8_t");
+
+//keep the cleaner off the blocks of inode while its block map or data is used
+void lock_block_map(struct rsfs *fs, struct inode *inode){
+    if(fs->layout!=RSFS_LAYOUT_LOG) return;
+    lock_mutex(fs, &inode->map_mutex, RSFS_LOCK_INODE_MAP);
+}
+
+void unlock_block_map(struct rsfs *fs, struct inode *inode){
+    if(fs->layout!=RSFS_LAYOUT_LOG) return;
+    pthread_mutex_unlock(&inode->map_mutex);
+}
+
+//helper: whether segment s is clean (no live block, and not the head)
+static int is_clean(struct rsfs *fs, int s){
+    return fs->seg_live[s]==0 && (s!=fs->log_head_seg || fs->log_head_off==0);
+}
+
+int log_clean_segments_locked(struct rsfs *fs){
+    if(fs->layout!=RSFS_LAYOUT_LOG) return 0;
+    int n = 0;
+    for(int s=0; s<NUM_SEGMENTS; s++) n += is_clean(fs, s);
+    return n;
+}
+
+static int clean_locked(struct rsfs *fs, int target, int max_live, int foreground);
+
+//helper: take the next block at the head of the log and mark it live;
+//when the head segment is full, continue in a clean segment; a writer (may_clean) that would
+//take the last clean segment cleans first, as the cleaner needs it to move blocks into;
+//return the block number, or -1 if the log is full
+static int take_slot_locked(struct rsfs *fs, int may_clean){
+    if(fs->log_head_off==SEGMENT_BLOCKS){
+        if(may_clean && log_clean_segments_locked(fs) <= 1) clean_locked(fs, 2, SEGMENT_BLOCKS-1, 1);
+        if(fs->log_head_off==SEGMENT_BLOCKS){ //the cleaner may have moved the head already
+            int next = -1;
+            for(int s=0; s<NUM_SEGMENTS && next<0; s++){
+                if(s!=fs->log_head_seg && fs->seg_live[s]==0) next = s;
+            }
+            if(next<0) return -1;
+            fs->log_head_seg = next;
+            fs->log_head_off = 0;
+        }
+        if(log_clean_segments_locked(fs) < LOG_CLEAN_TARGET) pthread_cond_signal(&fs->cleaner_cond);
+    }
+    int block = fs->log_head_seg*SEGMENT_BLOCKS + fs->log_head_off++;
+    fs->data_bitmap[block] = 1;
+    fs->seg_live[fs->log_head_seg]++;
+    fs->log_stats.blocks_written++;
+    return block;
+}
+
+//helper: mark a block taken by take_slot_locked() dead again
+static void drop_slot_locked(struct rsfs *fs, int block){
+    fs->data_bitmap[block] = 0;
+    fs->seg_live[block/SEGMENT_BLOCKS]--;
+}
+
+//take n blocks at the head of the log into blocks[] and mark them live;
+//the caller holds data_bitmap_mutex and accounts for them; return n, or -1 (nothing taken) if the log is full
+int log_take_blocks_locked(struct rsfs *fs, int n, int *blocks){
+    for(int i=0; i<n; i++){
+        blocks[i] = take_slot_locked(fs, 1);
+        if(blocks[i]<0){
+            while(i-->0) drop_slot_locked(fs, blocks[i]);
+            return -1;
+        }
+    }
+    return n;
+}
+
+//helper: write the record of inode_number at the head of the log and drop the old one; the caller holds data_bitmap_mutex
+static void write_record_locked(struct rsfs *fs, int inode_number, int may_clean){
+    int block = take_slot_locked(fs, may_clean);
+    if(block<0){ //the old record stays until the cleaner writes this one
+        fs->imap_stale |= 1<<inode_number;
+        return;
+    }
+
+    struct inode *inode = &fs->inodes[inode_number];
+    struct log_inode_record *r = (struct log_inode_record *)fs->data_blocks[block];
+    r->length = (uint16_t)inode->length;
+    r->inode_number = (uint8_t)inode_number;
+    lock_mutex(fs, &inode->map_mutex, RSFS_LOCK_INODE_MAP);
+    for(int i=0; i<NUM_POINTER; i++) r->block[i] = (int8_t)inode->block[i];
+    pthread_mutex_unlock(&inode->map_mutex);
+
+    if(fs->imap[inode_number]>=0) drop_slot_locked(fs, fs->imap[inode_number]);
+    fs->imap[inode_number] = block;
+    fs->imap_stale &= ~(1<<inode_number);
+    fs->log_stats.inode_records++;
+}
+
+//helper: move the live blocks out of segment s so it becomes clean; the records of the inodes whose
+//blocks moved are written later (see clean_locked); the caller holds data_bitmap_mutex;
+//return 0 if succeed, or -1 if a block cannot be moved now (it is not mapped yet or sealed, or the log is full)
+static int clean_segment_locked(struct rsfs *fs, int s){
+    for(int b = s*SEGMENT_BLOCKS; b < (s+1)*SEGMENT_BLOCKS; b++){
+        if(!fs->data_bitmap[b]) continue;
+
+        //an inode record: copy it
+        int owner = -1;
+        for(int i=0; i<NUM_INODES && owner<0; i++) if(fs->imap[i]==b) owner = i;
+        if(owner>=0){
+            int to = take_slot_locked(fs, 0);
+            if(to<0) return -1;
+            memcpy(fs->data_blocks[to], fs->data_blocks[b], BLOCK_SIZE);
+            fs->imap[owner] = to;
+            drop_slot_locked(fs, b);
+            fs->log_stats.blocks_moved++;
+            continue;
+        }
+
+        //a data block: find the inode and pointer it belongs to, and keep that inode's map locked;
+        //map_mutex is held only briefly and never while waiting for data_bitmap_mutex, so waiting for it is safe
+        int idx = -1;
+        struct inode *inode = NULL;
+        for(int i=0; i<NUM_INODES && owner<0; i++){
+            inode = &fs->inodes[i];
+            lock_mutex(fs, &inode->map_mutex, RSFS_LOCK_INODE_MAP);
+            for(int j=0; j<NUM_POINTER; j++){
+                if(inode->block[j]==b){ owner = i; idx = j; break; }
+            }
+            if(owner<0) pthread_mutex_unlock(&inode->map_mutex);
+        }
+        if(owner<0) return -1; //just allocated, not in a block map yet
+
+        if(__atomic_load_n(&inode->sealed, __ATOMIC_ACQUIRE)){ //sealed files are read with no lock
+            pthread_mutex_unlock(&inode->map_mutex);
+            return -1;
+        }
+        int to = take_slot_locked(fs, 0);
+        if(to>=0){
+            memcpy(fs->data_blocks[to], fs->data_blocks[b], BLOCK_SIZE);
+            inode->block[idx] = to;
+            drop_slot_locked(fs, b);
+            fs->imap_stale |= 1<<owner;
+            fs->log_stats.blocks_moved++;
+        }
+        pthread_mutex_unlock(&inode->map_mutex);
+        if(to<0) return -1;
+    }
+
+    return fs->seg_live[s]==0 ? 0 : -1;
+}
+
+//helper: return 1 if segment s holds a block of a sealed file, which the cleaner can not move;
+//the seal is checked under the block map, as seal_internal sets it there
+static int holds_sealed_locked(struct rsfs *fs, int s){
+    for(int i=0; i<NUM_INODES; i++){
+        struct inode *inode = &fs->inodes[i];
+        if(!__atomic_load_n(&inode->sealed, __ATOMIC_ACQUIRE)) continue;
+        int found = 0;
+        lock_mutex(fs, &inode->map_mutex, RSFS_LOCK_INODE_MAP);
+        for(int j=0; j<NUM_POINTER; j++){
+            if(inode->block[j]>=0 && inode->block[j]/SEGMENT_BLOCKS==s){ found = 1; break; }
+        }
+        pthread_mutex_unlock(&inode->map_mutex);
+        if(found) return 1;
+    }
+    return 0;
+}
+
+//helper: clean segments, fewest live blocks first, until target segments are clean;
+//segments with more than max_live live blocks, or pinned by a sealed file, are left alone; the caller holds data_bitmap_mutex
+static int clean_locked(struct rsfs *fs, int target, int max_live, int foreground){
+    fs->log_stats.cleaner_runs++;
+    if(foreground) fs->log_stats.foreground_runs++;
+
+    int skip = 0; //segments that could not be cleaned in this run
+    for(int s=0; s<NUM_SEGMENTS; s++){
+        if(s!=fs->log_head_seg && fs->seg_live[s]>0 && holds_sealed_locked(fs, s)) skip |= 1<<s; //moving the other blocks out would be wasted
+    }
+    while(log_clean_segments_locked(fs) < target){
+        int victim = -1;
+        for(int s=0; s<NUM_SEGMENTS; s++){
+            if(s==fs->log_head_seg || (skip & (1<<s)) || fs->seg_live[s]==0 || fs->seg_live[s]>max_live) continue;
+            if(victim<0 || fs->seg_live[s]<fs->seg_live[victim]) victim = s;
+        }
+        if(victim<0) break;
+
+        if(clean_segment_locked(fs, victim)==0) fs->log_stats.segments_cleaned++;
+        else skip |= 1<<victim;
+    }
+
+    //write the records of the inodes whose blocks moved, as long as that leaves a clean segment
+    for(int i=0; i<NUM_INODES; i++){
+        if(!(fs->imap_stale & (1<<i))) continue;
+        if(fs->log_head_off==SEGMENT_BLOCKS && log_clean_segments_locked(fs)<=1) break;
+        write_record_locked(fs, i, 0);
+    }
+    return log_clean_segments_locked(fs);
+}
+
+//helper: the background cleaner; it keeps LOG_CLEAN_TARGET segments clean, cleaning only
+//segments that are mostly dead, and wakes when the head takes a segment or every LOG_CLEANER_INTERVAL_MS
+static void *cleaner_main(void *arg){
+    struct rsfs *fs = (struct rsfs *)arg;
+
+    lock_mutex(fs, &fs->data_bitmap_mutex, RSFS_LOCK_DATA_BITMAP);
+    while(!fs->cleaner_stop){
+        if(log_clean_segments_locked(fs) < LOG_CLEAN_TARGET || fs->imap_stale){
+            TRACE(fs, 'B', "log_cleaner");
+            clean_locked(fs, LOG_CLEAN_TARGET, LOG_CLEAN_MAX_LIVE, 0);
+            TRACE(fs, 'E', "log_cleaner");
+        }
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += LOG_CLEANER_INTERVAL_MS * 1000000L;
+        if(deadline.tv_nsec >= 1000000000L){
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&fs->cleaner_cond, &fs->data_bitmap_mutex, &deadline);
+    }
+    pthread_mutex_unlock(&fs->data_bitmap_mutex);
+
+    return NULL;
+}
+
+//set up the log of a new volume and start its cleaner; return 0 if succeed, or -1 otherwise
+int log_init(struct rsfs *fs){
+    for(int s=0; s<NUM_SEGMENTS; s++) fs->seg_live[s] = 0;
+    fs->log_head_seg = 0;
+    fs->log_head_off = 0;
+    for(int i=0; i<NUM_INODES; i++) fs->imap[i] = -1;
+    fs->imap_stale = 0;
+
+    //two segments' worth of blocks are kept back, so a clean segment can always be made
+    //for the cleaner to move blocks into, and one block per inode for its record
+    fs->num_free_dblocks = NUM_DBLOCKS - LOG_RESERVED_BLOCKS;
+
+    init_cond(fs, &fs->cleaner_cond);
+    fs->cleaner_stop = 0;
+    if(pthread_create(&fs->cleaner, NULL, cleaner_main, fs)!=0) return -1;
+    fs->cleaner_running = 1;
+    return 0;
+}
+
+//stop the cleaner of a volume
+void log_destroy(struct rsfs *fs){
+    if(!fs->cleaner_running) return;
+
+    pthread_mutex_lock(&fs->data_bitmap_mutex);
+    fs->cleaner_stop = 1;
+    pthread_cond_signal(&fs->cleaner_cond);
+    pthread_mutex_unlock(&fs->data_bitmap_mutex);
+
+    pthread_join(fs->cleaner, NULL);
+    fs->cleaner_running = 0;
+    pthread_cond_destroy(&fs->cleaner_cond);
+}
+
+//move block idx of inode to the head of the log before it is modified; a block in the head segment
+//is not moved; the caller must not hold the map of inode, as taking a block may clean;
+//return 0 if succeed, or -1 if the log is full
+int log_relocate_block(struct rsfs *fs, struct inode *inode, int idx){
+    if(fs->layout!=RSFS_LAYOUT_LOG) return 0;
+
+    int ret = 0;
+    lock_mutex(fs, &fs->data_bitmap_mutex, RSFS_LOCK_DATA_BITMAP);
+    int block = inode->block[idx]; //only this thread and the cleaner change it, and the cleaner is excluded here
+    if(block>=0 && block/SEGMENT_BLOCKS!=fs->log_head_seg){
+        int to = take_slot_locked(fs, 1);
+        lock_mutex(fs, &inode->map_mutex, RSFS_LOCK_INODE_MAP);
+        block = inode->block[idx]; //cleaning may have moved it meanwhile
+        if(to<0){
+            ret = -1;
+        }else if(block/SEGMENT_BLOCKS==fs->log_head_seg){
+            drop_slot_locked(fs, to);
+        }else{
+            memcpy(fs->data_blocks[to], fs->data_blocks[block], BLOCK_SIZE);
+            drop_slot_locked(fs, block);
+            inode->block[idx] = to;
+        }
+        pthread_mutex_unlock(&inode->map_mutex);
+    }
+    pthread_mutex_unlock(&fs->data_bitmap_mutex);
+
+    return ret;
+}
+
+//append a record of inode_number (its length and block map) to the log
+void log_write_inode(struct rsfs *fs, int inode_number){
+    if(fs->layout!=RSFS_LAYOUT_LOG) return;
+
+    lock_mutex(fs, &fs->data_bitmap_mutex, RSFS_LOCK_DATA_BITMAP);
+    write_record_locked(fs, inode_number, 1);
+    pthread_mutex_unlock(&fs->data_bitmap_mutex);
+}
+
+//drop the record of a freed inode
+void log_delete_inode(struct rsfs *fs, int inode_number){
+    if(fs->layout!=RSFS_LAYOUT_LOG) return;
+
+    lock_mutex(fs, &fs->data_bitmap_mutex, RSFS_LOCK_DATA_BITMAP);
+    if(fs->imap[inode_number]>=0) drop_slot_locked(fs, fs->imap[inode_number]);
+    fs->imap[inode_number] = -1;
+    fs->imap_stale &= ~(1<<inode_number);
+    pthread_mutex_unlock(&fs->data_bitmap_mutex);
+}
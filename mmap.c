@@ -0,0 +1,192 @@
+/*
+    memfd-backed blocks and mappings of files: a volume formatted with RSFS_MEMFD keeps its medium
+    and large blocks (see blockmap.c) in one memfd, the medium blocks first and then the large ones,
+    each at an offset that is a multiple of its size; the whole memfd is mapped once, and the blocks
+    are addressed in that mapping, so the rest of the file system does not see the difference;
+    rsfs_mmap() reserves a range of address space and maps the blocks of the file into it in file
+    order, one mmap() per run of blocks that are consecutive in the memfd, so a file whose blocks
+    are scattered still reads as one array, and nothing is copied;
+    only the bytes held by medium and large blocks can be mapped, as the blocks of the tail are
+    smaller than a page;
+    a mapping shows the blocks, not the file: when the blocks of the file are relinked (a cut, a
+    delete, a truncate or a write that moves bytes into other blocks), every mapping of the file is
+    replaced by an inaccessible range before the blocks can be reused, so a stale mapping faults
+    rather than showing another file's data; it still has to be removed with rsfs_munmap();
+    the list of mappings is private to the process, so shared volumes have no memfd and no mappings
+*/
+
+#define _GNU_SOURCE
+#include "def.h"
+#include <unistd.h>
+#include <sys/mman.h>
+
+//helper: offset of block of class cls in the memfd
+static off_t memfd_offset(int cls, int block){
+    if(cls==RSFS_CLASS_MEDIUM) return (off_t)block * MEDIUM_BLOCK_SIZE;
+    return (off_t)NUM_MEDIUM_BLOCKS * MEDIUM_BLOCK_SIZE + (off_t)block * LARGE_BLOCK_SIZE;
+}
+
+//create the memfd of fs and map it; its pages are only allocated as the blocks are written;
+//return 0 if succeed, or -1 if it fails or a medium block is not a whole number of pages
+int memfd_init(struct rsfs *fs){
+    long page = sysconf(_SC_PAGESIZE);
+    if(page<=0 || MEDIUM_BLOCK_SIZE % page!=0) return -1;
+
+    size_t size = memfd_offset(RSFS_CLASS_LARGE, NUM_LARGE_BLOCKS);
+    int fd = memfd_create("rsfs_blocks", MFD_CLOEXEC);
+    if(fd<0) return -1;
+    if(ftruncate(fd, size)<0){
+        close(fd);
+        return -1;
+    }
+    void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, fd, 0);
+    if(base==MAP_FAILED){
+        close(fd);
+        return -1;
+    }
+    fs->memfd = fd;
+    fs->memfd_base = base;
+    fs->memfd_size = size;
+    return 0;
+}
+
+//unmap the mappings left and the memfd of fs, and close it
+void memfd_destroy(struct rsfs *fs){
+    while(fs->mappings){
+        struct rsfs_mapping *m = fs->mappings;
+        fs->mappings = m->next;
+        munmap(m->addr, m->len);
+        free(m);
+    }
+    fs->num_mappings = 0;
+    if(fs->memfd_base==NULL) return;
+    munmap(fs->memfd_base, fs->memfd_size);
+    close(fs->memfd);
+    fs->memfd_base = NULL;
+}
+
+//memory of block of class cls, in the mapping of the memfd of fs
+char *memfd_block(struct rsfs *fs, int cls, int block){
+    return fs->memfd_base + memfd_offset(cls, block);
+}
+
+//make every mapping of the file of inode inaccessible; called before blocks of the file are
+//freed or its bytes are moved to other blocks; costs one load when the volume has no mapping
+void invalidate_mappings(struct rsfs *fs, struct inode *inode){
+    if(__atomic_load_n(&fs->num_mappings, __ATOMIC_ACQUIRE)==0) return;
+
+    int inode_number = inode - fs->inodes;
+    lock_mutex(fs, &fs->mmap_mutex, RSFS_LOCK_MMAP);
+    for(struct rsfs_mapping *m = fs->mappings; m; m = m->next){
+        if(m->inode_number!=inode_number || !m->valid) continue;
+        //replacing the range keeps the address space reserved until rsfs_munmap()
+        mmap(m->addr, m->len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0);
+        m->valid = 0;
+        fs->mmap_stats.invalidated++;
+    }
+    pthread_mutex_unlock(&fs->mmap_mutex);
+    TRACE(fs, 'i', "invalidate_mappings");
+}
+
+//helper: take m off the list of mappings of fs; the caller holds mmap_mutex
+static void unlink_mapping(struct rsfs *fs, struct rsfs_mapping *m){
+    struct rsfs_mapping **p = &fs->mappings;
+    while(*p!=m) p = &(*p)->next;
+    *p = m->next;
+    __atomic_sub_fetch(&fs->num_mappings, 1, __ATOMIC_RELEASE);
+    fs->mmap_stats.live--;
+}
+
+//map bytes [offset, offset+len) of the file of descriptor fd into one contiguous range, writable if fd
+//is open with RSFS_RDWR (and not sealed); offset must be a multiple of MEDIUM_BLOCK_SIZE, and the range
+//must end before the tail of the file (see tail_start) and within its length; the bytes of the last
+//page past the end of the file read as zeros, which are written there first, so a range whose last
+//page goes past the end can only be mapped through a descriptor that may write the file;
+//the mapping stays after fd is closed;
+//return the address of the byte at offset, or NULL if it fails (or the volume has no memfd)
+void *rsfs_mmap(struct rsfs *fs, int fd, int64_t offset, int64_t len){
+    struct open_file_entry *ofe = get_open_file_entry(fs, fd);
+    if(fs->memfd_base==NULL || ofe==NULL || offset<0 || len<=0 || offset % MEDIUM_BLOCK_SIZE!=0) return NULL;
+    struct inode *inode = &fs->inodes[ofe->inode_number];
+    if(offset + len > inode->length || offset + len > tail_start(inode)) return NULL;
+
+    long page = sysconf(_SC_PAGESIZE);
+    size_t size = (len + page - 1) / page * page; //still before the tail, which starts on a medium block
+    int writable = (ofe->access_flag==RSFS_RDWR && !ofe->sealed);
+    if(offset + (int64_t)size > inode->length && !writable) return NULL; //the zeros past the end would change a file fd can not write
+    int prot = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+
+    TRACE(fs, 'B', "rsfs_mmap");
+    struct rsfs_mapping *m = malloc(sizeof(struct rsfs_mapping));
+    char *addr = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(m==NULL || addr==MAP_FAILED){
+        if(addr!=MAP_FAILED) munmap(addr, size);
+        free(m);
+        TRACE(fs, 'E', "rsfs_mmap");
+        return NULL;
+    }
+
+    //register the mapping before the block map is read, so a relink from now on invalidates it
+    m->addr = addr;
+    m->len = size;
+    m->inode_number = ofe->inode_number;
+    m->valid = 1;
+    lock_mutex(fs, &fs->mmap_mutex, RSFS_LOCK_MMAP);
+    m->next = fs->mappings;
+    fs->mappings = m;
+    __atomic_add_fetch(&fs->num_mappings, 1, __ATOMIC_RELEASE);
+    fs->mmap_stats.live++;
+    pthread_mutex_unlock(&fs->mmap_mutex);
+
+    //the bytes past the end of the file may hold what an earlier file left in the block
+    if(offset + (int64_t)size > inode->length) copy_into_file(fs, inode, inode->length, NULL, offset + size - inode->length);
+
+    //map each run of blocks that are consecutive in the memfd with one call, in file order; each call
+    //is made under mmap_mutex once the mapping is known to be still valid, so an invalidation either
+    //comes first, and the mapping fails, or replaces what was mapped
+    int segments = 0, ok = 1;
+    for(int64_t pos = offset; ok && pos < offset + (int64_t)size; ){
+        int avail;
+        char *start = file_ptr(fs, inode, pos, &avail);
+        int64_t n = avail;
+        while(pos + n < offset + (int64_t)size && file_ptr(fs, inode, pos + n, &avail)==start + n) n += avail;
+        if(n > offset + (int64_t)size - pos) n = offset + size - pos;
+        lock_mutex(fs, &fs->mmap_mutex, RSFS_LOCK_MMAP);
+        ok = m->valid && mmap(addr + (pos - offset), n, prot, MAP_SHARED | MAP_FIXED, fs->memfd, start - fs->memfd_base)!=MAP_FAILED;
+        pthread_mutex_unlock(&fs->mmap_mutex);
+        pos += n;
+        segments++;
+    }
+
+    lock_mutex(fs, &fs->mmap_mutex, RSFS_LOCK_MMAP);
+    ok = ok && m->valid;
+    if(ok){
+        fs->mmap_stats.maps++;
+        fs->mmap_stats.segments += segments;
+    }else{
+        unlink_mapping(fs, m);
+    }
+    pthread_mutex_unlock(&fs->mmap_mutex);
+    if(!ok){
+        munmap(addr, size);
+        free(m);
+        addr = NULL;
+    }
+    TRACE(fs, 'E', "rsfs_mmap");
+    return addr;
+}
+
+//remove the mapping at addr made by rsfs_mmap(), valid or not; return 0 if succeed, or -1 if there is none
+int rsfs_munmap(struct rsfs *fs, void *addr){
+    lock_mutex(fs, &fs->mmap_mutex, RSFS_LOCK_MMAP);
+    struct rsfs_mapping **p = &fs->mappings;
+    while(*p && (*p)->addr!=addr) p = &(*p)->next;
+    struct rsfs_mapping *m = *p;
+    if(m) unlink_mapping(fs, m);
+    pthread_mutex_unlock(&fs->mmap_mutex);
+    if(m==NULL) return -1;
+
+    munmap(m->addr, m->len);
+    free(m);
+    return 0;
+}
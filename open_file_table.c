@@ -1,44 +1,142 @@
 /*
-    allocation of global open_file_table and its guarding mutex; 
-    routines for open file entry
+    routines for open file entry;
+    the open file table of a volume is a list of chunks of OPEN_FILE_CHUNK entries that
+    grows on demand (entries never move, so pointers to them stay valid), and free
+    entries are kept on a lock-free stack so allocating and freeing take no lock;
+    a descriptor is (generation << FD_INDEX_BITS) | index, and the generation of an
+    entry changes each time it is freed, so a stale descriptor is rejected
 */
 
 #include "def.h"
+#include <unistd.h>
 
-struct open_file_entry open_file_table[NUM_OPEN_FILE];
-pthread_mutex_t open_file_table_mutex;
+#define FD_INDEX_MASK ((1<<FD_INDEX_BITS)-1)
+#define FD_GENERATION_MASK ((1<<(31-FD_INDEX_BITS))-1) //keeps descriptors positive
+
+//the free stack head packs the index of the top entry (low 32 bits, 0xffffffff if empty)
+//with a tag (high 32 bits) that changes on every pop, so a pop cannot succeed on a stale head
+#define FREE_EMPTY 0xffffffffu
+#define FREE_INDEX(head) ((uint32_t)(head))
+#define FREE_HEAD(index, tag) (((uint64_t)(tag)<<32) | (uint32_t)(index))
+
+//helper: the entry with the given index; the caller makes sure the index exists
+static struct open_file_entry *entry_at(struct rsfs *fs, int index){
+    return &fs->open_file_chunks[index / OPEN_FILE_CHUNK][index % OPEN_FILE_CHUNK];
+}
+
+//helper: push the entry with the given index on the free stack
+static void push_free(struct rsfs *fs, int index){
+    struct open_file_entry *entry = entry_at(fs, index);
+    uint64_t head = __atomic_load_n(&fs->open_file_free_head, __ATOMIC_RELAXED);
+    uint64_t new_head;
+    do{
+        entry->next_free = (int)FREE_INDEX(head);
+        new_head = FREE_HEAD(index, head>>32);
+    }while(!__atomic_compare_exchange_n(&fs->open_file_free_head, &head, new_head, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+//helper: pop an entry index from the free stack; return -1 if the stack is empty
+static int pop_free(struct rsfs *fs){
+    uint64_t head = __atomic_load_n(&fs->open_file_free_head, __ATOMIC_ACQUIRE);
+    uint64_t new_head;
+    do{
+        if(FREE_INDEX(head)==FREE_EMPTY) return -1;
+        struct open_file_entry *entry = entry_at(fs, FREE_INDEX(head));
+        new_head = FREE_HEAD((uint32_t)entry->next_free, (head>>32)+1);
+    }while(!__atomic_compare_exchange_n(&fs->open_file_free_head, &head, new_head, 1, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+    return (int)FREE_INDEX(head);
+}
+
+//add one chunk of entries to the table and put them on the free stack;
+//return 0 if succeed, or -1 if the table is at MAX_OPEN_FILE or memory runs out
+int grow_open_file_table(struct rsfs *fs){
+
+    int ret = 0;
+
+    lock_mutex(fs, &fs->open_file_table_mutex, RSFS_LOCK_OPEN_FILE_TABLE);
+
+    //another thread may have grown the table while this one waited
+    if(FREE_INDEX(__atomic_load_n(&fs->open_file_free_head, __ATOMIC_ACQUIRE))==FREE_EMPTY){
+        int chunk = fs->num_open_file_chunks;
+        struct open_file_entry *entries = NULL;
+        if(chunk < MAX_OPEN_FILE/OPEN_FILE_CHUNK){
+            entries = (struct open_file_entry *)fs_alloc(fs, OPEN_FILE_CHUNK * sizeof(struct open_file_entry));
+        }
+        if(entries==NULL){
+            ret = -1;
+        }else{
+            for(int i=0; i<OPEN_FILE_CHUNK; i++){
+                entries[i].used = 0;
+                init_mutex(fs, &entries[i].entry_mutex, 1);
+                entries[i].access_flag = -1;
+            }
+            __atomic_store_n(&fs->open_file_chunks[chunk], entries, __ATOMIC_RELEASE);
+            __atomic_store_n(&fs->num_open_file_chunks, chunk+1, __ATOMIC_RELEASE);
+
+            //push in reverse so the lowest index is handed out first
+            for(int i=OPEN_FILE_CHUNK-1; i>=0; i--) push_free(fs, chunk*OPEN_FILE_CHUNK + i);
+        }
+    }
+
+    pthread_mutex_unlock(&fs->open_file_table_mutex);
+
+    return ret;
+}
 
 //allocate an available entry in open file table and return fd (file descriptor);
 //return -1 if no entry is found
-int allocate_open_file_entry(int access_flag, struct dir_entry *dir_entry){
-    
-    int fd=-1;
-    
-    pthread_mutex_lock(&open_file_table_mutex);
-    for(int i=0; i<NUM_OPEN_FILE; i++){
-        struct open_file_entry *entry = &open_file_table[i];
-        if(entry->used==0){
-            fd=i; //find a valid fd
-            entry->used = 1; //mark it as used
-
-            //set up the entry
-            entry->access_flag = access_flag;
-            entry->dir_entry = dir_entry; 
-
-            //init position
-            entry->position = 0; 
-            
-            break;
-        }
+int allocate_open_file_entry(struct rsfs *fs, int access_flag, int inode_number){
+
+    int index;
+    while((index = pop_free(fs))<0){
+        if(grow_open_file_table(fs)<0) return -1;
     }
-    pthread_mutex_unlock(&open_file_table_mutex);
 
-    return fd;
+    struct open_file_entry *entry = entry_at(fs, index);
+
+    //set up the entry
+    entry->access_flag = access_flag;
+    entry->inode_number = inode_number;
+
+    //init position
+    entry->position = 0;
+    entry->sealed = 0; //set by the caller for a sealed open
+
+    //nothing buffered yet
+    entry->dirty_start = 0;
+    entry->dirty_len = 0;
+    entry->reserved = 0;
+
+    entry->pid = fs->shm ? getpid() : 0; //for rsfs_recover()
+    __atomic_store_n(&entry->used, 1, __ATOMIC_RELEASE); //mark it as used
+    __atomic_fetch_add(&fs->num_open_files, 1, __ATOMIC_RELAXED);
+
+    return (entry->generation << FD_INDEX_BITS) | index;
+}
+
+//get the open file entry of descriptor fd;
+//return NULL if fd is out of range, not in use, or was closed (its entry was reused)
+struct open_file_entry *get_open_file_entry(struct rsfs *fs, int fd){
+
+    if(fd<0) return NULL;
+    int index = fd & FD_INDEX_MASK;
+    if(index >= __atomic_load_n(&fs->num_open_file_chunks, __ATOMIC_ACQUIRE) * OPEN_FILE_CHUNK) return NULL;
+
+    struct open_file_entry *entry = entry_at(fs, index);
+    if(!__atomic_load_n(&entry->used, __ATOMIC_ACQUIRE) || entry->generation != (fd >> FD_INDEX_BITS)) return NULL;
+
+    return entry;
 }
 
+void free_open_file_entry(struct rsfs *fs, int fd){
+    struct open_file_entry *entry = get_open_file_entry(fs, fd);
+    if(entry==NULL) return;
 
-void free_open_file_entry(int fd){
-    pthread_mutex_lock(&open_file_table_mutex);
-    open_file_table[fd].used=0;
-    pthread_mutex_unlock(&open_file_table_mutex);
-}
\ No newline at end of file
+    fs_free(fs, entry->dirty); //the caller has flushed it already
+    entry->dirty=NULL;
+    entry->generation = (entry->generation + 1) & FD_GENERATION_MASK; //outstanding copies of fd become stale
+    __atomic_store_n(&entry->used, 0, __ATOMIC_RELEASE);
+    __atomic_fetch_sub(&fs->num_open_files, 1, __ATOMIC_RELAXED);
+
+    push_free(fs, fd & FD_INDEX_MASK);
+}
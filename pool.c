@@ -0,0 +1,224 @@
+/*
+    work-stealing pool of threads, used by the bulk routines (see bulk.c): every worker has a deque
+    of tasks; a task submitted by a worker (a directory that finds more work, say) goes to the
+    bottom of that worker's own deque, and the worker pops from the bottom, newest first, so a walk
+    goes depth first over data it has just touched; a worker whose deque is empty steals from the
+    top of the others', oldest first, so a thief takes the biggest piece of work left;
+    a deque has its own mutex, which only a thief and the owner ever share, and idle workers sleep
+    on one condition until a task is submitted
+*/
+
+#include "def.h"
+#include <unistd.h>
+
+struct pool_task{
+    pool_fn fn;
+    void *arg;
+};
+
+//tasks[top..top+count) (mod cap): the top is the oldest task, the bottom the newest
+struct pool_deque{
+    pthread_mutex_t mutex;
+    struct pool_task *tasks;
+    int cap; //a power of two
+    int top;
+    int count;
+} __attribute__((aligned(64)));
+
+struct pool_worker{
+    struct rsfs_pool *pool;
+    int id;
+    pthread_t thread;
+    struct pool_deque deque;
+};
+
+struct rsfs_pool{
+    int nthreads;
+    struct pool_worker *workers;
+    pthread_mutex_t mutex; //protects stop and the waits on the conditions
+    pthread_cond_t work; //signaled when a task is submitted or the pool stops
+    pthread_cond_t done; //signaled when pending drops to 0
+    int queued; //tasks in the deques; only changed atomically, increased under mutex
+    int pending; //tasks submitted and not finished
+    int stop;
+    unsigned int next; //round robin over the workers for tasks submitted from outside the pool
+    uint64_t steals;
+};
+
+//helper: push t to the bottom of d; return 0 or -1 if the deque cannot grow
+static int push_bottom(struct pool_deque *d, struct pool_task t){
+    pthread_mutex_lock(&d->mutex);
+    if(d->count==d->cap){
+        int cap = d->cap ? 2*d->cap : 64;
+        struct pool_task *tasks = malloc(sizeof(struct pool_task) * cap);
+        if(tasks==NULL){
+            pthread_mutex_unlock(&d->mutex);
+            return -1;
+        }
+        for(int i=0; i<d->count; i++) tasks[i] = d->tasks[(d->top + i) & (d->cap-1)];
+        free(d->tasks);
+        d->tasks = tasks;
+        d->cap = cap;
+        d->top = 0;
+    }
+    d->tasks[(d->top + d->count) & (d->cap-1)] = t;
+    __atomic_store_n(&d->count, d->count + 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&d->mutex);
+    return 0;
+}
+
+//helper: take the newest task of d (bottom, by its owner) or the oldest (top, by a thief); return 1 if one was taken
+static int take(struct pool_deque *d, struct pool_task *t, int from_top){
+    if(__atomic_load_n(&d->count, __ATOMIC_RELAXED)==0) return 0; //a thief does not lock an empty deque
+    pthread_mutex_lock(&d->mutex);
+    int taken = (d->count > 0);
+    if(taken){
+        __atomic_store_n(&d->count, d->count - 1, __ATOMIC_RELAXED);
+        if(from_top){
+            *t = d->tasks[d->top];
+            d->top = (d->top + 1) & (d->cap-1);
+        }else{
+            *t = d->tasks[(d->top + d->count) & (d->cap-1)];
+        }
+    }
+    pthread_mutex_unlock(&d->mutex);
+    return taken;
+}
+
+//helper: find a task for worker w, in its own deque first and then in the others', starting next to it
+static int find_task(struct pool_worker *w, struct pool_task *t){
+    struct rsfs_pool *pool = w->pool;
+    int found = take(&w->deque, t, 0);
+    for(int i=1; !found && i<pool->nthreads; i++){
+        found = take(&pool->workers[(w->id + i) % pool->nthreads].deque, t, 1);
+        if(found) __atomic_add_fetch(&pool->steals, 1, __ATOMIC_RELAXED);
+    }
+    if(found) __atomic_sub_fetch(&pool->queued, 1, __ATOMIC_RELAXED);
+    return found;
+}
+
+//helper: count a finished task and wake pool_wait() after the last one
+static void finish_task(struct rsfs_pool *pool){
+    if(__atomic_sub_fetch(&pool->pending, 1, __ATOMIC_ACQ_REL)==0){
+        pthread_mutex_lock(&pool->mutex);
+        pthread_cond_broadcast(&pool->done);
+        pthread_mutex_unlock(&pool->mutex);
+    }
+}
+
+static void *worker_main(void *ptr){
+    struct pool_worker *w = (struct pool_worker *)ptr;
+    struct rsfs_pool *pool = w->pool;
+
+    for(;;){
+        struct pool_task t;
+        if(find_task(w, &t)){
+            t.fn(t.arg, w->id);
+            finish_task(pool);
+            continue;
+        }
+        //sleep until a task is queued; queued only grows under the mutex, so no wakeup is missed
+        pthread_mutex_lock(&pool->mutex);
+        while(__atomic_load_n(&pool->queued, __ATOMIC_RELAXED)<=0 && !pool->stop) pthread_cond_wait(&pool->work, &pool->mutex);
+        int stop = pool->stop && __atomic_load_n(&pool->queued, __ATOMIC_RELAXED)<=0;
+        pthread_mutex_unlock(&pool->mutex);
+        if(stop) break;
+    }
+    return NULL;
+}
+
+//helper: wake the first n workers to exit once the deques are empty, and wait for them
+static void stop_workers(struct rsfs_pool *pool, int n){
+    pthread_mutex_lock(&pool->mutex);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->mutex);
+    for(int i=0; i<n; i++) pthread_join(pool->workers[i].thread, NULL);
+}
+
+static void free_pool(struct rsfs_pool *pool){
+    for(int i=0; i<pool->nthreads; i++){
+        pthread_mutex_destroy(&pool->workers[i].deque.mutex);
+        free(pool->workers[i].deque.tasks);
+    }
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->work);
+    pthread_cond_destroy(&pool->done);
+    free(pool->workers);
+    free(pool);
+}
+
+//create a pool of nthreads workers (<=0: one per online core); NULL if it fails
+struct rsfs_pool *pool_create(int nthreads){
+    if(nthreads<=0) nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if(nthreads<=0) nthreads = 1;
+
+    struct rsfs_pool *pool = calloc(1, sizeof(struct rsfs_pool));
+    if(pool==NULL) return NULL;
+    pool->workers = aligned_alloc(64, sizeof(struct pool_worker) * nthreads);
+    if(pool->workers==NULL){
+        free(pool);
+        return NULL;
+    }
+    memset(pool->workers, 0, sizeof(struct pool_worker) * nthreads);
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    pool->nthreads = nthreads;
+    for(int i=0; i<nthreads; i++){
+        pool->workers[i].pool = pool;
+        pool->workers[i].id = i;
+        pthread_mutex_init(&pool->workers[i].deque.mutex, NULL);
+    }
+    for(int i=0; i<nthreads; i++){
+        if(pthread_create(&pool->workers[i].thread, NULL, worker_main, &pool->workers[i])!=0){
+            stop_workers(pool, i); //the workers started so far
+            free_pool(pool);
+            return NULL;
+        }
+    }
+    return pool;
+}
+
+//number of workers of pool
+int pool_threads(struct rsfs_pool *pool){
+    return pool->nthreads;
+}
+
+//queue fn(arg, worker running it) on the deque of worker (a task pushing more work passes its own
+//worker; -1 from outside the pool spreads the tasks round robin); if the deque cannot grow, fn runs
+//right away in the caller, with the worker passed in (-1 from outside the pool)
+void pool_submit(struct rsfs_pool *pool, int worker, pool_fn fn, void *arg){
+    int target = (worker>=0 && worker<pool->nthreads) ? worker
+            : (int)(__atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED) % pool->nthreads);
+    struct pool_task t = {fn, arg};
+
+    __atomic_add_fetch(&pool->pending, 1, __ATOMIC_ACQ_REL); //before the task can finish
+    if(push_bottom(&pool->workers[target].deque, t)<0){
+        fn(arg, worker);
+        finish_task(pool);
+        return;
+    }
+    pthread_mutex_lock(&pool->mutex);
+    __atomic_add_fetch(&pool->queued, 1, __ATOMIC_RELAXED);
+    pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+//wait until every task submitted so far, and every task those submitted, has run
+void pool_wait(struct rsfs_pool *pool){
+    pthread_mutex_lock(&pool->mutex);
+    while(__atomic_load_n(&pool->pending, __ATOMIC_ACQUIRE)>0) pthread_cond_wait(&pool->done, &pool->mutex);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+//number of tasks taken from another worker's deque so far
+uint64_t pool_steals(struct rsfs_pool *pool){
+    return __atomic_load_n(&pool->steals, __ATOMIC_RELAXED);
+}
+
+//stop the workers and free the pool; called after pool_wait(), when no task is left
+void pool_destroy(struct rsfs_pool *pool){
+    stop_workers(pool, pool->nthreads);
+    free_pool(pool);
+}
@@ -0,0 +1,418 @@
+/*
+    rsfsd: serves one volume to other processes over a Unix domain socket (protocol in def.h)
+
+    usage: ./rsfsd [-S socket] [-w workers] [-L inplace|log] [-m shared_name]
+
+    one thread waits in epoll for connections with something to do and queues them for a pool of
+    workers; a connection is registered with EPOLLONESHOT, so only one worker serves it at a time:
+    the worker reads what has arrived, runs the requests of every complete frame in order and writes
+    the replies, then re-arms the connection; frames pipelined by a client are therefore answered
+    in order, and a worker moves on to other connections after RSFSD_FRAMES_PER_TURN frames;
+    a connection whose replies are not being read stops being served until the client catches up;
+    descriptors opened through a connection are closed when it goes away, and a connection can only
+    use its own; a call that waits (an open of a file held by another writer) keeps its worker waiting,
+    as it would keep a thread of a local caller, so use at least as many workers as such connections;
+    the volume is a private one formatted with -L, or the shared-memory volume -m (see shm.c)
+*/
+
+#define _GNU_SOURCE
+#include "def.h"
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define RSFSD_FRAMES_PER_TURN 64 //frames a worker serves on one connection before it requeues it
+#define RSFSD_OUT_LIMIT (4*RSFSD_MAX_FRAME) //unsent reply bytes at which a connection stops being served
+
+//a client connection
+struct conn{
+    int sock;
+    char *in; //received bytes not yet served, RSFSD_MAX_FRAME at most
+    int in_len;
+    char *out; //replies not yet sent
+    int out_len;
+    int out_sent;
+    int out_cap;
+    int *fds; //descriptors opened through this connection and not closed yet
+    int num_fds;
+    int cap_fds;
+    struct conn *next; //next connection in the work queue
+};
+
+static struct rsfs *fs; //the volume served
+static int epfd;
+static volatile sig_atomic_t stopping;
+
+//work queue: connections ready to be served, FIFO
+static struct conn *queue_head, *queue_tail;
+static int queue_closed;
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+
+static void enqueue(struct conn *c){
+    pthread_mutex_lock(&queue_mutex);
+    c->next = NULL;
+    if(queue_tail) queue_tail->next = c;
+    else queue_head = c;
+    queue_tail = c;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_mutex);
+}
+
+//take the next connection to serve; NULL once the server stops
+static struct conn *dequeue(){
+    pthread_mutex_lock(&queue_mutex);
+    while(queue_head==NULL && !queue_closed) pthread_cond_wait(&queue_cond, &queue_mutex);
+    struct conn *c = queue_head;
+    if(c){
+        queue_head = c->next;
+        if(queue_head==NULL) queue_tail = NULL;
+    }
+    pthread_mutex_unlock(&queue_mutex);
+    return c;
+}
+
+//helper: wait for events on c again
+static void arm(struct conn *c, uint32_t events){
+    struct epoll_event ev = {events | EPOLLONESHOT, {.ptr = c}};
+    epoll_ctl(epfd, EPOLL_CTL_MOD, c->sock, &ev);
+}
+
+//helper: make room for n more reply bytes; return 0 if succeed, or -1 if memory runs out
+static int reserve_out(struct conn *c, int n){
+    if(c->out_len + n <= c->out_cap) return 0;
+    int cap = c->out_cap ? c->out_cap : RSFSD_MAX_FRAME;
+    while(cap < c->out_len + n) cap *= 2;
+    char *out = realloc(c->out, cap);
+    if(out==NULL) return -1;
+    c->out = out;
+    c->out_cap = cap;
+    return 0;
+}
+
+//helper: remember that fd was opened through c (or forget it, when it is closed)
+static void track_fd(struct conn *c, int fd, int opened){
+    if(!opened){
+        for(int i=0; i<c->num_fds; i++){
+            if(c->fds[i]==fd){
+                c->fds[i] = c->fds[--c->num_fds];
+                return;
+            }
+        }
+        return;
+    }
+    if(c->num_fds==c->cap_fds){
+        int cap = c->cap_fds ? 2*c->cap_fds : 8;
+        int *fds = realloc(c->fds, cap * sizeof(int));
+        if(fds==NULL) return; //the descriptor is left open if the client goes away
+        c->fds = fds;
+        c->cap_fds = cap;
+    }
+    c->fds[c->num_fds++] = fd;
+}
+
+//helper: whether fd was opened through c; a connection can only use its own descriptors
+static int owns_fd(struct conn *c, int fd){
+    for(int i=0; i<c->num_fds; i++){
+        if(c->fds[i]==fd) return 1;
+    }
+    return 0;
+}
+
+//helper: run one request with its payload; the result is appended to c->out at resp,
+//with the data of a read or readdir written after it into at most room bytes (a read is cut short to it);
+//return the payload length of the response
+static int run_request(struct conn *c, struct rsfsd_request *req, char *payload, struct rsfsd_response *resp,
+        char *data, int room){
+    char path[RSFSD_MAX_PATH+1];
+    int len = req->len < RSFSD_MAX_PATH ? req->len : RSFSD_MAX_PATH;
+    memcpy(path, payload, len);
+    path[len] = '\0';
+
+    int takes_fd = req->op!=RSFSD_OP_CREATE && req->op!=RSFSD_OP_OPEN && req->op!=RSFSD_OP_DELETE
+            && req->op!=RSFSD_OP_MKDIR && req->op!=RSFSD_OP_RMDIR && req->op!=RSFSD_OP_READDIR;
+    resp->ret = -1;
+    if(takes_fd && !owns_fd(c, req->fd)) return 0;
+
+    int out = 0;
+    switch(req->op){
+        case RSFSD_OP_CREATE: resp->ret = rsfs_create(fs, path); break;
+        case RSFSD_OP_OPEN:
+            resp->ret = rsfs_open(fs, path, req->arg);
+            if(resp->ret>=0) track_fd(c, resp->ret, 1);
+            break;
+        case RSFSD_OP_CLOSE:
+            resp->ret = rsfs_close(fs, req->fd);
+            if(resp->ret==0) track_fd(c, req->fd, 0);
+            break;
+        case RSFSD_OP_READ:
+            if(req->arg<0) break;
+            //cut short to what fits in the reply frame, as a read may be
+            resp->ret = rsfs_read(fs, req->fd, data, req->arg < room ? req->arg : room);
+            out = resp->ret>0 ? resp->ret : 0;
+            break;
+        case RSFSD_OP_WRITE: resp->ret = rsfs_write(fs, req->fd, payload, req->len); break;
+        case RSFSD_OP_APPEND: resp->ret = rsfs_append(fs, req->fd, payload, req->len); break;
+        case RSFSD_OP_FSEEK: resp->ret = rsfs_fseek(fs, req->fd, req->arg); break;
+        case RSFSD_OP_CUT: resp->ret = rsfs_cut(fs, req->fd, req->arg); break;
+        case RSFSD_OP_DELETE: resp->ret = rsfs_delete(fs, path); break;
+        case RSFSD_OP_FALLOCATE: resp->ret = rsfs_fallocate(fs, req->fd, req->arg, req->arg2); break;
+        case RSFSD_OP_TRUNCATE: resp->ret = rsfs_truncate(fs, req->fd, req->arg); break;
+        case RSFSD_OP_FLUSH: resp->ret = rsfs_flush(fs, req->fd); break;
+        case RSFSD_OP_MKDIR: resp->ret = rsfs_mkdir(fs, path); break;
+        case RSFSD_OP_RMDIR: resp->ret = rsfs_rmdir(fs, path); break;
+        case RSFSD_OP_READDIR: {
+            if(req->arg2<0 || req->arg2 > room / (int)sizeof(struct rsfs_dirent)) break;
+            int max = (int)req->arg2;
+            struct rsfs_dirent *entries = malloc(max * sizeof(struct rsfs_dirent) + 1); //data may be unaligned
+            if(entries==NULL) break;
+            resp->ret = rsfs_readdir(fs, path, entries, max);
+            if(resp->ret>0) out = (resp->ret < max ? resp->ret : max) * sizeof(struct rsfs_dirent);
+            memcpy(data, entries, out);
+            free(entries);
+            break;
+        }
+        case RSFSD_OP_SEAL: resp->ret = rsfs_seal(fs, req->fd); break;
+    }
+    return out;
+}
+
+//helper: serve the complete frame of flen bytes at start and append its reply to c->out;
+//return 0 if succeed, or -1 if the frame is malformed or memory runs out
+static int serve_frame(struct conn *c, char *start, struct rsfsd_frame *frame, int flen){
+    if(reserve_out(c, RSFSD_MAX_FRAME)<0) return -1;
+    int reply = c->out_len; //start of the reply frame
+    int used = sizeof(struct rsfsd_frame);
+
+    char *p = start + sizeof(struct rsfsd_frame);
+    char *end = start + flen;
+    for(int i=0; i<frame->count; i++){
+        struct rsfsd_request req;
+        if(end - p < (long)sizeof(req)) return -1;
+        memcpy(&req, p, sizeof(req));
+        p += sizeof(req);
+        if(end - p < req.len || req.op>=RSFSD_NUM_OPS) return -1;
+
+        struct rsfsd_response resp;
+        resp.pad = 0;
+        char *data = c->out + reply + used + sizeof(resp);
+        //the headers of this response and of every response still to come must fit in the frame too
+        int room = RSFSD_MAX_FRAME - used - (frame->count - i) * (int)sizeof(resp);
+        if(room<0) room = 0;
+        resp.len = run_request(c, &req, p, &resp, data, room);
+        memcpy(c->out + reply + used, &resp, sizeof(resp));
+        used += sizeof(resp) + resp.len;
+        p += req.len;
+    }
+    if(p!=end) return -1;
+
+    struct rsfsd_frame header = {used - sizeof(struct rsfsd_frame), RSFSD_MAGIC, frame->count};
+    memcpy(c->out + reply, &header, sizeof(header));
+    c->out_len += used;
+    return 0;
+}
+
+//helper: serve the complete frames received on c, at most budget of them, while the replies
+//waiting to be sent stay under RSFSD_OUT_LIMIT; return the number served, or -1 if the client misbehaved
+static int serve_frames(struct conn *c, int budget){
+    int served = 0, off = 0;
+    while(served<budget && c->out_len - c->out_sent < RSFSD_OUT_LIMIT){
+        struct rsfsd_frame frame;
+        if(c->in_len - off < (int)sizeof(frame)) break;
+        memcpy(&frame, c->in + off, sizeof(frame));
+        if(frame.magic!=RSFSD_MAGIC || frame.len > RSFSD_MAX_FRAME - sizeof(frame) || frame.count > RSFSD_MAX_BATCH) return -1;
+        int flen = sizeof(frame) + frame.len;
+        if(c->in_len - off < flen) break;
+
+        if(serve_frame(c, c->in + off, &frame, flen)<0) return -1;
+        off += flen;
+        served++;
+    }
+    memmove(c->in, c->in + off, c->in_len - off);
+    c->in_len -= off;
+    return served;
+}
+
+//helper: send what it can of the replies of c; return 0 if succeed, or -1 if the connection failed
+static int send_replies(struct conn *c){
+    while(c->out_sent < c->out_len){
+        ssize_t n = send(c->sock, c->out + c->out_sent, c->out_len - c->out_sent, MSG_NOSIGNAL);
+        if(n<0){
+            if(errno==EINTR) continue;
+            if(errno==EAGAIN || errno==EWOULDBLOCK) return 0;
+            return -1;
+        }
+        c->out_sent += n;
+    }
+    c->out_len = c->out_sent = 0;
+    return 0;
+}
+
+//helper: forget c, closing the descriptors opened through it
+static void drop(struct conn *c){
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->sock, NULL);
+    close(c->sock);
+    for(int i=0; i<c->num_fds; i++) rsfs_close(fs, c->fds[i]);
+    free(c->fds);
+    free(c->in);
+    free(c->out);
+    free(c);
+}
+
+//helper: serve c until it has nothing more to do, its replies back up or its turn is over
+static void serve(struct conn *c){
+    int budget = RSFSD_FRAMES_PER_TURN;
+    for(;;){
+        if(send_replies(c)<0){
+            drop(c);
+            return;
+        }
+        if(c->out_len - c->out_sent >= RSFSD_OUT_LIMIT){ //wait for the client to read its replies
+            arm(c, EPOLLOUT);
+            return;
+        }
+
+        int served = serve_frames(c, budget);
+        if(served<0){
+            drop(c);
+            return;
+        }
+        if(served>0){
+            budget -= served;
+            if(budget<=0){ //let other connections have a worker; continue from the back of the queue
+                if(send_replies(c)<0) drop(c);
+                else enqueue(c);
+                return;
+            }
+            continue;
+        }
+
+        ssize_t n = recv(c->sock, c->in + c->in_len, RSFSD_MAX_FRAME - c->in_len, 0);
+        if(n>0){
+            c->in_len += n;
+            continue;
+        }
+        if(n<0 && errno==EINTR) continue;
+        if(n<0 && (errno==EAGAIN || errno==EWOULDBLOCK)){
+            arm(c, c->out_sent < c->out_len ? EPOLLOUT : EPOLLIN);
+            return;
+        }
+        drop(c); //closed by the client, or failed
+        return;
+    }
+}
+
+static void *worker_main(void *arg){
+    (void)arg;
+    struct conn *c;
+    while((c = dequeue())!=NULL) serve(c);
+    return NULL;
+}
+
+//helper: accept every pending connection on listener
+static void accept_all(int listener){
+    for(;;){
+        int sock = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(sock<0) return;
+
+        struct conn *c = calloc(1, sizeof(struct conn));
+        if(c) c->in = malloc(RSFSD_MAX_FRAME);
+        if(c==NULL || c->in==NULL){
+            free(c);
+            close(sock);
+            continue;
+        }
+        c->sock = sock;
+        struct epoll_event ev = {EPOLLIN | EPOLLONESHOT, {.ptr = c}};
+        if(epoll_ctl(epfd, EPOLL_CTL_ADD, sock, &ev)<0){
+            free(c->in);
+            free(c);
+            close(sock);
+        }
+    }
+}
+
+static void on_signal(int sig){
+    (void)sig;
+    stopping = 1;
+}
+
+static void usage(const char *prog){
+    fprintf(stderr, "usage: %s [-S socket] [-w workers] [-L inplace|log] [-m shared_name]\n", prog);
+    exit(2);
+}
+
+int main(int argc, char *argv[]){
+    const char *socket_path = RSFSD_DEFAULT_SOCKET;
+    const char *shared_name = NULL;
+    int workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int layout = RSFS_LAYOUT_INPLACE;
+
+    int opt;
+    while((opt = getopt(argc, argv, "S:w:L:m:h"))!=-1){
+        switch(opt){
+            case 'S': socket_path = optarg; break;
+            case 'w': workers = atoi(optarg); break;
+            case 'L': layout = strcmp(optarg, "log")==0 ? RSFS_LAYOUT_LOG : RSFS_LAYOUT_INPLACE; break;
+            case 'm': shared_name = optarg; break;
+            default: usage(argv[0]);
+        }
+    }
+    if(workers<1) workers = 1;
+
+    fs = shared_name ? rsfs_open_shared(shared_name) : rsfs_format(layout);
+    if(fs==NULL){
+        fprintf(stderr, "[rsfsd] cannot set up the volume\n");
+        return 1;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(socket_path)>=sizeof(addr.sun_path)) usage(argv[0]);
+    strcpy(addr.sun_path, socket_path);
+    unlink(socket_path);
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(listener<0 || bind(listener, (struct sockaddr *)&addr, sizeof(addr))<0 || listen(listener, 128)<0){
+        fprintf(stderr, "[rsfsd] cannot listen on %s\n", socket_path);
+        return 1;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event lev = {EPOLLIN, {.ptr = NULL}}; //NULL marks the listener
+    epoll_ctl(epfd, EPOLL_CTL_ADD, listener, &lev);
+
+    pthread_t threads[workers];
+    for(int i=0; i<workers; i++) pthread_create(&threads[i], NULL, worker_main, NULL);
+    fprintf(stderr, "[rsfsd] serving on %s with %d workers\n", socket_path, workers);
+
+    struct epoll_event events[64];
+    while(!stopping){
+        int n = epoll_wait(epfd, events, 64, -1);
+        for(int i=0; i<n; i++){
+            if(events[i].data.ptr==NULL) accept_all(listener);
+            else enqueue((struct conn *)events[i].data.ptr);
+        }
+    }
+
+    //stop the workers; connections still open are dropped with the process
+    pthread_mutex_lock(&queue_mutex);
+    queue_closed = 1;
+    pthread_cond_broadcast(&queue_cond);
+    pthread_mutex_unlock(&queue_mutex);
+    for(int i=0; i<workers; i++) pthread_join(threads[i], NULL);
+
+    close(listener);
+    unlink(socket_path);
+    rsfs_destroy(fs);
+    return 0;
+}
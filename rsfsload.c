@@ -0,0 +1,313 @@
+/*
+    load generator for rsfsd (see rsfsd.c)
+
+    usage: ./rsfsload [-S socket] [-w workload,...] [-c max_connections] [-n frames_per_connection]
+                      [-B calls_per_frame] [-P frames_in_flight] [-T]
+
+    every workload is run with 1, 2, 4, ... max_connections connections, one thread each; a thread
+    keeps up to P frames of B calls in flight on its connection and times every frame from its send
+    to its reply; one JSON line per (workload, connections) is printed with calls/sec, the p50/p99/p999
+    latency of a frame in nanoseconds and the number of calls that returned <0
+
+    workloads: "seekread" reads a block of a file every connection has open (RSFS_fseek and RSFS_read),
+               "churn" creates and deletes a file of its own, "readdir" lists the root directory
+
+    -T runs no workload: it sends frames at the limits of the protocol, checks the replies and exits 1 if
+    one is wrong
+*/
+
+#include "def.h"
+#include <unistd.h>
+#include <time.h>
+
+#define MAX_FILE_SIZE TAIL_SIZE //size of the file read by seekread
+
+//settings from the command line
+struct load_config{
+    const char *socket_path;
+    int max_connections;
+    int frames; //frames per connection
+    int batch; //calls per frame
+    int pipeline; //frames in flight per connection
+};
+
+struct load_arg{
+    struct rsfs_client *client;
+    int id;
+    const struct load_config *cfg;
+    char name[16]; //file of this connection
+    int fd; //descriptor opened by setup, -1 if none
+    struct rsfs_call *calls; //pipeline * batch calls
+    char *bufs; //read buffer of each call, BLOCK_SIZE bytes
+    struct rsfs_dirent *entries; //readdir buffer of each call, 8 entries
+    uint64_t *lat; //latency of each frame in ns
+    long issued; //calls made so far; workloads alternate between two calls on it
+    int done; //frames answered
+    int errors; //calls that returned <0
+};
+
+//a workload: setup runs once per connection, outside the timed region; fill prepares the k-th call of the connection
+struct workload{
+    const char *name;
+    void (*setup)(struct load_arg *arg);
+    void (*fill)(struct load_arg *arg, struct rsfs_call *call, long k, char *buf, struct rsfs_dirent *entries);
+};
+
+static char shared_name[] = "shared"; //file read by every connection
+
+static uint64_t now_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+//create the file read by seekread and fill it; done once, before the runs
+static void prepare_volume(const struct load_config *cfg){
+    struct rsfs_client *client = rsfs_connect(cfg->socket_path);
+    if(client==NULL){
+        fprintf(stderr, "[rsfsload] cannot connect to %s (is rsfsd running?)\n", cfg->socket_path);
+        exit(2);
+    }
+    char buf[MAX_FILE_SIZE];
+    memset(buf, 's', sizeof(buf));
+    rsfs_remote_create(client, shared_name);
+    int fd = rsfs_remote_open(client, shared_name, RSFS_RDWR);
+    if(fd>=0){
+        rsfs_remote_truncate(client, fd, 0);
+        rsfs_remote_write(client, fd, buf, sizeof(buf));
+        rsfs_remote_close(client, fd);
+    }
+    rsfs_disconnect(client);
+}
+
+//-T: a read of RSFSD_MAX_PAYLOAD bytes fills a reply frame on its own; batched with other calls,
+//it must be cut short so their replies fit too, and the connection must stay usable afterwards;
+//return 0 if every reply is right, or 1 otherwise
+static int check_protocol(const struct load_config *cfg){
+    struct rsfs_client *client = rsfs_connect(cfg->socket_path);
+    if(client==NULL){
+        fprintf(stderr, "[rsfsload] cannot connect to %s (is rsfsd running?)\n", cfg->socket_path);
+        return 1;
+    }
+    static char data[RSFSD_MAX_PAYLOAD], buf[RSFSD_MAX_PAYLOAD];
+    memset(data, 'p', sizeof(data));
+    char name[] = "protocol_check";
+    rsfs_remote_create(client, name);
+    int fd = rsfs_remote_open(client, name, RSFS_RDWR);
+    int failed = fd<0 || rsfs_remote_truncate(client, fd, 0)<0 || rsfs_remote_write(client, fd, data, sizeof(data))!=(int64_t)sizeof(data);
+
+    //fseek + full read + fseek in one frame
+    struct rsfs_call calls[3] = {
+        {RSFSD_OP_FSEEK, fd, 0, 0, NULL, NULL, 0, NULL, 0, 0},
+        {RSFSD_OP_READ, fd, RSFSD_MAX_PAYLOAD, 0, NULL, NULL, 0, buf, sizeof(buf), 0},
+        {RSFSD_OP_FSEEK, fd, 1, 0, NULL, NULL, 0, NULL, 0, 0},
+    };
+    for(int i=0; i<3 && !failed; i++) failed = rsfs_client_add(client, &calls[i])<0;
+    if(!failed) failed = rsfs_client_send(client)<0 || rsfs_client_recv(client)!=3;
+    if(!failed){
+        //the read leaves room for the headers of the other two responses
+        int64_t expect = RSFSD_MAX_FRAME - (int)sizeof(struct rsfsd_frame) - 3 * (int)sizeof(struct rsfsd_response);
+        failed = calls[0].ret!=0 || calls[1].ret!=expect || calls[2].ret!=1 || memcmp(buf, data, expect)!=0;
+    }
+    //the next call is answered in turn
+    if(!failed) failed = rsfs_remote_read(client, fd, buf, 4)!=4;
+
+    if(fd>=0) rsfs_remote_close(client, fd);
+    rsfs_remote_delete(client, name);
+    rsfs_disconnect(client);
+    fprintf(stderr, "[rsfsload] protocol check: %s\n", failed ? "FAILED" : "ok");
+    return failed;
+}
+
+static void setup_reader(struct load_arg *arg){
+    arg->fd = rsfs_remote_open(arg->client, shared_name, RSFS_RDONLY);
+}
+
+static void fill_seekread(struct load_arg *arg, struct rsfs_call *call, long k, char *buf, struct rsfs_dirent *entries){
+    (void)entries;
+    struct rsfs_call c = {k%2 ? RSFSD_OP_READ : RSFSD_OP_FSEEK, arg->fd, k%2 ? BLOCK_SIZE : 0, 0,
+            NULL, NULL, 0, buf, BLOCK_SIZE, 0};
+    *call = c;
+}
+
+static void fill_churn(struct load_arg *arg, struct rsfs_call *call, long k, char *buf, struct rsfs_dirent *entries){
+    (void)buf; (void)entries;
+    struct rsfs_call c = {k%2 ? RSFSD_OP_DELETE : RSFSD_OP_CREATE, -1, 0, 0, arg->name, NULL, 0, NULL, 0, 0};
+    *call = c;
+}
+
+static void fill_readdir(struct load_arg *arg, struct rsfs_call *call, long k, char *buf, struct rsfs_dirent *entries){
+    (void)arg; (void)k; (void)buf;
+    struct rsfs_call c = {RSFSD_OP_READDIR, -1, 0, 8, "", NULL, 0, entries, 8 * sizeof(struct rsfs_dirent), 0};
+    *call = c;
+}
+
+static struct workload workloads[] = {
+    {"seekread", setup_reader, fill_seekread},
+    {"churn", NULL, fill_churn},
+    {"readdir", NULL, fill_readdir},
+};
+#define NUM_WORKLOADS ((int)(sizeof(workloads)/sizeof(workloads[0])))
+
+static struct workload *current; //workload being run
+
+static void *load_thread(void *ptr){
+    struct load_arg *arg = (struct load_arg *)ptr;
+    const struct load_config *cfg = arg->cfg;
+    if(current->setup) current->setup(arg);
+
+    uint64_t sent_at[RSFSD_MAX_INFLIGHT];
+    int sent = 0;
+    while(arg->done < cfg->frames){
+        //keep the pipeline full
+        while(sent < cfg->frames && sent - arg->done < cfg->pipeline){
+            int slot = sent % cfg->pipeline;
+            for(int k=0; k<cfg->batch; k++){
+                int i = slot * cfg->batch + k;
+                current->fill(arg, &arg->calls[i], arg->issued++, arg->bufs + i*BLOCK_SIZE, arg->entries + i*8);
+                rsfs_client_add(arg->client, &arg->calls[i]);
+            }
+            sent_at[slot] = now_ns();
+            if(rsfs_client_send(arg->client)<0) return NULL;
+            sent++;
+        }
+
+        int slot = arg->done % cfg->pipeline;
+        if(rsfs_client_recv(arg->client)<0) return NULL;
+        arg->lat[arg->done++] = now_ns() - sent_at[slot];
+        for(int k=0; k<cfg->batch; k++) arg->errors += (arg->calls[slot * cfg->batch + k].ret < 0);
+    }
+
+    if(arg->fd>=0) rsfs_remote_close(arg->client, arg->fd);
+    return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b){
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x>y) - (x<y);
+}
+
+static uint64_t percentile(uint64_t *sorted, int n, double p){
+    if(n==0) return 0;
+    int i = (int)(p * (n-1) + 0.5);
+    return sorted[i];
+}
+
+//run workload w over nconns connections and print its result line
+static void run(struct workload *w, int nconns, const struct load_config *cfg, int first){
+    pthread_t threads[nconns];
+    struct load_arg args[nconns];
+    int calls = cfg->pipeline * cfg->batch;
+
+    for(int i=0; i<nconns; i++){
+        memset(&args[i], 0, sizeof(args[i]));
+        args[i].client = rsfs_connect(cfg->socket_path);
+        args[i].id = i;
+        args[i].cfg = cfg;
+        snprintf(args[i].name, sizeof(args[i].name), "c%d", i);
+        args[i].fd = -1;
+        args[i].calls = calloc(calls, sizeof(struct rsfs_call));
+        args[i].bufs = malloc(calls * BLOCK_SIZE);
+        args[i].entries = malloc(calls * 8 * sizeof(struct rsfs_dirent));
+        args[i].lat = malloc(sizeof(uint64_t) * cfg->frames);
+        if(args[i].client==NULL || args[i].calls==NULL || args[i].bufs==NULL || args[i].entries==NULL || args[i].lat==NULL){
+            fprintf(stderr, "[rsfsload] cannot set up connection %d\n", i);
+            exit(2);
+        }
+    }
+
+    current = w;
+    uint64_t start = now_ns();
+    for(int i=0; i<nconns; i++) pthread_create(&threads[i], NULL, load_thread, &args[i]);
+    for(int i=0; i<nconns; i++) pthread_join(threads[i], NULL);
+    double elapsed = (now_ns() - start) / 1e9;
+
+    //merge the latencies of all connections
+    int total = 0, errors = 0;
+    for(int i=0; i<nconns; i++){
+        total += args[i].done;
+        errors += args[i].errors;
+    }
+    uint64_t *lat = malloc(sizeof(uint64_t) * (total ? total : 1));
+    if(lat==NULL) exit(2);
+    for(int i=0, k=0; i<nconns; i++){
+        memcpy(lat + k, args[i].lat, sizeof(uint64_t) * args[i].done);
+        k += args[i].done;
+        rsfs_disconnect(args[i].client);
+        free(args[i].calls);
+        free(args[i].bufs);
+        free(args[i].entries);
+        free(args[i].lat);
+    }
+    qsort(lat, total, sizeof(uint64_t), cmp_u64);
+
+    printf("%s{\"workload\":\"%s\",\"connections\":%d,\"batch\":%d,\"pipeline\":%d,\"frames\":%d,\"ops\":%lld,"
+            "\"ops_per_sec\":%.0f,\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu,\"errors\":%d}\n",
+            first ? "    " : "   ,", w->name, nconns, cfg->batch, cfg->pipeline, total,
+            (long long)total * cfg->batch, (double)total * cfg->batch / elapsed,
+            (unsigned long long)percentile(lat, total, 0.50),
+            (unsigned long long)percentile(lat, total, 0.99),
+            (unsigned long long)percentile(lat, total, 0.999), errors);
+    fflush(stdout);
+    free(lat);
+}
+
+static void usage(const char *prog){
+    fprintf(stderr, "usage: %s [-S socket] [-w workload,...] [-c max_connections] [-n frames_per_connection]\n"
+            "          [-B calls_per_frame] [-P frames_in_flight] [-T]\n"
+            "workloads:", prog);
+    for(int i=0; i<NUM_WORKLOADS; i++) fprintf(stderr, " %s", workloads[i].name);
+    fprintf(stderr, "\n");
+    exit(2);
+}
+
+int main(int argc, char *argv[]){
+    struct load_config cfg = {RSFSD_DEFAULT_SOCKET, 16, 20000, 1, 1};
+    char *selected = NULL; //comma-separated workload names; NULL runs all
+    int check = 0; //-T: check the protocol instead
+
+    int opt;
+    while((opt = getopt(argc, argv, "S:w:c:n:B:P:Th"))!=-1){
+        switch(opt){
+            case 'S': cfg.socket_path = optarg; break;
+            case 'w': selected = optarg; break;
+            case 'c': cfg.max_connections = atoi(optarg); break;
+            case 'n': cfg.frames = atoi(optarg); break;
+            case 'B': cfg.batch = atoi(optarg); break;
+            case 'P': cfg.pipeline = atoi(optarg); break;
+            case 'T': check = 1; break;
+            default: usage(argv[0]);
+        }
+    }
+    if(cfg.max_connections<1) cfg.max_connections = 1;
+    if(cfg.frames<1) cfg.frames = 1;
+    if(cfg.batch<1) cfg.batch = 1;
+    if(cfg.batch>RSFSD_MAX_BATCH) cfg.batch = RSFSD_MAX_BATCH;
+    if(cfg.pipeline<1) cfg.pipeline = 1;
+    if(cfg.pipeline>RSFSD_MAX_INFLIGHT) cfg.pipeline = RSFSD_MAX_INFLIGHT;
+
+    if(check) return check_protocol(&cfg);
+    prepare_volume(&cfg);
+
+    printf("{\n  \"config\":{\"max_connections\":%d,\"frames_per_connection\":%d,\"batch\":%d,\"pipeline\":%d},\n"
+            "  \"results\":[\n", cfg.max_connections, cfg.frames, cfg.batch, cfg.pipeline);
+
+    int first = 1;
+    for(int w=0; w<NUM_WORKLOADS; w++){
+        if(selected){
+            //match the name as a whole item of the comma-separated list
+            char list[256];
+            snprintf(list, sizeof(list), ",%s,", selected);
+            char item[64];
+            snprintf(item, sizeof(item), ",%s,", workloads[w].name);
+            if(strstr(list, item)==NULL) continue;
+        }
+        for(int n=1; n<=cfg.max_connections; n*=2){
+            run(&workloads[w], n, &cfg, first);
+            first = 0;
+        }
+    }
+    printf("  ]\n}\n");
+
+    return 0;
+}
@@ -0,0 +1,312 @@
+/*
+    shared-memory volumes: rsfs_open_shared() places a whole volume (struct rsfs, its data blocks,
+    open file table, directories and names) in a named POSIX shared-memory segment, so several
+    processes can mount it and call the rsfs_* API on it directly, without any IPC;
+    every process maps the segment at the same address, one of RSFS_SHM_SLOTS slots from
+    RSFS_SHM_BASE chosen by its creator, so the pointers inside the volume are valid everywhere; memory for the volume is taken from the segment by fs_alloc(), a bump
+    allocator with free lists of power-of-two classes (private volumes just use the heap);
+    the volume's mutexes are process-shared, and robust wherever they are only held for the
+    length of a call: when a process dies holding one, the next process to take it marks it
+    consistent and carries on with the state it guarded as it was left;
+    an inode's rw_mutex is held from open to close and is unlocked by whichever reader leaves
+    last, so it can not be robust; instead every open file entry records the pid that opened it,
+    and rsfs_recover() closes the descriptors of processes that are gone, which releases it;
+    shared volumes use the in-place layout and run neither the dentry cache (rwlocks can not be
+    robust) nor the defragmenter
+*/
+
+#include "def.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SHM_MAGIC 0x7273667373686d32ull //"rsfsshm2": bumped when the layout of the volume changes
+#define SHM_MIN_CLASS 6 //smallest allocation class: 64 bytes, header included
+#define SHM_NUM_CLASSES 27 //largest allocation class: 2^(SHM_MIN_CLASS+SHM_NUM_CLASSES-1) bytes
+#define SHM_ATTACH_TIMEOUT_MS 5000 //how long an attaching process waits for the creator to finish
+#define SHM_MAX_MOUNTS 16 //shared volumes a process can have mounted at a time
+
+//header at the start of a segment; the volume follows it, then the allocator's arena
+struct rsfs_shm{
+    uint64_t magic;
+    uint64_t size; //bytes in the segment
+    uint64_t base; //address every process maps the segment at
+    int ready; //set once the creator has formatted the volume
+    pthread_mutex_t alloc_mutex; //guards brk and free_lists
+    pthread_mutex_t recover_mutex; //serializes rsfs_recover()
+    uint64_t brk; //offset of the first byte never handed out
+    uint64_t free_lists[SHM_NUM_CLASSES]; //offset of the first free block of each class, 0 if none
+};
+
+//header of an allocation in the arena; keeps the data cache-line aligned
+struct shm_block{
+    uint64_t next_free; //offset of the next free block of the same class (while free)
+    int cls; //class of the block: it is 1<<(cls+SHM_MIN_CLASS) bytes long
+} __attribute__((aligned(64)));
+
+//segments mapped by this process; a forked child inherits them along with the mappings,
+//so mounting a volume it already has only takes another reference
+static struct shm_mount{
+    ino_t ino; //identifies the segment
+    struct rsfs_shm *shm; //NULL if the slot is free
+    int refs; //handles returned by rsfs_open_shared() not yet destroyed
+} mounts[SHM_MAX_MOUNTS];
+static pthread_mutex_t mounts_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define SHM_FS_OFFSET ((sizeof(struct rsfs_shm)+63) & ~(size_t)63)
+#define SHM_ARENA_OFFSET ((SHM_FS_OFFSET + sizeof(struct rsfs) + 63) & ~(size_t)63)
+
+//allocate size bytes of zeroed, 64-byte aligned memory for the volume fs (from its segment if it is shared);
+//return NULL if memory runs out
+void *fs_alloc(struct rsfs *fs, size_t size){
+    if(fs->shm==NULL){
+        void *p = NULL;
+        if(posix_memalign(&p, 64, size)!=0) return NULL;
+        memset(p, 0, size);
+        return p;
+    }
+
+    struct rsfs_shm *shm = fs->shm;
+    int cls = 0;
+    while(cls<SHM_NUM_CLASSES && ((size_t)1<<(cls+SHM_MIN_CLASS)) < size + sizeof(struct shm_block)) cls++;
+    if(cls==SHM_NUM_CLASSES) return NULL;
+    uint64_t bytes = (uint64_t)1<<(cls+SHM_MIN_CLASS);
+
+    struct shm_block *block = NULL;
+    take_mutex(fs, &shm->alloc_mutex);
+    if(shm->free_lists[cls]){
+        block = (struct shm_block *)((char *)shm + shm->free_lists[cls]);
+        shm->free_lists[cls] = block->next_free;
+    }else if(shm->brk + bytes <= shm->size){
+        block = (struct shm_block *)((char *)shm + shm->brk);
+        shm->brk += bytes;
+    }
+    pthread_mutex_unlock(&shm->alloc_mutex);
+    if(block==NULL) return NULL;
+
+    block->cls = cls;
+    memset(block+1, 0, size);
+    return block+1;
+}
+
+//free memory taken by fs_alloc(); NULL is ignored
+void fs_free(struct rsfs *fs, void *p){
+    if(p==NULL) return;
+    if(fs->shm==NULL){
+        free(p);
+        return;
+    }
+
+    struct rsfs_shm *shm = fs->shm;
+    struct shm_block *block = (struct shm_block *)p - 1;
+    take_mutex(fs, &shm->alloc_mutex);
+    block->next_free = shm->free_lists[block->cls];
+    shm->free_lists[block->cls] = (char *)block - (char *)shm;
+    pthread_mutex_unlock(&shm->alloc_mutex);
+}
+
+//helper: initialize mutex of a shared volume
+static void init_shared_mutex(pthread_mutex_t *mutex, int robust){
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    if(robust) pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+//initialize a mutex of fs; on a shared volume it is process-shared, and robust if robust is 1
+//(only for mutexes that the thread taking them also releases)
+void init_mutex(struct rsfs *fs, pthread_mutex_t *mutex, int robust){
+    if(fs->shm==NULL){
+        pthread_mutex_init(mutex, NULL);
+        return;
+    }
+    init_shared_mutex(mutex, robust);
+}
+
+//initialize a condition variable of fs; process-shared on a shared volume
+void init_cond(struct rsfs *fs, pthread_cond_t *cond){
+    if(fs->shm==NULL){
+        pthread_cond_init(cond, NULL);
+        return;
+    }
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+//take over mutex, just acquired with EOWNERDEAD because its owner died holding it
+void mutex_owner_died(struct rsfs *fs, pthread_mutex_t *mutex){
+    pthread_mutex_consistent(mutex);
+    __atomic_fetch_add(&fs->shm_stats.owner_deaths, 1, __ATOMIC_RELAXED);
+}
+
+//pthread_mutex_lock() that takes over a robust mutex whose owner died, without counting the acquisition
+void take_mutex(struct rsfs *fs, pthread_mutex_t *mutex){
+    if(pthread_mutex_lock(mutex)==EOWNERDEAD) mutex_owner_died(fs, mutex);
+}
+
+//helper: map the segment of fd, size bytes, at base (or anywhere if base is 0); return NULL if it fails
+static struct rsfs_shm *map_segment(int fd, uint64_t size, uint64_t base){
+    int flags = MAP_SHARED | (base ? MAP_FIXED_NOREPLACE : 0);
+    void *p = mmap((void *)base, size, PROT_READ|PROT_WRITE, flags, fd, 0);
+    if(p==MAP_FAILED) return NULL;
+    if(base && (uint64_t)p!=base){ //a kernel without MAP_FIXED_NOREPLACE took it as a hint
+        munmap(p, size);
+        return NULL;
+    }
+    return (struct rsfs_shm *)p;
+}
+
+//helper: create the segment of fd and format a volume in it; return the volume, or NULL if it fails
+static struct rsfs *create_shared(int fd){
+    if(ftruncate(fd, RSFS_SHM_SIZE)<0) return NULL; //sparse: pages are only backed once touched
+
+    //the pointers inside the volume are absolute, so it must live at an address other processes can
+    //map it at too: the first free slot of the range reserved for shared volumes, and never elsewhere
+    struct rsfs_shm *shm = NULL;
+    for(int k=0; shm==NULL && k<RSFS_SHM_SLOTS; k++) shm = map_segment(fd, RSFS_SHM_SIZE, RSFS_SHM_BASE + k*RSFS_SHM_SIZE);
+    if(shm==NULL) return NULL; //every slot is taken in this process
+
+    shm->size = RSFS_SHM_SIZE;
+    shm->base = (uint64_t)shm;
+    shm->brk = SHM_ARENA_OFFSET;
+    init_shared_mutex(&shm->alloc_mutex, 1);
+    init_shared_mutex(&shm->recover_mutex, 1);
+
+    struct rsfs *fs = (struct rsfs *)((char *)shm + SHM_FS_OFFSET);
+    fs->shm = shm;
+    if(volume_setup(fs, RSFS_LAYOUT_INPLACE)<0){
+        munmap(shm, RSFS_SHM_SIZE);
+        return NULL;
+    }
+
+    shm->magic = SHM_MAGIC;
+    __atomic_store_n(&shm->ready, 1, __ATOMIC_RELEASE);
+    return fs;
+}
+
+//helper: map the segment of fd, formatted by another process, at the address it uses;
+//return the volume, or NULL if it fails
+static struct rsfs *attach_shared(int fd){
+
+    //wait for the creator: first for the segment to get its size, then for the volume to be ready
+    struct rsfs_shm *probe = NULL;
+    for(int waited=0; ; waited++){
+        struct stat st;
+        if(fstat(fd, &st)<0) return NULL;
+        if(probe==NULL && st.st_size >= (off_t)SHM_ARENA_OFFSET) probe = map_segment(fd, SHM_ARENA_OFFSET, 0);
+        if(probe && __atomic_load_n(&probe->ready, __ATOMIC_ACQUIRE)) break;
+        if(waited>=SHM_ATTACH_TIMEOUT_MS){
+            if(probe) munmap(probe, SHM_ARENA_OFFSET);
+            return NULL;
+        }
+        usleep(1000);
+    }
+    uint64_t magic = probe->magic, size = probe->size, base = probe->base;
+    munmap(probe, SHM_ARENA_OFFSET);
+    if(magic!=SHM_MAGIC) return NULL;
+
+    struct rsfs_shm *shm = map_segment(fd, size, base);
+    if(shm==NULL) return NULL; //something else lives at the volume's address in this process
+    return (struct rsfs *)((char *)shm + SHM_FS_OFFSET);
+}
+
+//helper: the mount of the segment ino, or NULL; the caller holds mounts_mutex
+static struct shm_mount *find_mount(ino_t ino){
+    for(int i=0; i<SHM_MAX_MOUNTS; i++){
+        if(mounts[i].shm && mounts[i].ino==ino) return &mounts[i];
+    }
+    return NULL;
+}
+
+//mount the shared volume name (a POSIX shared-memory name such as "/vol"), creating and formatting it
+//with the in-place layout if it does not exist yet; descriptors left open by dead processes are closed;
+//return its handle, or NULL if it fails; release it with rsfs_destroy(), which only unmaps it
+struct rsfs *rsfs_open_shared(const char *name){
+    struct rsfs *fs = NULL;
+    int created = 1;
+    int fd = shm_open(name, O_RDWR|O_CREAT|O_EXCL, 0600);
+    if(fd<0){
+        created = 0;
+        if(errno!=EEXIST || (fd = shm_open(name, O_RDWR, 0))<0) return NULL;
+    }
+    struct stat st;
+    if(fstat(fd, &st)<0){
+        close(fd);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&mounts_mutex);
+    struct shm_mount *mount = created ? NULL : find_mount(st.st_ino);
+    if(mount){ //mapped already, by this process or the one it was forked from
+        mount->refs++;
+        fs = (struct rsfs *)((char *)mount->shm + SHM_FS_OFFSET);
+    }else{
+        for(int i=0; i<SHM_MAX_MOUNTS && mount==NULL; i++) if(mounts[i].shm==NULL) mount = &mounts[i];
+        if(mount) fs = created ? create_shared(fd) : attach_shared(fd);
+        if(fs){
+            mount->ino = st.st_ino;
+            mount->shm = fs->shm;
+            mount->refs = 1;
+            static int next_id = 1000; //trace pids of shared volumes, apart from the private ones
+            fs->id = __atomic_fetch_add(&next_id, 1, __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&mounts_mutex);
+
+    if(fs==NULL && created) shm_unlink(name);
+    close(fd);
+    if(fs) rsfs_recover(fs);
+    return fs;
+}
+
+//drop a handle of the shared volume fs (for rsfs_destroy()), unmapping it from this process with the last one;
+//the volume lives on in its segment
+void shm_detach(struct rsfs *fs){
+    struct rsfs_shm *shm = fs->shm;
+    pthread_mutex_lock(&mounts_mutex);
+    for(int i=0; i<SHM_MAX_MOUNTS; i++){
+        if(mounts[i].shm==shm && --mounts[i].refs==0){
+            mounts[i].shm = NULL;
+            munmap(shm, shm->size);
+        }
+    }
+    pthread_mutex_unlock(&mounts_mutex);
+}
+
+//remove the shared volume name; processes that have it mounted keep using it until they unmap it;
+//return 0 if succeed, or -1 if it does not exist
+int rsfs_unlink_shared(const char *name){
+    return shm_unlink(name);
+}
+
+//close the descriptors of fs opened by processes that no longer exist, releasing their inode locks
+//and flushing their buffered writes; return the number of descriptors closed (0 for a private volume)
+int rsfs_recover(struct rsfs *fs){
+    if(fs->shm==NULL) return 0;
+
+    int closed = 0;
+    int self = getpid();
+    take_mutex(fs, &fs->shm->recover_mutex);
+    int chunks = __atomic_load_n(&fs->num_open_file_chunks, __ATOMIC_ACQUIRE);
+    for(int c=0; c<chunks; c++){
+        for(int i=0; i<OPEN_FILE_CHUNK; i++){
+            struct open_file_entry *entry = &fs->open_file_chunks[c][i];
+            if(!__atomic_load_n(&entry->used, __ATOMIC_ACQUIRE) || entry->pid==self) continue;
+            if(kill(entry->pid, 0)==0 || errno!=ESRCH) continue; //alive (or not ours to signal)
+            int fd = (entry->generation << FD_INDEX_BITS) | (c*OPEN_FILE_CHUNK + i);
+            if(rsfs_close(fs, fd)==0) closed++;
+        }
+    }
+    pthread_mutex_unlock(&fs->shm->recover_mutex);
+
+    __atomic_fetch_add(&fs->shm_stats.recovered_files, closed, __ATOMIC_RELAXED);
+    return closed;
+}
@@ -0,0 +1,142 @@
+/*
+    per-operation counters, latency histograms and lock wait times of a file system;
+    counters are striped over RSFS_STATS_SLOTS cache-line-sized slots so that each thread
+    updates its own slot, and rsfs_stats_snapshot() sums the slots
+*/
+
+#include "def.h"
+#include <time.h>
+#include <errno.h>
+
+const char *rsfs_op_names[RSFS_NUM_OPS] = {
+    "rsfs_create", "rsfs_open", "rsfs_append", "rsfs_fseek", "rsfs_read", "rsfs_close",
+    "rsfs_write", "rsfs_cut", "rsfs_delete", "rsfs_fallocate", "rsfs_truncate", "rsfs_flush",
+    "rsfs_mkdir", "rsfs_rmdir", "rsfs_readdir", "rsfs_seal"
+};
+
+const char *rsfs_lock_names[RSFS_NUM_LOCKS] = {
+    "dir.mutex", "inodes_mutex", "inode_bitmap_mutex", "data_bitmap_mutex",
+    "open_file_table_mutex", "inode.rw_mutex", "inode.read_mutex", "entry_mutex",
+    "mutex_for_fs_stat", "inode.map_mutex", "block_class.mutex", "mmap_mutex"
+};
+
+static int next_slot; //slot handed to the next thread that records a stat
+static __thread int my_slot = -1; //slot of the calling thread; -1 until first use
+
+//helper: the calling thread's slot of fs
+static struct rsfs_stats_slot *get_slot(struct rsfs *fs){
+    if(my_slot<0) my_slot = __atomic_fetch_add(&next_slot, 1, __ATOMIC_RELAXED) % RSFS_STATS_SLOTS;
+    return &fs->stats_slots[my_slot];
+}
+
+static void add(uint64_t *counter, uint64_t value){
+    __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+static uint64_t load(uint64_t *counter){
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+//current time in ns
+uint64_t stats_now(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+//count a call of op that started at start and returned ret, moving bytes bytes
+void stats_record(struct rsfs *fs, int op, uint64_t start, int64_t ret, int64_t bytes){
+    struct rsfs_op_stats *s = &get_slot(fs)->ops[op];
+    uint64_t ns = stats_now() - start;
+
+    int bucket = 0;
+    while(bucket<RSFS_LAT_BUCKETS-1 && (ns>>(bucket+1))!=0) bucket++;
+
+    add(&s->calls, 1);
+    if(ret<0) add(&s->errors, 1);
+    if(bytes>0) add(&s->bytes, bytes);
+    add(&s->lat_hist[bucket], 1);
+}
+
+//lock mutex, counting the acquisition under lock_id;
+//only a contended acquisition reads the clock, to time the wait;
+//the trace gets an instant event for an acquisition, or a span covering the wait;
+//a robust mutex of a shared volume whose owner died is taken over (see shm.c)
+void lock_mutex(struct rsfs *fs, pthread_mutex_t *mutex, int lock_id){
+    struct rsfs_lock_stats *s = &get_slot(fs)->locks[lock_id];
+
+    int rc = pthread_mutex_trylock(mutex);
+    if(rc==0 || rc==EOWNERDEAD){
+        if(rc) mutex_owner_died(fs, mutex);
+        add(&s->acquisitions, 1);
+        TRACE(fs, 'i', rsfs_lock_names[lock_id]);
+        return;
+    }
+
+    TRACE(fs, 'B', rsfs_lock_names[lock_id]);
+    uint64_t start = stats_now();
+    if(pthread_mutex_lock(mutex)==EOWNERDEAD) mutex_owner_died(fs, mutex);
+    add(&s->acquisitions, 1);
+    add(&s->contended, 1);
+    add(&s->wait_ns, stats_now() - start);
+    TRACE(fs, 'E', rsfs_lock_names[lock_id]);
+}
+
+//count a dentry cache lookup that hit (1) or missed (0)
+void stats_dcache(struct rsfs *fs, int hit){
+    struct rsfs_dcache_stats *s = &get_slot(fs)->dcache;
+    add(hit ? &s->hits : &s->misses, 1);
+}
+
+//fill stats with the sum of the counters of fs and the current allocator state;
+//return 0 if succeed, or -1 if an argument is NULL
+int rsfs_stats_snapshot(struct rsfs *fs, struct rsfs_stats *stats){
+    if(fs==NULL || stats==NULL) return -1;
+
+    memset(stats, 0, sizeof(*stats));
+    for(int i=0; i<RSFS_STATS_SLOTS; i++){
+        struct rsfs_stats_slot *slot = &fs->stats_slots[i];
+        for(int op=0; op<RSFS_NUM_OPS; op++){
+            stats->ops[op].calls += load(&slot->ops[op].calls);
+            stats->ops[op].errors += load(&slot->ops[op].errors);
+            stats->ops[op].bytes += load(&slot->ops[op].bytes);
+            for(int b=0; b<RSFS_LAT_BUCKETS; b++) stats->ops[op].lat_hist[b] += load(&slot->ops[op].lat_hist[b]);
+        }
+        for(int l=0; l<RSFS_NUM_LOCKS; l++){
+            stats->locks[l].acquisitions += load(&slot->locks[l].acquisitions);
+            stats->locks[l].contended += load(&slot->locks[l].contended);
+            stats->locks[l].wait_ns += load(&slot->locks[l].wait_ns);
+        }
+        stats->dcache.hits += load(&slot->dcache.hits);
+        stats->dcache.misses += load(&slot->dcache.misses);
+    }
+
+    //allocator state; these mutexes are taken directly so the snapshot does not count itself
+    take_mutex(fs, &fs->inode_bitmap_mutex);
+    for(int i=0; i<NUM_INODES; i++) stats->free_inodes += !fs->inode_bitmap[i];
+    pthread_mutex_unlock(&fs->inode_bitmap_mutex);
+
+    take_mutex(fs, &fs->data_bitmap_mutex);
+    stats->free_dblocks = fs->num_free_dblocks;
+    stats->reserved_dblocks = fs->num_reserved_dblocks;
+    stats->log = fs->log_stats;
+    stats->log.clean_segments = log_clean_segments_locked(fs);
+    stats->defrag = fs->defrag_stats;
+    pthread_mutex_unlock(&fs->data_bitmap_mutex);
+
+    for(int c=0; c<RSFS_NUM_CLASSES; c++){
+        take_mutex(fs, &fs->classes[c].mutex);
+        stats->free_class_blocks[c] = fs->classes[c].num_free;
+        pthread_mutex_unlock(&fs->classes[c].mutex);
+    }
+
+    take_mutex(fs, &fs->mmap_mutex);
+    stats->mmap = fs->mmap_stats;
+    pthread_mutex_unlock(&fs->mmap_mutex);
+
+    stats->open_files = __atomic_load_n(&fs->num_open_files, __ATOMIC_RELAXED);
+    stats->shm.owner_deaths = __atomic_load_n(&fs->shm_stats.owner_deaths, __ATOMIC_RELAXED);
+    stats->shm.recovered_files = __atomic_load_n(&fs->shm_stats.recovered_files, __ATOMIC_RELAXED);
+
+    return 0;
+}
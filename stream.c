@@ -0,0 +1,205 @@
+/*
+    buffered streams over an open file, in the manner of stdio: small writes are collected in
+    the stream's buffer and reach the file as one rsfs_write() when it fills up, on rsfs_fflush()
+    and rsfs_fclose(), and, in line-buffered mode, at every newline; reads are served from a
+    buffer refilled in whole blocks;
+    a stream opened with RSFS_APPEND starts at the end of the file, and every flush first moves
+    the buffered range to the current end, as stdio's "a" mode does;
+    a stream keeps its own position and is used by one thread at a time; like stdio, it does not
+    see writes made to the file through other descriptors while it holds buffered data;
+    a flush the file takes only part of keeps the rest buffered and marks the stream as failed:
+    later writes are refused, flushes retry the rest, and rsfs_fclose() reports the failure
+*/
+
+#include "def.h"
+
+//helper: the length of the file of stream
+static int64_t file_end(struct rsfs_stream *stream){
+    struct rsfs *fs = stream->fs;
+    struct open_file_entry *ofe = get_open_file_entry(fs, stream->fd);
+    if(ofe==NULL) return stream->pos;
+    struct inode *ino = &fs->inodes[ofe->inode_number];
+    lock_mutex(fs, &fs->inodes_mutex, RSFS_LOCK_INODES);
+    int64_t length = ino->length;
+    pthread_mutex_unlock(&fs->inodes_mutex);
+    return length;
+}
+
+//open the file at path with access_flag (RSFS_RDONLY, RSFS_RDWR or RSFS_APPEND) as a fully buffered
+//stream with a buffer of RSFS_STREAM_BUFSIZE bytes; return the stream, or NULL if it fails
+struct rsfs_stream *rsfs_fopen(struct rsfs *fs, char *path, int access_flag){
+    if(access_flag!=RSFS_RDONLY && access_flag!=RSFS_RDWR && access_flag!=RSFS_APPEND) return NULL;
+    int append = (access_flag==RSFS_APPEND);
+    if(append) access_flag = RSFS_RDWR;
+
+    struct rsfs_stream *stream = malloc(sizeof(struct rsfs_stream));
+    if(stream==NULL) return NULL;
+    memset(stream, 0, sizeof(struct rsfs_stream));
+
+    stream->buf = malloc(RSFS_STREAM_BUFSIZE);
+    if(stream->buf==NULL){
+        free(stream);
+        return NULL;
+    }
+    stream->fd = rsfs_open(fs, path, access_flag);
+    if(stream->fd<0){
+        free(stream->buf);
+        free(stream);
+        return NULL;
+    }
+    stream->fs = fs;
+    stream->access_flag = access_flag;
+    stream->append = append;
+    stream->mode = RSFS_IOFBF;
+    stream->size = RSFS_STREAM_BUFSIZE;
+    if(append) stream->pos = file_end(stream);
+    return stream;
+}
+
+//set the buffering mode (RSFS_IOFBF, RSFS_IOLBF or RSFS_IONBF) and the buffer size of stream;
+//only allowed before the first read or write; return 0 if succeed, or -1 otherwise
+int rsfs_setvbuf(struct rsfs_stream *stream, int mode, int size){
+    if(mode!=RSFS_IOFBF && mode!=RSFS_IOLBF && mode!=RSFS_IONBF) return -1;
+    if(stream->used || size<1) return -1;
+
+    char *buf = realloc(stream->buf, size);
+    if(buf==NULL) return -1;
+    stream->buf = buf;
+    stream->size = size;
+    stream->mode = mode;
+    return 0;
+}
+
+//helper: move the descriptor of stream to offset; rsfs_fseek() keeps the old position when offset is
+//past the end of the file; return 0 if succeed, or -1 otherwise
+static int seek_fd(struct rsfs_stream *stream, int64_t offset){
+    return rsfs_fseek(stream->fs, stream->fd, offset)==offset ? 0 : -1;
+}
+
+//write the buffered data of stream to the file with one rsfs_write(), at the end of the file in append mode;
+//return 0 if succeed, or -1 if the file took less: the bytes not written stay buffered for the next flush,
+//and the stream is marked as failed
+int rsfs_fflush(struct rsfs_stream *stream){
+    if(stream->wlen==0) return 0;
+
+    if(stream->append){
+        stream->wstart = file_end(stream); //the file may have been cut since the data was buffered
+        stream->pos = stream->wstart + stream->wlen;
+    }
+    int64_t written = 0;
+    if(seek_fd(stream, stream->wstart)==0) written = rsfs_write(stream->fs, stream->fd, stream->buf, stream->wlen);
+    if(written==stream->wlen){
+        stream->wlen = 0;
+        return 0;
+    }
+
+    //keep what the file did not take at the front of the buffer, so a later flush can retry it
+    if(written<0) written = 0;
+    memmove(stream->buf, stream->buf + written, stream->wlen - written);
+    stream->wstart += written;
+    stream->wlen -= (int)written;
+    stream->error = 1;
+    return -1;
+}
+
+//helper: whether buf[0..size) holds a newline
+static int has_newline(const char *buf, int size){
+    return memchr(buf, '\n', size)!=NULL;
+}
+
+//write size bytes of buf at the position of stream; return the number of bytes taken, or -1 if it fails
+//or an earlier flush of the stream failed
+int64_t rsfs_fwrite(struct rsfs_stream *stream, void *buf, int64_t size){
+    if(stream->access_flag!=RSFS_RDWR || size<0 || stream->error) return -1;
+    if(size==0) return 0;
+    stream->used = 1;
+    stream->rlen = 0; //the read buffer may hold the old bytes
+    if(stream->append && stream->wlen==0) stream->pos = file_end(stream); //wherever rsfs_fsetpos() left it
+
+    //the buffer holds one contiguous range; a write somewhere else goes after what is buffered
+    if(stream->wlen>0 && stream->wstart+stream->wlen!=stream->pos){
+        if(rsfs_fflush(stream)<0) return -1;
+    }
+
+    //unbuffered, or too large to be worth copying: write it through
+    if(stream->mode==RSFS_IONBF || size>=stream->size){
+        if(rsfs_fflush(stream)<0) return -1;
+        if(seek_fd(stream, stream->pos)<0) return -1;
+        int64_t written = rsfs_write(stream->fs, stream->fd, buf, size);
+        if(written<size) stream->error = 1;
+        if(written<0) return -1;
+        stream->pos += written;
+        return written;
+    }
+
+    if(stream->wlen+size>stream->size && rsfs_fflush(stream)<0) return -1;
+    if(stream->wlen==0) stream->wstart = stream->pos;
+    memcpy(stream->buf + stream->wlen, buf, size);
+    stream->wlen += size;
+    stream->pos += size;
+
+    //the bytes are taken either way: if this flush fails they stay buffered, and the error is reported
+    //by the next write, flush or close
+    if(stream->wlen==stream->size || (stream->mode==RSFS_IOLBF && has_newline((char *)buf, size))){
+        rsfs_fflush(stream);
+    }
+    return size;
+}
+
+//read up to size bytes at the position of stream into buf; the read buffer is refilled in whole blocks;
+//return the number of bytes read (0 at the end of the file), or -1 if it fails
+int64_t rsfs_fread(struct rsfs_stream *stream, void *buf, int64_t size){
+    if(size<0) return -1;
+    if(size==0) return 0;
+    stream->used = 1;
+    if(rsfs_fflush(stream)<0) return -1; //reads see what this stream wrote
+
+    //the block-aligned part of the buffer used for reading
+    int cap = stream->size - stream->size % BLOCK_SIZE;
+    if(stream->mode==RSFS_IONBF || cap==0){
+        if(seek_fd(stream, stream->pos)<0) return 0; //at or past the end of the file
+        int64_t got = rsfs_read(stream->fs, stream->fd, buf, size);
+        if(got>0) stream->pos += got;
+        return got;
+    }
+
+    int64_t done = 0;
+    while(done<size){
+        if(stream->pos<stream->rstart || stream->pos>=stream->rstart+stream->rlen){
+            //refill with the blocks starting at the one holding the position
+            stream->rstart = stream->pos - stream->pos % BLOCK_SIZE;
+            stream->rlen = 0;
+            if(seek_fd(stream, stream->rstart)<0) break;
+            int got = rsfs_read(stream->fs, stream->fd, stream->buf, cap);
+            if(got<0) return done ? done : -1;
+            stream->rlen = got;
+            if(stream->pos>=stream->rstart+stream->rlen) break; //end of file
+        }
+        int64_t n = stream->rstart + stream->rlen - stream->pos;
+        if(n>size-done) n = size-done;
+        memcpy((char *)buf + done, stream->buf + (stream->pos - stream->rstart), n);
+        done += n;
+        stream->pos += n;
+    }
+    return done;
+}
+
+//move the position of stream to offset; return 0 if succeed, or -1 if it is past the end of the file
+int rsfs_fsetpos(struct rsfs_stream *stream, int64_t offset){
+    if(offset<0) return -1;
+    if(rsfs_fflush(stream)<0) return -1;
+    if(seek_fd(stream, offset)<0) return -1;
+    stream->pos = offset;
+    return 0;
+}
+
+//flush and close stream and release it; return 0 if succeed, or -1 if the last flush or an earlier one failed,
+//in which case the bytes still buffered are lost
+int rsfs_fclose(struct rsfs_stream *stream){
+    int ret = rsfs_fflush(stream);
+    if(stream->error) ret = -1;
+    if(rsfs_close(stream->fs, stream->fd)<0) ret = -1;
+    free(stream->buf);
+    free(stream);
+    return ret;
+}
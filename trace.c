@@ -0,0 +1,89 @@
+/*
+    event tracing: every thread appends timestamped events to its own ring of
+    TRACE_RING_SIZE events, so recording takes no lock and shares no cache line;
+    rsfs_trace_dump() writes the rings of all threads as Chrome trace JSON
+    (load it in chrome://tracing or ui.perfetto.dev)
+*/
+
+#include "def.h"
+
+int trace_enabled; //1 while tracing is on
+
+struct trace_record{
+    uint64_t ts; //time in ns (stats_now)
+    const char *name;
+    int volume; //id of the volume
+    char phase; //'B', 'E' or 'i'
+};
+
+//ring of one thread; only the owner thread writes it
+struct trace_ring{
+    struct trace_record records[TRACE_RING_SIZE];
+    uint64_t head; //number of records ever written; published with release order
+    int tid; //number of the thread within the trace
+    struct trace_ring *next; //list of all rings
+};
+
+static struct trace_ring *rings; //all rings ever created; rings are kept after their thread exits
+static int next_tid;
+static __thread struct trace_ring *my_ring; //ring of the calling thread; NULL until its first event
+
+//helper: create the calling thread's ring and push it on the list of rings
+static struct trace_ring *new_ring(){
+    struct trace_ring *ring = (struct trace_ring *)calloc(1, sizeof(struct trace_ring));
+    if(ring==NULL) return NULL;
+    ring->tid = __atomic_fetch_add(&next_tid, 1, __ATOMIC_RELAXED);
+
+    struct trace_ring *head = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+    do{
+        ring->next = head;
+    }while(!__atomic_compare_exchange_n(&rings, &head, ring, 1, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+
+    return ring;
+}
+
+//append an event to the calling thread's ring; the oldest event is overwritten when it is full
+void trace_event(struct rsfs *fs, char phase, const char *name){
+    if(my_ring==NULL){
+        my_ring = new_ring();
+        if(my_ring==NULL) return;
+    }
+    uint64_t head = my_ring->head;
+    struct trace_record *r = &my_ring->records[head % TRACE_RING_SIZE];
+    r->ts = stats_now();
+    r->name = name;
+    r->volume = fs ? fs->id : 0;
+    r->phase = phase;
+    __atomic_store_n(&my_ring->head, head+1, __ATOMIC_RELEASE);
+}
+
+//switch tracing on (1) or off (0); events already recorded are kept
+void rsfs_trace_enable(int on){
+    __atomic_store_n(&trace_enabled, on ? 1 : 0, __ATOMIC_RELAXED);
+}
+
+//write the events of all rings to path in the Chrome trace event format;
+//events recorded while the dump runs may show up torn, so switch tracing off first;
+//return 0 if succeed, or -1 if path cannot be written
+int rsfs_trace_dump(const char *path){
+    FILE *f = fopen(path, "w");
+    if(f==NULL) return -1;
+
+    fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    int first = 1;
+    for(struct trace_ring *ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring; ring = ring->next){
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t start = (head > TRACE_RING_SIZE) ? head - TRACE_RING_SIZE : 0;
+        for(uint64_t i=start; i<head; i++){
+            struct trace_record *r = &ring->records[i % TRACE_RING_SIZE];
+            fprintf(f, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%llu.%03llu,\"pid\":%d,\"tid\":%d%s}",
+                    first ? "" : ",\n", r->name, r->phase,
+                    (unsigned long long)(r->ts / 1000), (unsigned long long)(r->ts % 1000),
+                    r->volume, ring->tid, r->phase=='i' ? ",\"s\":\"t\"" : "");
+            first = 0;
+        }
+    }
+    fprintf(f, "\n]}\n");
+
+    return fclose(f)==0 ? 0 : -1;
+}